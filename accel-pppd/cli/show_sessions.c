@@ -16,6 +16,8 @@
 #include "memdebug.h"
 
 #define CELL_SIZE 128
+#define ROW_CHUNK_SIZE (64 * 1024)
+#define OUT_BUF_SIZE (16 * 1024)
 #define DEF_COLUMNS "ifname,username,calling-sid,ip,rate-limit,type,comp,state,uptime"
 
 struct column_t
@@ -36,17 +38,18 @@ struct col_t
 
 struct row_t
 {
-	struct list_head entry;
 	char *match_key;
 	char *order_key;
-	struct list_head cell_list;
+	int idx;
+	char data[0];
 };
 
-struct cell_t
+struct row_chunk_t
 {
 	struct list_head entry;
-	struct col_t *col;
-	char buf[CELL_SIZE + 1];
+	int pos;
+	int size;
+	char buf[0];
 };
 
 static LIST_HEAD(col_list);
@@ -91,34 +94,75 @@ static struct column_t *find_column(const char *name)
 	return NULL;
 }
 
-static void free_row(struct row_t *row)
+static void free_rows(struct list_head *chunk_list, struct row_t **rows)
 {
-	struct cell_t *cell;
+	struct row_chunk_t *chunk;
 
-	while (!list_empty(&row->cell_list)) {
-		cell = list_entry(row->cell_list.next, typeof(*cell), entry);
-		list_del(&cell->entry);
-		_free(cell);
+	while (!list_empty(chunk_list)) {
+		chunk = list_entry(chunk_list->next, typeof(*chunk), entry);
+		list_del(&chunk->entry);
+		_free(chunk);
 	}
 
-	_free(row);
+	if (rows)
+		_free(rows);
 }
 
-static void insert_row(struct list_head *list, struct row_t *row)
+/* Rows are packed back to back into large chunks, so a snapshot of
+ * many sessions costs a handful of allocations instead of one per cell */
+static struct row_t *alloc_row(struct list_head *chunk_list, int size)
 {
-	struct row_t *row2, *row3;
+	struct row_chunk_t *chunk = NULL;
+	struct row_t *row;
 
-	row3 = NULL;
-	list_for_each_entry(row2, list, entry) {
-		if (strcmp(row->order_key, row2->order_key) <= 0) {
-			row3 = row2;
-			break;
-		}
+	size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+	if (!list_empty(chunk_list)) {
+		chunk = list_entry(chunk_list->prev, typeof(*chunk), entry);
+		if (chunk->size - chunk->pos < size)
+			chunk = NULL;
 	}
-	if (row3)
-		list_add_tail(&row->entry, &row3->entry);
-	else
-		list_add_tail(&row->entry, list);
+
+	if (!chunk) {
+		int n = size > ROW_CHUNK_SIZE ? size : ROW_CHUNK_SIZE;
+
+		chunk = _malloc(sizeof(*chunk) + n);
+		if (!chunk)
+			return NULL;
+		chunk->pos = 0;
+		chunk->size = n;
+		list_add_tail(&chunk->entry, chunk_list);
+	}
+
+	row = (struct row_t *)(chunk->buf + chunk->pos);
+	chunk->pos += size;
+
+	return row;
+}
+
+static int row_cmp(const void *a, const void *b)
+{
+	const struct row_t *r1 = *(const struct row_t **)a;
+	const struct row_t *r2 = *(const struct row_t **)b;
+	int r = strcmp(r1->order_key, r2->order_key);
+
+	if (r)
+		return r;
+
+	return r1->idx - r2->idx;
+}
+
+static int flush_out(void *cli, char *out, int *len)
+{
+	int r = 0;
+
+	if (*len) {
+		out[*len] = 0;
+		r = cli_send(cli, out);
+		*len = 0;
+	}
+
+	return r;
 }
 
 static int show_ses_exec(const char *cmd, char * const *f, int f_cnt, void *cli)
@@ -132,16 +176,16 @@ static int show_ses_exec(const char *cmd, char * const *f, int f_cnt, void *cli)
 	int pcre_offset;
 	struct column_t *column;
 	struct col_t *col;
-	struct row_t *row;
-	struct cell_t *cell;
-	char *ptr1, *ptr2;
+	struct row_t *row, **rows = NULL, **rows2;
+	char *ptr1, *ptr2, *cells = NULL, *cell;
 	int i, n, total_width, def_columns = 0;
+	int col_cnt = 0, row_cnt = 0, row_size = 0, len, buf_size;
+	int match_off, order_off;
 	struct ap_session *ses;
 	char *buf = NULL;
 	int match_key_f = 0, order_key_f = 0;
 	LIST_HEAD(c_list);
-	LIST_HEAD(r_list);
-	LIST_HEAD(t_list);
+	LIST_HEAD(chunk_list);
 
 	for (i = 2; i < f_cnt; i++) {
 		if (!strcmp(f[i], "order")) {
@@ -226,52 +270,71 @@ static int show_ses_exec(const char *cmd, char * const *f, int f_cnt, void *cli)
 		list_add_tail(&col->entry, &c_list);
 	}
 
+	list_for_each_entry(col, &c_list, entry)
+		col_cnt++;
+
+	cells = _malloc(col_cnt * (CELL_SIZE + 1));
+	if (!cells)
+		goto oom;
+
+	/* Only format cells under the lock, everything else is done on the snapshot */
 	pthread_rwlock_rdlock(&ses_lock);
 	list_for_each_entry(ses, &ses_list, entry) {
+		if (row_cnt == row_size) {
+			n = row_size ? row_size * 2 : 1024;
+			rows2 = _realloc(rows, n * sizeof(*rows));
+			if (!rows2) {
+				pthread_rwlock_unlock(&ses_lock);
+				goto oom;
+			}
+			rows = rows2;
+			row_size = n;
+		}
+
 		stats_set = 0;
-		row = _malloc(sizeof(*row));
-		if (!row)
-			goto oom;
-		memset(row, 0, sizeof(*row));
-		INIT_LIST_HEAD(&row->cell_list);
-		if (match_key || order_key)
-			list_add_tail(&row->entry, &t_list);
-		else
-			list_add_tail(&row->entry, &r_list);
+		cell = cells;
+		match_off = order_off = 0;
 		list_for_each_entry(col, &c_list, entry) {
-			cell = _malloc(sizeof(*cell));
-			if (!cell)
-				goto oom;
-			cell->col = col;
-			list_add_tail(&cell->entry, &row->cell_list);
-			col->column->print(ses, cell->buf);
-			n = strlen(cell->buf);
-			if (n > col->width)
-				col->width = n;
-			if (col->column == order_key)
-				row->order_key = cell->buf;
 			if (col->column == match_key)
-				row->match_key = cell->buf;
+				match_off = cell - cells;
+			if (col->column == order_key)
+				order_off = cell - cells;
+			col->column->print(ses, cell);
+			cell[CELL_SIZE] = 0;
+			cell = strchr(cell, 0) + 1;
+		}
+
+		len = cell - cells;
+		row = alloc_row(&chunk_list, sizeof(*row) + len);
+		if (!row) {
+			pthread_rwlock_unlock(&ses_lock);
+			goto oom;
 		}
+		memcpy(row->data, cells, len);
+		row->match_key = row->data + match_off;
+		row->order_key = row->data + order_off;
+		row->idx = row_cnt;
+		rows[row_cnt++] = row;
 	}
 	pthread_rwlock_unlock(&ses_lock);
 
-	if (order_key || match_key) {
-		while(!list_empty(&t_list)) {
-			row = list_entry(t_list.next, typeof(*row), entry);
-			list_del(&row->entry);
-			if (match_key) {
-				if (pcre_exec(re, NULL, row->match_key, strlen(row->match_key), 0, 0, NULL, 0) < 0) {
-					free_row(row);
-					continue;
-				}
-			}
-			if (order_key)
-				insert_row(&r_list, row);
-			else
-				list_add_tail(&row->entry, &r_list);
+	for (i = 0, n = 0; i < row_cnt; i++) {
+		row = rows[i];
+		if (re && pcre_exec(re, NULL, row->match_key, strlen(row->match_key), 0, 0, NULL, 0) < 0)
+			continue;
+		rows[n++] = row;
+		cell = row->data;
+		list_for_each_entry(col, &c_list, entry) {
+			len = strlen(cell);
+			if (!col->hidden && len > col->width)
+				col->width = len;
+			cell += len + 1;
 		}
 	}
+	row_cnt = n;
+
+	if (order_key)
+		qsort(rows, row_cnt, sizeof(*rows), row_cmp);
 
 	total_width = -1;
 	list_for_each_entry(col, &c_list, entry) {
@@ -282,9 +345,10 @@ static int show_ses_exec(const char *cmd, char * const *f, int f_cnt, void *cli)
 
 	if (total_width < 0)
 		/* No column to print */
-		goto early_out;
+		goto out;
 
-	buf = _malloc(total_width + 3);
+	buf_size = total_width + 3 > OUT_BUF_SIZE ? total_width + 3 : OUT_BUF_SIZE;
+	buf = _malloc(buf_size);
 	if (!buf)
 		goto oom;
 
@@ -326,34 +390,47 @@ static int show_ses_exec(const char *cmd, char * const *f, int f_cnt, void *cli)
 	}
 
 	strcpy(ptr1 - 1, "\r\n");
-	cli_send(cli, buf);
-
-	while (!list_empty(&r_list)) {
-		row = list_entry(r_list.next, typeof(*row), entry);
-		ptr1 = buf;
-		list_for_each_entry(cell, &row->cell_list, entry) {
-			if (cell->col->hidden)
-				continue;
-			ptr2 = ptr1;
-			sprintf(ptr1, " %s ", cell->buf);
-			ptr1 = strchr(ptr1, 0);
-			n = ptr1 - ptr2;
-			if (n - 2 < cell->col->width) {
-				memset(ptr1, ' ', cell->col->width + 2 - (ptr1 - ptr2));
-				ptr1 += cell->col->width + 2 - (ptr1 - ptr2);
+	if (cli_send(cli, buf))
+		goto out;
+
+	/* Stream rows in batches of whole lines, stop if the client went away */
+	len = 0;
+	for (i = 0; i < row_cnt; i++) {
+		if (buf_size - len < total_width + 3 && flush_out(cli, buf, &len))
+			goto out;
+
+		row = rows[i];
+		cell = row->data;
+		ptr1 = buf + len;
+		list_for_each_entry(col, &c_list, entry) {
+			n = strlen(cell);
+			if (!col->hidden) {
+				sprintf(ptr1, " %s ", cell);
+				ptr1 += n + 2;
+				if (n < col->width) {
+					memset(ptr1, ' ', col->width - n);
+					ptr1 += col->width - n;
+				}
+				*ptr1 = '|';
+				ptr1++;
 			}
-			*ptr1 = '|';
-			ptr1++;
+			cell += n + 1;
 		}
 		strcpy(ptr1 - 1, "\r\n");
-		cli_send(cli, buf);
-		list_del(&row->entry);
-		free_row(row);
+		len = ptr1 + 1 - buf;
 	}
 
-	_free(buf);
+	flush_out(cli, buf, &len);
 
 out:
+	free_rows(&chunk_list, rows);
+
+	if (cells)
+		_free(cells);
+
+	if (buf)
+		_free(buf);
+
 	while (!list_empty(&c_list)) {
 		col = list_entry(c_list.next, typeof(*col), entry);
 		list_del(&col->entry);
@@ -366,16 +443,7 @@ out:
 	return CLI_CMD_OK;
 
 oom:
-	cli_send(cli, "out of memory");
-early_out:
-	if (buf)
-		_free(buf);
-
-	while (!list_empty(&t_list)) {
-		row = list_entry(t_list.next, typeof(*row), entry);
-		list_del(&row->entry);
-		free_row(row);
-	}
+	cli_send(cli, "out of memory\r\n");
 	goto out;
 }
 
@@ -13,10 +13,20 @@
 #include "cli.h"
 #include "utils.h"
 #include "log.h"
+#include "mempool.h"
 #include "memdebug.h"
 
 void core_restart(int);
 
+static void show_mempool_stat(struct mempool_pool_stat_t *st, void *client)
+{
+	if (!st->alloc)
+		return;
+
+	cli_sendv(client, "  size %i: alloc %lu, hit %lu%%, cached %i/%i\r\n", st->size, st->alloc,
+		  st->hit * 100 / st->alloc, st->cached, st->objects);
+}
+
 static int show_stat_exec(const char *cmd, char * const *fields, int fields_cnt, void *client)
 {
 	struct timespec ts;
@@ -64,11 +74,17 @@ static int show_stat_exec(const char *cmd, char * const *fields, int fields_cnt,
 	cli_sendv(client, "  context_count: %u\r\n", triton_stat.context_count);
 	cli_sendv(client, "  context_sleeping: %u\r\n", triton_stat.context_sleeping);
 	cli_sendv(client, "  context_pending: %u\r\n", triton_stat.context_pending);
+	cli_sendv(client, "  context_stolen: %u\r\n", triton_stat.context_stolen);
 	cli_sendv(client, "  md_handler_count: %u\r\n", triton_stat.md_handler_count);
 	cli_sendv(client, "  md_handler_pending: %u\r\n", triton_stat.md_handler_pending);
 	cli_sendv(client, "  timer_count: %u\r\n", triton_stat.timer_count);
 	cli_sendv(client, "  timer_pending: %u\r\n", triton_stat.timer_pending);
 
+#ifndef MEMDEBUG
+	cli_send(client, "mempool:\r\n");
+	mempool_walk_stat(show_mempool_stat, client);
+#endif
+
 //===========
 	cli_send(client, "sessions:\r\n");
 	cli_sendv(client, "  starting: %u\r\n", ap_session_stat.starting);
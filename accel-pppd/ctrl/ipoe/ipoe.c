@@ -141,6 +141,10 @@ static int conf_attr_l4_redirect_ipset;
 static const char *conf_attr_dhcp_opt82;
 static const char *conf_attr_dhcp_opt82_remote_id;
 static const char *conf_attr_dhcp_opt82_circuit_id;
+static struct rad_dict_attr_t *attr_dhcp_opt82;
+static struct rad_dict_attr_t *attr_dhcp_opt82_remote_id;
+static struct rad_dict_attr_t *attr_dhcp_opt82_circuit_id;
+static struct rad_dict_attr_t *attr_framed_ip_address;
 #endif
 static int conf_l4_redirect_table;
 static int conf_l4_redirect_on_reject;
@@ -623,10 +627,7 @@ static void auth_result(struct ipoe_session *ses, int r)
 			goto cont;
 		}
 
-		pthread_rwlock_wrlock(&ses_lock);
-		ses->ses.username = username;
-		ses->ses.terminate_cause = TERM_AUTH_ERROR;
-		pthread_rwlock_unlock(&ses_lock);
+		ap_session_set_failed_username(&ses->ses, username);
 		if (conf_ppp_verbose)
 			log_ppp_warn("authentication failed\n");
 		if (conf_l4_redirect_on_reject && !ses->dhcpv4_request)
@@ -2438,15 +2439,15 @@ static int ipoe_rad_send_acct_request(struct rad_plugin_t *rad, struct rad_packe
 		return 0;
 
 	if (conf_attr_dhcp_opt82 &&
-		rad_packet_add_octets(pack, conf_vendor_str, conf_attr_dhcp_opt82, ses->relay_agent->data, ses->relay_agent->len))
+		rad_packet_add_attr_octets(pack, attr_dhcp_opt82, ses->relay_agent->data, ses->relay_agent->len))
 		return -1;
 
 	if (conf_attr_dhcp_opt82_remote_id && ses->agent_remote_id &&
-		rad_packet_add_octets(pack, conf_vendor_str, conf_attr_dhcp_opt82_remote_id, ses->agent_remote_id + 1, *ses->agent_remote_id))
+		rad_packet_add_attr_octets(pack, attr_dhcp_opt82_remote_id, ses->agent_remote_id + 1, *ses->agent_remote_id))
 		return -1;
 
 	if (conf_attr_dhcp_opt82_circuit_id && ses->agent_circuit_id &&
-		rad_packet_add_octets(pack, conf_vendor_str, conf_attr_dhcp_opt82_circuit_id, ses->agent_circuit_id + 1, *ses->agent_circuit_id))
+		rad_packet_add_attr_octets(pack, attr_dhcp_opt82_circuit_id, ses->agent_circuit_id + 1, *ses->agent_circuit_id))
 		return -1;
 
 	return 0;
@@ -2460,7 +2461,7 @@ static int ipoe_rad_send_auth_request(struct rad_plugin_t *rad, struct rad_packe
 		return -1;
 
 	if (ses->yiaddr)
-		rad_packet_add_ipaddr(pack, NULL, "Framed-IP-Address", ses->yiaddr);
+		rad_packet_add_attr_ipaddr(pack, attr_framed_ip_address, ses->yiaddr);
 
 	return 0;
 }
@@ -3407,6 +3408,11 @@ static void load_radius_attrs(void)
 	conf_attr_dhcp_opt82 = conf_get_opt("ipoe", "attr-dhcp-opt82");
 	conf_attr_dhcp_opt82_remote_id = conf_get_opt("ipoe", "attr-dhcp-opt82-remote-id");
 	conf_attr_dhcp_opt82_circuit_id = conf_get_opt("ipoe", "attr-dhcp-opt82-circuit-id");
+
+	attr_dhcp_opt82 = conf_attr_dhcp_opt82 ? rad_dict_attr(conf_vendor_str, conf_attr_dhcp_opt82) : NULL;
+	attr_dhcp_opt82_remote_id = conf_attr_dhcp_opt82_remote_id ? rad_dict_attr(conf_vendor_str, conf_attr_dhcp_opt82_remote_id) : NULL;
+	attr_dhcp_opt82_circuit_id = conf_attr_dhcp_opt82_circuit_id ? rad_dict_attr(conf_vendor_str, conf_attr_dhcp_opt82_circuit_id) : NULL;
+	attr_framed_ip_address = rad_dict_attr(NULL, "Framed-IP-Address");
 }
 #endif
 
@@ -0,0 +1,130 @@
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "log.h"
+#include "utils.h"
+#include "memdebug.h"
+
+#include "l2tp.h"
+
+#define CHUNK_SIZE (1 << L2TP_IDMAP_CHUNK_SHIFT)
+#define CHUNK_WORDS (CHUNK_SIZE / 64)
+
+/* Random values are read from urandom in blocks, so IDs stay as
+ * unpredictable as with a read per ID, for a fraction of syscalls */
+static __thread uint16_t rnd_buf[256];
+static __thread unsigned int rnd_pos = sizeof(rnd_buf) / sizeof(rnd_buf[0]);
+
+static int random_id(uint16_t *id)
+{
+	int err;
+
+	if (rnd_pos == sizeof(rnd_buf) / sizeof(rnd_buf[0])) {
+		if (u_randbuf(rnd_buf, sizeof(rnd_buf), &err) < 0) {
+			if (err)
+				log_error("l2tp: reading from urandom failed: %s\n",
+					  strerror(err));
+			else
+				log_error("l2tp: end of file reached while"
+					  " reading from urandom\n");
+			return -1;
+		}
+		rnd_pos = 0;
+	}
+
+	*id = rnd_buf[rnd_pos++];
+
+	return 0;
+}
+
+/* First clear bit at or after 'bit', wrapping around chunk's end */
+static int chunk_find(const uint64_t *chunk, unsigned int bit)
+{
+	unsigned int w = bit / 64, i;
+	uint64_t x = ~chunk[w] & (~0ULL << (bit % 64));
+
+	for (i = 0; i <= CHUNK_WORDS; i++) {
+		if (x)
+			return w * 64 + __builtin_ctzll(x);
+		w = (w + 1) % CHUNK_WORDS;
+		x = ~chunk[w];
+	}
+
+	return -1;
+}
+
+/* Allocates an ID in range 1..65535, starting the search at a random
+ * position. Returns -1 if all IDs are in use or on error. */
+int l2tp_idmap_alloc(struct l2tp_idmap_t *map)
+{
+	uint16_t start;
+	unsigned int c, i;
+	int bit;
+
+	if (random_id(&start) < 0)
+		return -1;
+
+	for (i = 0; i < L2TP_IDMAP_CHUNKS; i++) {
+		c = ((start >> L2TP_IDMAP_CHUNK_SHIFT) + i) % L2TP_IDMAP_CHUNKS;
+
+		if (map->used[c] == CHUNK_SIZE)
+			continue;
+
+		if (!map->chunk[c]) {
+			map->chunk[c] = _malloc(CHUNK_WORDS * sizeof(uint64_t));
+			if (!map->chunk[c]) {
+				log_emerg("l2tp: out of memory\n");
+				return -1;
+			}
+			memset(map->chunk[c], 0, CHUNK_WORDS * sizeof(uint64_t));
+
+			/* ID 0 is reserved */
+			if (c == 0) {
+				map->chunk[0][0] = 1;
+				map->used[0] = 1;
+			}
+		}
+
+		bit = chunk_find(map->chunk[c], i ? 0 : start % CHUNK_SIZE);
+		if (bit < 0)
+			continue;
+
+		map->chunk[c][bit / 64] |= 1ULL << (bit % 64);
+		map->used[c]++;
+
+		return (c << L2TP_IDMAP_CHUNK_SHIFT) + bit;
+	}
+
+	return -1;
+}
+
+void l2tp_idmap_free(struct l2tp_idmap_t *map, uint16_t id)
+{
+	unsigned int c = id >> L2TP_IDMAP_CHUNK_SHIFT;
+	unsigned int bit = id % CHUNK_SIZE;
+	uint64_t *chunk = map->chunk[c];
+
+	if (id == 0 || !chunk || !(chunk[bit / 64] & (1ULL << (bit % 64))))
+		return;
+
+	chunk[bit / 64] &= ~(1ULL << (bit % 64));
+
+	if (--map->used[c] == (c == 0)) {
+		_free(chunk);
+		map->chunk[c] = NULL;
+		map->used[c] = 0;
+	}
+}
+
+void l2tp_idmap_destroy(struct l2tp_idmap_t *map)
+{
+	unsigned int c;
+
+	for (c = 0; c < L2TP_IDMAP_CHUNKS; c++) {
+		if (map->chunk[c])
+			_free(map->chunk[c]);
+	}
+
+	memset(map, 0, sizeof(*map));
+}
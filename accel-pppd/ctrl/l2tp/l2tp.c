@@ -1,5 +1,4 @@
 #include <unistd.h>
-#include <search.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
@@ -8,6 +7,7 @@
 #include <fcntl.h>
 #include <time.h>
 #include <pthread.h>
+#include <sched.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
@@ -73,6 +73,15 @@
 #define DEFAULT_RTIMEOUT 1
 #define DEFAULT_RTIMEOUT_CAP 16
 #define DEFAULT_RETRANSMIT 5
+#define DEFAULT_RECV_BATCH 16
+#define RECV_BATCH_MAX 64
+
+#define PEER_HASH_BITS 10
+
+#define SESS_TAB_MIN_SIZE 8
+
+/* Tunnel slots scanned per l2tp_lock hold by "show stat" */
+#define STAT_SCAN_CHUNK 1024
 
 int conf_verbose = 0;
 int conf_hide_avps = 0;
@@ -81,6 +90,8 @@ static uint16_t conf_recv_window = DEFAULT_RECV_WINDOW;
 static int conf_ppp_max_mtu = DEFAULT_PPP_MAX_MTU;
 static int conf_port = L2TP_PORT;
 static int conf_ephemeral_ports = 0;
+static int conf_shared_socket = 0;
+static int conf_recv_batch = DEFAULT_RECV_BATCH;
 static int conf_timeout = 60;
 static int conf_rtimeout = DEFAULT_RTIMEOUT;
 static int conf_rtimeout_cap = DEFAULT_RTIMEOUT_CAP;
@@ -115,6 +126,17 @@ struct l2tp_serv_t
 	struct triton_context_t ctx;
 	struct triton_md_handler_t hnd;
 	struct sockaddr_in addr;
+	uint8_t *buf;
+};
+
+/* Raw control message received on the shared socket,
+ * queued to the tunnel it belongs to */
+struct l2tp_dgram_t
+{
+	struct list_head entry;
+	struct sockaddr_in addr;
+	int len;
+	uint8_t data[0];
 };
 
 struct l2tp_sess_t
@@ -131,6 +153,10 @@ struct l2tp_sess_t
 	uint16_t recv_seq:1;
 	int reorder_timeout;
 
+	/* kernel session parameters, set by the tunnel before starting
+	 * the data channel, which opens the PPPoL2TP socket */
+	struct sockaddr_pppol2tp pppox_addr;
+
 	struct triton_timer_t timeout_timer;
 	struct list_head send_queue;
 
@@ -180,12 +206,30 @@ struct l2tp_conn_t
 
 	unsigned int ref_count;
 	int state;
-	void *sessions;
+	/* open addressing hash of sessions, indexed by sid */
+	struct l2tp_sess_t **sessions;
+	unsigned int sess_tab_size;
 	unsigned int sess_count;
+	struct l2tp_idmap_t sid_map;
+
+	/* shared socket mode, protected by ctx_lock */
+	struct list_head rx_queue;
+	unsigned int rx_queue_len;
+	int rx_pending;
+
+	/* protected by l2tp_lock */
+	struct list_head peer_entry;
 };
 
 static pthread_mutex_t l2tp_lock = PTHREAD_MUTEX_INITIALIZER;
 static struct l2tp_conn_t **l2tp_conn;
+static struct l2tp_idmap_t l2tp_tid_map;
+
+/* Tunnels using the shared socket, indexed by peer address and peer
+ * tunnel ID to detect retransmitted SCCRQ */
+static struct list_head l2tp_peer_hash[1 << PEER_HASH_BITS];
+
+static struct l2tp_serv_t udp_serv;
 
 static mempool_t l2tp_conn_pool;
 static mempool_t l2tp_sess_pool;
@@ -197,6 +241,7 @@ static int l2tp_conn_read(struct triton_md_handler_t *);
 static void l2tp_session_free(struct l2tp_sess_t *sess);
 static void l2tp_tunnel_free(struct l2tp_conn_t *conn);
 static void apses_stop(void *data);
+static void l2tp_tunnel_recv_queued(void *data);
 
 
 #define log_tunnel(log_func, conn, fmt, ...)				\
@@ -273,23 +318,102 @@ static inline struct l2tp_conn_t *l2tp_tunnel_self(void)
 	return container_of(triton_context_self(), struct l2tp_conn_t, ctx);
 }
 
-static int sess_cmp(const void *a, const void *b)
+/* Fibonacci hashing: take the top log2(size) bits of the product */
+static inline unsigned int sess_hash(uint16_t sid, unsigned int size)
 {
-	const struct l2tp_sess_t *sess_a = a;
-	const struct l2tp_sess_t *sess_b = b;
-
-	return (sess_a->sid > sess_b->sid) - (sess_a->sid < sess_b->sid);
+	return (sid * 0x9e3779b1u) >> (32 - __builtin_ctz(size));
 }
 
 static struct l2tp_sess_t *l2tp_tunnel_get_session(struct l2tp_conn_t *conn,
 						   uint16_t sid)
 {
-	struct l2tp_sess_t sess = {.sid = sid, 0};
-	struct l2tp_sess_t **res = NULL;
+	unsigned int mask = conn->sess_tab_size - 1;
+	unsigned int i;
 
-	res = tfind(&sess, &conn->sessions, sess_cmp);
+	if (!conn->sessions)
+		return NULL;
 
-	return (res) ? *res : NULL;
+	for (i = sess_hash(sid, conn->sess_tab_size); conn->sessions[i];
+	     i = (i + 1) & mask) {
+		if (conn->sessions[i]->sid == sid)
+			return conn->sessions[i];
+	}
+
+	return NULL;
+}
+
+static void __tunnel_insert_session(struct l2tp_sess_t **tab,
+				    unsigned int size,
+				    struct l2tp_sess_t *sess)
+{
+	unsigned int i;
+
+	for (i = sess_hash(sess->sid, size); tab[i]; i = (i + 1) & (size - 1))
+		;
+
+	tab[i] = sess;
+}
+
+static int l2tp_tunnel_add_session(struct l2tp_conn_t *conn,
+				   struct l2tp_sess_t *sess)
+{
+	struct l2tp_sess_t **tab;
+	unsigned int size, i;
+
+	if (l2tp_tunnel_get_session(conn, sess->sid))
+		return -1;
+
+	/* Keep load factor under 1/2 */
+	if ((conn->sess_count + 1) * 2 > conn->sess_tab_size) {
+		size = conn->sess_tab_size ? conn->sess_tab_size * 2
+					   : SESS_TAB_MIN_SIZE;
+		tab = _malloc(size * sizeof(*tab));
+		if (!tab)
+			return -1;
+		memset(tab, 0, size * sizeof(*tab));
+
+		for (i = 0; i < conn->sess_tab_size; i++) {
+			if (conn->sessions[i])
+				__tunnel_insert_session(tab, size,
+							conn->sessions[i]);
+		}
+
+		if (conn->sessions)
+			_free(conn->sessions);
+		conn->sessions = tab;
+		conn->sess_tab_size = size;
+	}
+
+	__tunnel_insert_session(conn->sessions, conn->sess_tab_size, sess);
+
+	return 0;
+}
+
+static int l2tp_tunnel_del_session(struct l2tp_conn_t *conn,
+				   struct l2tp_sess_t *sess)
+{
+	struct l2tp_sess_t **tab = conn->sessions;
+	unsigned int mask = conn->sess_tab_size - 1;
+	unsigned int i, j, k;
+
+	for (i = sess_hash(sess->sid, conn->sess_tab_size); tab[i] != sess;
+	     i = (i + 1) & mask) {
+		if (!tab[i])
+			return -1;
+	}
+
+	/* Shift back following entries of the probe sequence,
+	 * so that lookups don't stop at the freed slot */
+	for (j = (i + 1) & mask; tab[j]; j = (j + 1) & mask) {
+		k = sess_hash(tab[j]->sid, conn->sess_tab_size);
+		if (i <= j ? (k <= i || k > j) : (k <= i && k > j)) {
+			tab[i] = tab[j];
+			i = j;
+		}
+	}
+	tab[i] = NULL;
+
+	return 0;
 }
 
 static int l2tp_tunnel_genchall(uint16_t chall_len,
@@ -527,6 +651,7 @@ static int __l2tp_tunnel_send(const struct l2tp_conn_t *conn,
 {
 	const struct l2tp_attr_t *msg_type;
 	void (*log_func)(const char *fmt, ...);
+	struct in_pktinfo pkt_info;
 
 	pack->hdr.Nr = htons(conn->Nr);
 
@@ -545,7 +670,15 @@ static int __l2tp_tunnel_send(const struct l2tp_conn_t *conn,
 		l2tp_packet_print(pack, log_func);
 	}
 
-	return l2tp_packet_send(conn->hnd.fd, pack);
+	if (conn->hnd.fd < 0) {
+		/* No dedicated socket yet, send from the shared one */
+		memset(&pkt_info, 0, sizeof(pkt_info));
+		pkt_info.ipi_spec_dst = conn->host_addr.sin_addr;
+
+		return l2tp_packet_send(udp_serv.hnd.fd, pack, &pkt_info);
+	}
+
+	return l2tp_packet_send(conn->hnd.fd, pack, NULL);
 }
 
 /* Drop acknowledged packets from tunnel's retransmission queue */
@@ -849,13 +982,22 @@ out_err:
 
 static void l2tp_tunnel_free_sessions(struct l2tp_conn_t *conn)
 {
-	void *sessions = conn->sessions;
+	struct l2tp_sess_t **sessions = conn->sessions;
+	unsigned int size = conn->sess_tab_size;
+	unsigned int i;
 
 	conn->sessions = NULL;
-	tdestroy(sessions, (__free_fn_t)l2tp_session_free);
+	conn->sess_tab_size = 0;
+
 	/* Let l2tp_session_free() handle the session counter and
 	 * the reference held by the tunnel.
 	 */
+	for (i = 0; i < size; i++) {
+		if (sessions[i])
+			l2tp_session_free(sessions[i]);
+	}
+
+	_free(sessions);
 }
 
 static int l2tp_tunnel_disconnect(struct l2tp_conn_t *conn,
@@ -933,10 +1075,23 @@ static int l2tp_tunnel_disconnect_push(struct l2tp_conn_t *conn,
 	return 0;
 }
 
+static void l2tp_tunnel_free_dgrams(struct list_head *queue)
+{
+	struct l2tp_dgram_t *dgram;
+
+	while (!list_empty(queue)) {
+		dgram = list_first_entry(queue, typeof(*dgram), entry);
+		list_del(&dgram->entry);
+		_free(dgram);
+	}
+}
+
 static void __tunnel_destroy(struct l2tp_conn_t *conn)
 {
 	pthread_mutex_destroy(&conn->ctx_lock);
 
+	l2tp_tunnel_free_dgrams(&conn->rx_queue);
+
 	if (conn->hnd.fd >= 0)
 		close(conn->hnd.fd);
 	if (conn->challenge)
@@ -946,6 +1101,8 @@ static void __tunnel_destroy(struct l2tp_conn_t *conn)
 	if (conn->recv_queue)
 		_free(conn->recv_queue);
 
+	l2tp_idmap_destroy(&conn->sid_map);
+
 	log_tunnel(log_info2, conn, "tunnel destroyed\n");
 
 	mempool_free(conn);
@@ -1071,16 +1228,19 @@ static void l2tp_session_free(struct l2tp_sess_t *sess)
 	}
 
 	if (sess->paren_conn->sessions) {
-		if (!tdelete(sess, &sess->paren_conn->sessions, sess_cmp)) {
+		if (l2tp_tunnel_del_session(sess->paren_conn, sess) < 0) {
 			log_session(log_error, sess,
 				    "impossible to delete session:"
 				    " session unreachable from its parent tunnel\n");
 			return;
 		}
 	}
+	l2tp_idmap_free(&sess->paren_conn->sid_map, sess->sid);
+
 	/* Parent tunnel doesn't hold the session anymore. This is true even
 	 * if sess->paren_conn->sessions was NULL (which means that
-	 * l2tp_session_free() is being called by tdestroy()).
+	 * l2tp_session_free() is being called by
+	 * l2tp_tunnel_free_sessions()).
 	 */
 	session_put(sess);
 
@@ -1147,6 +1307,9 @@ static void l2tp_tunnel_free(struct l2tp_conn_t *conn)
 
 	pthread_mutex_lock(&l2tp_lock);
 	l2tp_conn[conn->tid] = NULL;
+	l2tp_idmap_free(&l2tp_tid_map, conn->tid);
+	if (conn->peer_entry.next)
+		list_del(&conn->peer_entry);
 	pthread_mutex_unlock(&l2tp_lock);
 
 	if (conn->hnd.tpd)
@@ -1381,6 +1544,81 @@ static void apses_started(struct ap_session *apses)
 		      sess->sid, sess->peer_sid);
 }
 
+/* Runs in the data channel context */
+static int l2tp_session_open_channel(struct l2tp_sess_t *sess)
+{
+	int lns_mode = sess->lns_mode;
+	int flg;
+
+	sess->ppp.fd = socket(AF_PPPOX, SOCK_DGRAM, PX_PROTO_OL2TP);
+	if (sess->ppp.fd < 0) {
+		log_ppp_error("impossible to connect session:"
+			      " socket(AF_PPPOX) failed: %s\n", strerror(errno));
+		return -1;
+	}
+
+	flg = fcntl(sess->ppp.fd, F_GETFD);
+	if (flg < 0) {
+		log_ppp_error("impossible to connect session:"
+			      " fcntl(F_GETFD) failed: %s\n", strerror(errno));
+		goto out_err;
+	}
+	flg = fcntl(sess->ppp.fd, F_SETFD, flg | FD_CLOEXEC);
+	if (flg < 0) {
+		log_ppp_error("impossible to connect session:"
+			      " fcntl(F_SETFD) failed: %s\n", strerror(errno));
+		goto out_err;
+	}
+
+	if (connect(sess->ppp.fd, (struct sockaddr *)&sess->pppox_addr,
+		    sizeof(sess->pppox_addr)) < 0) {
+		log_ppp_error("impossible to connect session:"
+			      " connect() failed: %s\n", strerror(errno));
+		goto out_err;
+	}
+
+	if (setsockopt(sess->ppp.fd, SOL_PPPOL2TP, PPPOL2TP_SO_LNSMODE,
+		       &lns_mode, sizeof(lns_mode))) {
+		log_ppp_error("impossible to connect session:"
+			      " setsockopt(PPPOL2TP_SO_LNSMODE) failed: %s\n",
+			      strerror(errno));
+		goto out_err;
+	}
+
+	flg = 1;
+	if (sess->send_seq &&
+	    setsockopt(sess->ppp.fd, SOL_PPPOL2TP, PPPOL2TP_SO_SENDSEQ,
+		       &flg, sizeof(flg))) {
+		log_ppp_error("impossible to connect session:"
+			      " setsockopt(PPPOL2TP_SO_SENDSEQ) failed: %s\n",
+			      strerror(errno));
+		goto out_err;
+	}
+	if (sess->recv_seq &&
+	    setsockopt(sess->ppp.fd, SOL_PPPOL2TP, PPPOL2TP_SO_RECVSEQ,
+		       &flg, sizeof(flg))) {
+		log_ppp_error("impossible to connect session:"
+			      " setsockopt(PPPOL2TP_SO_RECVSEQ) failed: %s\n",
+			      strerror(errno));
+		goto out_err;
+	}
+	if (sess->reorder_timeout &&
+	    setsockopt(sess->ppp.fd, SOL_PPPOL2TP, PPPOL2TP_SO_REORDERTO,
+		       &sess->reorder_timeout, sizeof(sess->reorder_timeout))) {
+		log_ppp_error("impossible to connect session:"
+			      " setsockopt(PPPOL2TP_REORDERTO) failed: %s\n",
+			      strerror(errno));
+		goto out_err;
+	}
+
+	return 0;
+
+out_err:
+	close(sess->ppp.fd);
+	sess->ppp.fd = -1;
+	return -1;
+}
+
 static void apses_start(void *data)
 {
 	struct ap_session *apses = data;
@@ -1397,7 +1635,8 @@ static void apses_start(void *data)
 	log_ppp_info2("starting data channel for l2tp(%s)\n",
 		      apses->chan_name);
 
-	if (establish_ppp(&sess->ppp) < 0) {
+	if (l2tp_session_open_channel(sess) < 0 ||
+	    establish_ppp(&sess->ppp) < 0) {
 		intptr_t cause = TERM_NAS_ERROR;
 
 		log_ppp_error("session startup failed,"
@@ -1421,9 +1660,7 @@ static void l2tp_session_timeout(struct triton_timer_t *t)
 static struct l2tp_sess_t *l2tp_tunnel_new_session(struct l2tp_conn_t *conn)
 {
 	struct l2tp_sess_t *sess = NULL;
-	struct l2tp_sess_t **sess_search = NULL;
-	ssize_t rdlen = 0;
-	uint16_t count;
+	int sid;
 
 	sess = mempool_alloc(l2tp_sess_pool);
 	if (sess == NULL) {
@@ -1434,30 +1671,20 @@ static struct l2tp_sess_t *l2tp_tunnel_new_session(struct l2tp_conn_t *conn)
 	}
 	memset(sess, 0, sizeof(*sess));
 
-	for (count = UINT16_MAX; count > 0; --count) {
-		rdlen = read(urandom_fd, &sess->sid, sizeof(sess->sid));
-		if (rdlen != sizeof(sess->sid)) {
-			log_tunnel(log_error, conn,
-				   "impossible to allocate new session:"
-				   " reading from urandom failed: %s\n",
-				   (rdlen < 0) ? strerror(errno) : "short read");
-			goto out_err;
-		}
-
-		if (sess->sid == 0)
-			continue;
-
-		sess_search = tsearch(sess, &conn->sessions, sess_cmp);
-		if (*sess_search != sess)
-			continue;
-
-		break;
+	sid = l2tp_idmap_alloc(&conn->sid_map);
+	if (sid < 0) {
+		log_tunnel(log_error, conn,
+			   "impossible to allocate new session:"
+			   " could not find any unused session ID\n");
+		goto out_err;
 	}
+	sess->sid = sid;
 
-	if (count == 0) {
+	if (l2tp_tunnel_add_session(conn, sess) < 0) {
 		log_tunnel(log_error, conn,
 			   "impossible to allocate new session:"
-			   " could not find any unused session ID\n");
+			   " inserting session %hu failed\n", sess->sid);
+		l2tp_idmap_free(&conn->sid_map, sess->sid);
 		goto out_err;
 	}
 
@@ -1525,11 +1752,13 @@ static int l2tp_tunnel_start(struct l2tp_conn_t *conn,
 			  " context registration failed\n");
 		goto err;
 	}
-	triton_md_register_handler(&conn->ctx, &conn->hnd);
-	if (triton_md_enable_handler(&conn->hnd, MD_MODE_READ) < 0) {
-		log_error("l2tp: impossible to start new tunnel:"
-			  " enabling handler failed\n");
-		goto err_ctx;
+	if (conn->hnd.fd >= 0) {
+		triton_md_register_handler(&conn->ctx, &conn->hnd);
+		if (triton_md_enable_handler(&conn->hnd, MD_MODE_READ) < 0) {
+			log_error("l2tp: impossible to start new tunnel:"
+				  " enabling handler failed\n");
+			goto err_ctx_md;
+		}
 	}
 	triton_context_wakeup(&conn->ctx);
 	if (triton_timer_add(&conn->ctx, &conn->timeout_timer, 0) < 0) {
@@ -1543,115 +1772,150 @@ static int l2tp_tunnel_start(struct l2tp_conn_t *conn,
 		goto err_ctx_md_timer;
 	}
 
+	/* Messages forwarded from the shared socket before the context
+	 * was registered are waiting without a scheduled call */
+	pthread_mutex_lock(&conn->ctx_lock);
+	if (!conn->rx_pending && !list_empty(&conn->rx_queue) &&
+	    triton_context_call(&conn->ctx, l2tp_tunnel_recv_queued, NULL) == 0)
+		conn->rx_pending = 1;
+	pthread_mutex_unlock(&conn->ctx_lock);
+
 	return 0;
 
 err_ctx_md_timer:
 	triton_timer_del(&conn->timeout_timer);
 err_ctx_md:
-	triton_md_unregister_handler(&conn->hnd, 0);
-err_ctx:
+	if (conn->hnd.tpd)
+		triton_md_unregister_handler(&conn->hnd, 0);
 	triton_context_unregister(&conn->ctx);
 err:
 	return -1;
 }
 
-static struct l2tp_conn_t *l2tp_tunnel_alloc(const struct sockaddr_in *peer,
-					     const struct sockaddr_in *host,
-					     uint32_t framing_cap,
-					     int lns_mode, int port_set,
-					     int hide_avps)
+static int l2tp_tunnel_open_socket(struct l2tp_conn_t *conn,
+				   const struct sockaddr_in *host)
 {
-	struct l2tp_conn_t *conn;
 	socklen_t hostaddrlen = sizeof(conn->host_addr);
-	uint16_t count;
-	ssize_t rdlen;
+	in_port_t peer_port = conn->peer_addr.sin_port;
 	int flag;
 
-	conn = mempool_alloc(l2tp_conn_pool);
-	if (!conn) {
-		log_error("l2tp: impossible to allocate new tunnel:"
-			  " memory allocation failed\n");
-		goto err;
-	}
-
-	memset(conn, 0, sizeof(*conn));
-	pthread_mutex_init(&conn->ctx_lock, NULL);
-	INIT_LIST_HEAD(&conn->send_queue);
-	INIT_LIST_HEAD(&conn->rtms_queue);
-
 	conn->hnd.fd = socket(PF_INET, SOCK_DGRAM, 0);
 	if (conn->hnd.fd < 0) {
-		log_error("l2tp: impossible to allocate new tunnel:"
+		log_error("l2tp: impossible to open tunnel socket:"
 			  " socket(PF_INET) failed: %s\n", strerror(errno));
-		goto err_conn;
+		return -1;
 	}
 
 	flag = fcntl(conn->hnd.fd, F_GETFD);
 	if (flag < 0) {
-		log_error("l2tp: impossible to allocate new tunnel:"
+		log_error("l2tp: impossible to open tunnel socket:"
 			  " fcntl(F_GETFD) failed: %s\n", strerror(errno));
-		goto err_conn_fd;
+		goto err_fd;
 	}
 	flag = fcntl(conn->hnd.fd, F_SETFD, flag | FD_CLOEXEC);
 	if (flag < 0) {
-		log_error("l2tp: impossible to allocate new tunnel:"
+		log_error("l2tp: impossible to open tunnel socket:"
 			  " fcntl(F_SETFD) failed: %s\n",
 			  strerror(errno));
-		goto err_conn_fd;
+		goto err_fd;
 	}
 
 	flag = 1;
 	if (setsockopt(conn->hnd.fd, SOL_SOCKET, SO_REUSEADDR,
 		       &flag, sizeof(flag)) < 0) {
-		log_error("l2tp: impossible to allocate new tunnel:"
+		log_error("l2tp: impossible to open tunnel socket:"
 			  " setsockopt(SO_REUSEADDR) failed: %s\n",
 			  strerror(errno));
-		goto err_conn_fd;
+		goto err_fd;
 	}
 	if (bind(conn->hnd.fd, host, sizeof(*host))) {
-		log_error("l2tp: impossible to allocate new tunnel:"
+		log_error("l2tp: impossible to open tunnel socket:"
 			  " bind() failed: %s\n", strerror(errno));
-		goto err_conn_fd;
+		goto err_fd;
 	}
 
-	memcpy(&conn->peer_addr, peer, sizeof(*peer));
-	if (!port_set)
+	if (!conn->port_set)
 		/* 'peer.sin_port' is set to a default destination port but the
 		   source port that will be used by the peer isn't known yet */
 		conn->peer_addr.sin_port = 0;
 	if (connect(conn->hnd.fd, (struct sockaddr *)&conn->peer_addr,
 		    sizeof(conn->peer_addr))) {
-		log_error("l2tp: impossible to allocate new tunnel:"
+		log_error("l2tp: impossible to open tunnel socket:"
 			  " connect() failed: %s\n", strerror(errno));
-		goto err_conn_fd;
+		goto err_fd;
 	}
-	if (!port_set)
-		conn->peer_addr.sin_port = peer->sin_port;
+	if (!conn->port_set)
+		conn->peer_addr.sin_port = peer_port;
 
 	flag = fcntl(conn->hnd.fd, F_GETFL);
 	if (flag < 0) {
-		log_error("l2tp: impossible to allocate new tunnel:"
+		log_error("l2tp: impossible to open tunnel socket:"
 			  " fcntl(F_GETFL) failed: %s\n", strerror(errno));
-		goto err_conn_fd;
+		goto err_fd;
 	}
 	flag = fcntl(conn->hnd.fd, F_SETFL, flag | O_NONBLOCK);
 	if (flag < 0) {
-		log_error("l2tp: impossible to allocate new tunnel:"
+		log_error("l2tp: impossible to open tunnel socket:"
 			  " fcntl(F_SETFL) failed: %s\n", strerror(errno));
-		goto err_conn_fd;
+		goto err_fd;
 	}
 
 	if (getsockname(conn->hnd.fd, &conn->host_addr, &hostaddrlen) < 0) {
-		log_error("l2tp: impossible to allocate new tunnel:"
+		log_error("l2tp: impossible to open tunnel socket:"
 			  " getsockname() failed: %s\n", strerror(errno));
-		goto err_conn_fd;
+		goto err_fd;
 	}
 	if (hostaddrlen != sizeof(conn->host_addr)) {
-		log_error("l2tp: impossible to allocate new tunnel:"
+		log_error("l2tp: impossible to open tunnel socket:"
 			  " inconsistent address length returned by"
 			  " getsockname(): %i bytes instead of %zu\n",
 			  hostaddrlen, sizeof(conn->host_addr));
-		goto err_conn_fd;
+		goto err_fd;
+	}
+
+	return 0;
+
+err_fd:
+	close(conn->hnd.fd);
+	conn->hnd.fd = -1;
+
+	return -1;
+}
+
+static struct l2tp_conn_t *l2tp_tunnel_alloc(const struct sockaddr_in *peer,
+					     const struct sockaddr_in *host,
+					     uint32_t framing_cap,
+					     int lns_mode, int port_set,
+					     int hide_avps, int shared)
+{
+	struct l2tp_conn_t *conn;
+	int tid;
+
+	conn = mempool_alloc(l2tp_conn_pool);
+	if (!conn) {
+		log_error("l2tp: impossible to allocate new tunnel:"
+			  " memory allocation failed\n");
+		goto err;
+	}
+
+	memset(conn, 0, sizeof(*conn));
+	pthread_mutex_init(&conn->ctx_lock, NULL);
+	INIT_LIST_HEAD(&conn->send_queue);
+	INIT_LIST_HEAD(&conn->rtms_queue);
+	INIT_LIST_HEAD(&conn->rx_queue);
+
+	memcpy(&conn->peer_addr, peer, sizeof(*peer));
+	conn->port_set = port_set;
+
+	if (shared) {
+		/* Control messages go through the shared socket until
+		 * the data channel is set up */
+		conn->hnd.fd = -1;
+		memcpy(&conn->host_addr, host, sizeof(*host));
+	} else if (l2tp_tunnel_open_socket(conn, host) < 0) {
+		log_error("l2tp: impossible to allocate new tunnel:"
+			  " opening socket failed\n");
+		goto err_conn;
 	}
 
 	conn->recv_queue_sz = conf_recv_window;
@@ -1667,30 +1931,15 @@ static struct l2tp_conn_t *l2tp_tunnel_alloc(const struct sockaddr_in *peer,
 	       conn->recv_queue_sz * sizeof(*conn->recv_queue));
 	conn->recv_queue_offt = 0;
 
-	for (count = UINT16_MAX; count > 0; --count) {
-		rdlen = read(urandom_fd, &conn->tid, sizeof(conn->tid));
-		if (rdlen != sizeof(conn->tid)) {
-			log_error("l2tp: impossible to allocate new tunnel:"
-				  " reading from urandom failed: %s\n",
-				  (rdlen < 0) ? strerror(errno) : "short read");
-			goto err_conn_fd_queue;
-		}
-
-		if (conn->tid == 0)
-			continue;
-
-		pthread_mutex_lock(&l2tp_lock);
-		if (l2tp_conn[conn->tid]) {
-			pthread_mutex_unlock(&l2tp_lock);
-			continue;
-		}
+	pthread_mutex_lock(&l2tp_lock);
+	tid = l2tp_idmap_alloc(&l2tp_tid_map);
+	if (tid > 0) {
+		conn->tid = tid;
 		l2tp_conn[conn->tid] = conn;
-		pthread_mutex_unlock(&l2tp_lock);
-
-		break;
 	}
+	pthread_mutex_unlock(&l2tp_lock);
 
-	if (count == 0) {
+	if (tid < 0) {
 		log_error("l2tp: impossible to allocate new tunnel:"
 			   " could not find any unused tunnel ID\n");
 		goto err_conn_fd_queue;
@@ -1714,9 +1963,9 @@ static struct l2tp_conn_t *l2tp_tunnel_alloc(const struct sockaddr_in *peer,
 	conn->max_retransmit = conf_retransmit;
 
 	conn->sessions = NULL;
+	conn->sess_tab_size = 0;
 	conn->sess_count = 0;
 	conn->lns_mode = lns_mode;
-	conn->port_set = port_set;
 	conn->hide_avps = hide_avps;
 	conn->peer_rcv_wnd_sz = DEFAULT_PEER_RECV_WINDOW_SIZE;
 	tunnel_hold(conn);
@@ -1728,7 +1977,8 @@ static struct l2tp_conn_t *l2tp_tunnel_alloc(const struct sockaddr_in *peer,
 err_conn_fd_queue:
 	_free(conn->recv_queue);
 err_conn_fd:
-	close(conn->hnd.fd);
+	if (conn->hnd.fd >= 0)
+		close(conn->hnd.fd);
 err_conn:
 	mempool_free(conn);
 err:
@@ -1871,87 +2121,23 @@ err:
 
 static int l2tp_session_connect(struct l2tp_sess_t *sess)
 {
-	struct sockaddr_pppol2tp pppox_addr;
 	struct l2tp_conn_t *conn = sess->paren_conn;
-	int lns_mode = sess->lns_mode;
-	int flg;
 	uint16_t peer_port;
 	char addr[17];
 
 	if (sess->timeout_timer.tpd)
 		triton_timer_del(&sess->timeout_timer);
 
-	sess->ppp.fd = socket(AF_PPPOX, SOCK_DGRAM, PX_PROTO_OL2TP);
-	if (sess->ppp.fd < 0) {
-		log_session(log_error, sess, "impossible to connect session:"
-			    " socket(AF_PPPOX) failed: %s\n", strerror(errno));
-		goto out_err;
-	}
-
-	flg = fcntl(sess->ppp.fd, F_GETFD);
-	if (flg < 0) {
-		log_session(log_error, sess, "impossible to connect session:"
-			    " fcntl(F_GETFD) failed: %s\n", strerror(errno));
-		goto out_err;
-	}
-	flg = fcntl(sess->ppp.fd, F_SETFD, flg | FD_CLOEXEC);
-	if (flg < 0) {
-		log_session(log_error, sess, "impossible to connect session:"
-			    " fcntl(F_SETFD) failed: %s\n", strerror(errno));
-		goto out_err;
-	}
-
-	memset(&pppox_addr, 0, sizeof(pppox_addr));
-	pppox_addr.sa_family = AF_PPPOX;
-	pppox_addr.sa_protocol = PX_PROTO_OL2TP;
-	pppox_addr.pppol2tp.fd = conn->hnd.fd;
-	memcpy(&pppox_addr.pppol2tp.addr, &conn->peer_addr,
-	       sizeof(conn->peer_addr));
-	pppox_addr.pppol2tp.s_tunnel = conn->tid;
-	pppox_addr.pppol2tp.d_tunnel = conn->peer_tid;
-	pppox_addr.pppol2tp.s_session = sess->sid;
-	pppox_addr.pppol2tp.d_session = sess->peer_sid;
-
-	if (connect(sess->ppp.fd,
-		    (struct sockaddr *)&pppox_addr, sizeof(pppox_addr)) < 0) {
-		log_session(log_error, sess, "impossible to connect session:"
-			    " connect() failed: %s\n", strerror(errno));
-		goto out_err;
-	}
-
-	if (setsockopt(sess->ppp.fd, SOL_PPPOL2TP, PPPOL2TP_SO_LNSMODE,
-		       &lns_mode, sizeof(lns_mode))) {
-		log_session(log_error, sess, "impossible to connect session:"
-			    " setsockopt(PPPOL2TP_SO_LNSMODE) failed: %s\n",
-			    strerror(errno));
-		goto out_err;
-	}
-
-	flg = 1;
-	if (sess->send_seq &&
-	    setsockopt(sess->ppp.fd, SOL_PPPOL2TP, PPPOL2TP_SO_SENDSEQ,
-		       &flg, sizeof(flg))) {
-		log_session(log_error, sess, "impossible to connect session:"
-			    " setsockopt(PPPOL2TP_SO_SENDSEQ) failed: %s\n",
-			    strerror(errno));
-		goto out_err;
-	}
-	if (sess->recv_seq &&
-	    setsockopt(sess->ppp.fd, SOL_PPPOL2TP, PPPOL2TP_SO_RECVSEQ,
-		       &flg, sizeof(flg))) {
-		log_session(log_error, sess, "impossible to connect session:"
-			    " setsockopt(PPPOL2TP_SO_RECVSEQ) failed: %s\n",
-			    strerror(errno));
-		goto out_err;
-	}
-	if (sess->reorder_timeout &&
-	    setsockopt(sess->ppp.fd, SOL_PPPOL2TP, PPPOL2TP_SO_REORDERTO,
-		       &sess->reorder_timeout, sizeof(sess->reorder_timeout))) {
-		log_session(log_error, sess, "impossible to connect session:"
-			    " setsockopt(PPPOL2TP_REORDERTO) failed: %s\n",
-			    strerror(errno));
-		goto out_err;
-	}
+	memset(&sess->pppox_addr, 0, sizeof(sess->pppox_addr));
+	sess->pppox_addr.sa_family = AF_PPPOX;
+	sess->pppox_addr.sa_protocol = PX_PROTO_OL2TP;
+	sess->pppox_addr.pppol2tp.fd = conn->hnd.fd;
+	memcpy(&sess->pppox_addr.pppol2tp.addr, &conn->peer_addr,
+	       sizeof(conn->peer_addr));
+	sess->pppox_addr.pppol2tp.s_tunnel = conn->tid;
+	sess->pppox_addr.pppol2tp.d_tunnel = conn->peer_tid;
+	sess->pppox_addr.pppol2tp.s_session = sess->sid;
+	sess->pppox_addr.pppol2tp.d_session = sess->peer_sid;
 
 	u_inet_ntoa(conn->peer_addr.sin_addr.s_addr, addr);
 	peer_port = ntohs(conn->peer_addr.sin_port);
@@ -1970,6 +2156,11 @@ static int l2tp_session_connect(struct l2tp_sess_t *sess)
 	__sync_add_and_fetch(&stat_sess_active, 1);
 	sess->state1 = STATE_ESTB;
 
+	/* Kernel session is set up by the data channel context. This keeps
+	 * the socket(), connect() and setsockopt() calls out of the tunnel
+	 * context, so sessions of a same tunnel are set up in parallel.
+	 * Failures are reported back through l2tp_session_apses_finished().
+	 */
 	if (l2tp_session_start_data_channel(sess) < 0) {
 		log_session(log_error, sess, "impossible to connect session:"
 			    " starting data channel failed\n");
@@ -1983,10 +2174,6 @@ out_err:
 		_free(sess->ppp.ses.chan_name);
 		sess->ppp.ses.chan_name = NULL;
 	}
-	if (sess->ppp.fd >= 0) {
-		close(sess->ppp.fd);
-		sess->ppp.fd = -1;
-	}
 	return -1;
 }
 
@@ -1999,6 +2186,24 @@ static int l2tp_tunnel_connect(struct l2tp_conn_t *conn)
 	if (conn->timeout_timer.tpd)
 		triton_timer_del(&conn->timeout_timer);
 
+	if (conn->hnd.fd < 0) {
+		/* Kernel attaches the data channel to a dedicated socket,
+		 * from now on control messages are received through it */
+		if (l2tp_tunnel_open_socket(conn, &conn->host_addr) < 0) {
+			log_tunnel(log_error, conn,
+				   "impossible to connect tunnel:"
+				   " opening tunnel socket failed\n");
+			goto err;
+		}
+		triton_md_register_handler(&conn->ctx, &conn->hnd);
+		if (triton_md_enable_handler(&conn->hnd, MD_MODE_READ) < 0) {
+			log_tunnel(log_error, conn,
+				   "impossible to connect tunnel:"
+				   " enabling handler failed\n");
+			goto err;
+		}
+	}
+
 	memset(&pppox_addr, 0, sizeof(pppox_addr));
 	pppox_addr.sa_family = AF_PPPOX;
 	pppox_addr.sa_protocol = PX_PROTO_OL2TP;
@@ -2736,6 +2941,46 @@ static void l2tp_tunnel_finwait(struct l2tp_conn_t *conn)
 	}
 }
 
+static struct list_head *l2tp_peer_bucket(const struct sockaddr_in *addr,
+					  uint16_t peer_tid)
+{
+	uint32_t h = addr->sin_addr.s_addr ^ ((uint32_t)addr->sin_port << 16)
+		     ^ peer_tid;
+
+	h *= 0x9e3779b1;
+
+	return &l2tp_peer_hash[h >> (32 - PEER_HASH_BITS)];
+}
+
+static int l2tp_tunnel_peer_exists(const struct sockaddr_in *addr,
+				   uint16_t peer_tid)
+{
+	struct list_head *head = l2tp_peer_bucket(addr, peer_tid);
+	struct l2tp_conn_t *conn;
+	int r = 0;
+
+	pthread_mutex_lock(&l2tp_lock);
+	list_for_each_entry(conn, head, peer_entry) {
+		if (conn->peer_tid == peer_tid &&
+		    conn->peer_addr.sin_addr.s_addr == addr->sin_addr.s_addr &&
+		    conn->peer_addr.sin_port == addr->sin_port) {
+			r = 1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&l2tp_lock);
+
+	return r;
+}
+
+static void l2tp_tunnel_hash_peer(struct l2tp_conn_t *conn)
+{
+	pthread_mutex_lock(&l2tp_lock);
+	list_add_tail(&conn->peer_entry,
+		      l2tp_peer_bucket(&conn->peer_addr, conn->peer_tid));
+	pthread_mutex_unlock(&l2tp_lock);
+}
+
 static int l2tp_recv_SCCRQ(const struct l2tp_serv_t *serv,
 			   const struct l2tp_packet_t *pack,
 			   const struct in_pktinfo *pkt_info)
@@ -2830,16 +3075,27 @@ static int l2tp_recv_SCCRQ(const struct l2tp_serv_t *serv,
 			return -1;
 		}
 
+		/* With shared socket, tunnels that are still being set up
+		 * don't have a connected socket of their own, so peer's
+		 * retransmissions of SCCRQ reach us */
+		if (conf_shared_socket &&
+		    l2tp_tunnel_peer_exists(&pack->addr,
+					    assigned_tid->val.uint16)) {
+			log_info2("l2tp: discarding retransmitted SCCRQ"
+				  " from %s\n", src_addr);
+			return 0;
+		}
+
 		host_addr.sin_family = AF_INET;
 		host_addr.sin_addr = pkt_info->ipi_addr;
-		if (conf_ephemeral_ports)
+		if (conf_ephemeral_ports && !conf_shared_socket)
 			host_addr.sin_port = 0;
 		else
 			host_addr.sin_port = serv->addr.sin_port;
 
 		conn = l2tp_tunnel_alloc(&pack->addr, &host_addr,
 					 framing_cap->val.uint32, 1, 1,
-					 conf_hide_avps);
+					 conf_hide_avps, conf_shared_socket);
 		if (conn == NULL) {
 			log_error("l2tp: impossible to handle SCCRQ from %s:"
 				  " tunnel allocation failed\n", src_addr);
@@ -2882,6 +3138,9 @@ static int l2tp_recv_SCCRQ(const struct l2tp_serv_t *serv,
 		conn->port_set = 1;
 		conn->Nr = 1;
 
+		if (conn->hnd.fd < 0)
+			l2tp_tunnel_hash_peer(conn);
+
 		if (l2tp_tunnel_start(conn, (triton_event_func)l2tp_send_SCCRP, conn) < 0) {
 			log_error("l2tp: impossible to handle SCCRQ from %s:"
 				  " starting tunnel failed\n", src_addr);
@@ -4318,70 +4577,52 @@ static int l2tp_tunnel_reply(struct l2tp_conn_t *conn, int need_ack)
 	return res;
 }
 
-static int l2tp_conn_read(struct triton_md_handler_t *h)
+/* Returns 1 if message was added to reception queue, 0 if it was discarded
+ * and -1 if tunnel has to be deleted. The message is consumed in any case. */
+static int l2tp_tunnel_recv_pack(struct l2tp_conn_t *conn,
+				 struct l2tp_packet_t *pack, int *need_ack)
 {
-	struct l2tp_conn_t *conn = container_of(h, typeof(*conn), hnd);
-	struct l2tp_packet_t *pack;
-	unsigned int pkt_count = 0;
-	int need_ack = 0;
 	int res;
 
-	/* Hold the tunnel. This allows any function we call to free the
-	 * tunnel while still keeping the tunnel valid until we return.
-	 */
-	tunnel_hold(conn);
-
-	while (1) {
-		res = l2tp_recv(h->fd, &pack, NULL,
-				conn->secret, conn->secret_len);
-		if (res) {
-			if (res == -2) {
-				log_tunnel(log_info1, conn,
-					   "peer is unreachable,"
-					   " disconnecting tunnel\n");
-				goto err_tunfree;
-			}
-
-			break;
-		}
-
-		if (!pack)
-			continue;
-
-		if (conn->port_set == 0) {
-			/* Get peer's first reply source port and use it as
-			   destination port for further outgoing messages */
-			log_tunnel(log_info2, conn,
-				   "setting peer port to %hu\n",
-				   ntohs(pack->addr.sin_port));
-			res = l2tp_tunnel_update_peerport(conn,
-							  pack->addr.sin_port);
-			if (res < 0) {
-				log_tunnel(log_error, conn,
-					   "peer port update failed,"
-					   " disconnecting tunnel\n");
-				l2tp_packet_free(pack);
-				goto err_tunfree;
-			}
-			conn->port_set = 1;
-		}
-
-		if (ntohs(pack->hdr.tid) != conn->tid && (pack->hdr.tid || !conf_dir300_quirk)) {
-			log_tunnel(log_warn, conn,
-				   "discarding message with invalid tid %hu\n",
-				   ntohs(pack->hdr.tid));
+	if (conn->port_set == 0) {
+		/* Get peer's first reply source port and use it as
+		   destination port for further outgoing messages */
+		log_tunnel(log_info2, conn,
+			   "setting peer port to %hu\n",
+			   ntohs(pack->addr.sin_port));
+		res = l2tp_tunnel_update_peerport(conn,
+						  pack->addr.sin_port);
+		if (res < 0) {
+			log_tunnel(log_error, conn,
+				   "peer port update failed,"
+				   " disconnecting tunnel\n");
 			l2tp_packet_free(pack);
-			continue;
+			return -1;
 		}
+		conn->port_set = 1;
+	}
 
-		if (l2tp_tunnel_store_msg(conn, pack, &need_ack) < 0) {
-			l2tp_packet_free(pack);
-			continue;
-		}
+	if (ntohs(pack->hdr.tid) != conn->tid && (pack->hdr.tid || !conf_dir300_quirk)) {
+		log_tunnel(log_warn, conn,
+			   "discarding message with invalid tid %hu\n",
+			   ntohs(pack->hdr.tid));
+		l2tp_packet_free(pack);
+		return 0;
+	}
 
-		++pkt_count;
+	if (l2tp_tunnel_store_msg(conn, pack, need_ack) < 0) {
+		l2tp_packet_free(pack);
+		return 0;
 	}
 
+	return 1;
+}
+
+/* Processes messages added to reception queue and drops the reference
+ * taken by the caller */
+static int l2tp_tunnel_recv_done(struct l2tp_conn_t *conn,
+				 unsigned int pkt_count, int need_ack)
+{
 	log_tunnel(log_debug, conn, "%u message%s added to reception queue\n",
 		   pkt_count, pkt_count > 1 ? "s" : "");
 
@@ -4426,65 +4667,287 @@ err:
 	return -1;
 }
 
-static int l2tp_udp_read(struct triton_md_handler_t *h)
+static int l2tp_conn_read(struct triton_md_handler_t *h)
 {
-	struct l2tp_serv_t *serv = container_of(h, typeof(*serv), hnd);
+	struct l2tp_conn_t *conn = container_of(h, typeof(*conn), hnd);
 	struct l2tp_packet_t *pack;
-	const struct l2tp_attr_t *msg_type;
-	struct in_pktinfo pkt_info;
-	char src_addr[17];
+	unsigned int pkt_count = 0;
+	int need_ack = 0;
+	int res;
+
+	/* Hold the tunnel. This allows any function we call to free the
+	 * tunnel while still keeping the tunnel valid until we return.
+	 */
+	tunnel_hold(conn);
 
 	while (1) {
-		if (l2tp_recv(h->fd, &pack, &pkt_info,
-			      conf_secret, conf_secret_len) < 0)
+		res = l2tp_recv(h->fd, &pack, NULL,
+				conn->secret, conn->secret_len);
+		if (res) {
+			if (res == -2) {
+				log_tunnel(log_info1, conn,
+					   "peer is unreachable,"
+					   " disconnecting tunnel\n");
+				goto err_tunfree;
+			}
+
 			break;
+		}
 
 		if (!pack)
 			continue;
 
-		u_inet_ntoa(pack->addr.sin_addr.s_addr, src_addr);
+		res = l2tp_tunnel_recv_pack(conn, pack, &need_ack);
+		if (res < 0)
+			goto err_tunfree;
 
-		if (iprange_client_check(pack->addr.sin_addr.s_addr)) {
-			log_warn("l2tp: discarding unexpected message from %s:"
-				 " IP address is out of client-ip-range\n",
-				 src_addr);
-			goto skip;
-		}
+		pkt_count += res;
+	}
 
-		if (pack->hdr.tid) {
-			log_warn("l2tp: discarding unexpected message from %s:"
-				 " invalid tid %hu\n",
-				 src_addr, ntohs(pack->hdr.tid));
-			goto skip;
-		}
+	return l2tp_tunnel_recv_done(conn, pkt_count, need_ack);
+
+err_tunfree:
+	l2tp_tunnel_free(conn);
+	tunnel_put(conn);
+
+	return -1;
+}
+
+/* Handles messages forwarded from the shared socket */
+static void l2tp_tunnel_recv_queued(void *data)
+{
+	struct l2tp_conn_t *conn = l2tp_tunnel_self();
+	struct l2tp_dgram_t *dgram;
+	struct l2tp_packet_t *pack;
+	LIST_HEAD(queue);
+	unsigned int pkt_count = 0;
+	int need_ack = 0;
+	int res;
+	char addr[17];
+
+	pthread_mutex_lock(&conn->ctx_lock);
+	list_splice_init(&conn->rx_queue, &queue);
+	conn->rx_queue_len = 0;
+	conn->rx_pending = 0;
+	pthread_mutex_unlock(&conn->ctx_lock);
 
-		if (list_empty(&pack->attrs)) {
-			log_warn("l2tp: discarding unexpected message from %s:"
-				 " message is empty\n", src_addr);
-			goto skip;
+	tunnel_hold(conn);
+
+	while (!list_empty(&queue)) {
+		dgram = list_first_entry(&queue, typeof(*dgram), entry);
+		list_del(&dgram->entry);
+
+		/* Without connected socket, peer address isn't checked
+		 * by the kernel */
+		if (dgram->addr.sin_addr.s_addr != conn->peer_addr.sin_addr.s_addr ||
+		    (conn->port_set &&
+		     dgram->addr.sin_port != conn->peer_addr.sin_port)) {
+			u_inet_ntoa(dgram->addr.sin_addr.s_addr, addr);
+			log_tunnel(log_warn, conn,
+				   "discarding message from unexpected"
+				   " peer %s:%hu\n",
+				   addr, ntohs(dgram->addr.sin_port));
+			_free(dgram);
+			continue;
 		}
 
-		msg_type = list_entry(pack->attrs.next, typeof(*msg_type), entry);
-		if (msg_type->attr->id != Message_Type) {
-			log_warn("l2tp: discarding unexpected message from %s:"
-				 " invalid first attribute type %i\n",
-				 src_addr, msg_type->attr->id);
-			goto skip;
+		l2tp_packet_parse(dgram->data, dgram->len, &dgram->addr, &pack,
+				  conn->secret, conn->secret_len);
+		_free(dgram);
+
+		if (!pack)
+			continue;
+
+		res = l2tp_tunnel_recv_pack(conn, pack, &need_ack);
+		if (res < 0)
+			goto err_tunfree;
+
+		pkt_count += res;
+	}
+
+	l2tp_tunnel_recv_done(conn, pkt_count, need_ack);
+
+	return;
+
+err_tunfree:
+	l2tp_tunnel_free_dgrams(&queue);
+	l2tp_tunnel_free(conn);
+	tunnel_put(conn);
+}
+
+/* Queues a message received on the shared socket to the tunnel's context */
+static void l2tp_tunnel_forward(const uint8_t *buf, int n,
+				const struct sockaddr_in *addr)
+{
+	const struct l2tp_hdr_t *hdr = (const struct l2tp_hdr_t *)buf;
+	struct l2tp_dgram_t *dgram;
+	struct l2tp_conn_t *conn;
+	uint16_t tid = ntohs(hdr->tid);
+	char src_addr[17];
+
+	pthread_mutex_lock(&l2tp_lock);
+	conn = l2tp_conn[tid];
+	if (conn)
+		tunnel_hold(conn);
+	pthread_mutex_unlock(&l2tp_lock);
+
+	if (!conn) {
+		u_inet_ntoa(addr->sin_addr.s_addr, src_addr);
+		log_warn("l2tp: discarding unexpected message from %s:"
+			 " invalid tid %hu\n", src_addr, tid);
+		return;
+	}
+
+	dgram = _malloc(sizeof(*dgram) + n);
+	if (!dgram) {
+		log_emerg("l2tp: out of memory\n");
+		goto out;
+	}
+
+	memcpy(&dgram->addr, addr, sizeof(*addr));
+	dgram->len = n;
+	memcpy(dgram->data, buf, n);
+
+	pthread_mutex_lock(&conn->ctx_lock);
+	if (conn->rx_queue_len >= conn->recv_queue_sz) {
+		pthread_mutex_unlock(&conn->ctx_lock);
+		log_tunnel(log_warn, conn, "discarding message:"
+			   " reception queue is full\n");
+		_free(dgram);
+		goto out;
+	}
+	list_add_tail(&dgram->entry, &conn->rx_queue);
+	++conn->rx_queue_len;
+	if (!conn->rx_pending && conn->ctx.tpd &&
+	    triton_context_call(&conn->ctx, l2tp_tunnel_recv_queued, NULL) == 0)
+		conn->rx_pending = 1;
+	pthread_mutex_unlock(&conn->ctx_lock);
+
+out:
+	tunnel_put(conn);
+}
+
+static void l2tp_udp_recv(struct l2tp_serv_t *serv, uint8_t *buf, int n,
+			  const struct sockaddr_in *addr,
+			  const struct in_pktinfo *pkt_info)
+{
+	const struct l2tp_hdr_t *hdr = (const struct l2tp_hdr_t *)buf;
+	struct l2tp_packet_t *pack;
+	const struct l2tp_attr_t *msg_type;
+	char src_addr[17];
+
+	/* With shared socket, control messages of tunnels that have no
+	 * connected socket yet are demultiplexed by tunnel ID */
+	if (conf_shared_socket && n >= 6 && hdr->T && hdr->tid) {
+		l2tp_tunnel_forward(buf, n, addr);
+		return;
+	}
+
+	if (l2tp_packet_parse(buf, n, addr, &pack,
+			      conf_secret, conf_secret_len) < 0)
+		return;
+
+	u_inet_ntoa(pack->addr.sin_addr.s_addr, src_addr);
+
+	if (iprange_client_check(pack->addr.sin_addr.s_addr)) {
+		log_warn("l2tp: discarding unexpected message from %s:"
+			 " IP address is out of client-ip-range\n",
+			 src_addr);
+		goto skip;
+	}
+
+	if (pack->hdr.tid) {
+		log_warn("l2tp: discarding unexpected message from %s:"
+			 " invalid tid %hu\n",
+			 src_addr, ntohs(pack->hdr.tid));
+		goto skip;
+	}
+
+	if (list_empty(&pack->attrs)) {
+		log_warn("l2tp: discarding unexpected message from %s:"
+			 " message is empty\n", src_addr);
+		goto skip;
+	}
+
+	msg_type = list_entry(pack->attrs.next, typeof(*msg_type), entry);
+	if (msg_type->attr->id != Message_Type) {
+		log_warn("l2tp: discarding unexpected message from %s:"
+			 " invalid first attribute type %i\n",
+			 src_addr, msg_type->attr->id);
+		goto skip;
+	}
+
+	if (conf_verbose) {
+		log_info2("l2tp: recv ");
+		l2tp_packet_print(pack, log_info2);
+	}
+	if (msg_type->val.uint16 == Message_Type_Start_Ctrl_Conn_Request)
+		l2tp_recv_SCCRQ(serv, pack, pkt_info);
+	else {
+		log_warn("l2tp: discarding unexpected message from %s:"
+			 " invalid Message Type %i\n",
+			 src_addr, msg_type->val.uint16);
+	}
+skip:
+	l2tp_packet_free(pack);
+}
+
+static int l2tp_udp_read(struct triton_md_handler_t *h)
+{
+	struct l2tp_serv_t *serv = container_of(h, typeof(*serv), hnd);
+	struct sockaddr_in addr[RECV_BATCH_MAX];
+	struct iovec iov[RECV_BATCH_MAX];
+	struct mmsghdr mmsg[RECV_BATCH_MAX];
+	char msg_control[RECV_BATCH_MAX][CMSG_SPACE(sizeof(struct in_pktinfo))];
+	struct in_pktinfo pkt_info;
+	struct cmsghdr *cmsg;
+	int batch = conf_recv_batch;
+	int i, n;
+
+	if (batch < 1)
+		batch = 1;
+	else if (batch > RECV_BATCH_MAX)
+		batch = RECV_BATCH_MAX;
+
+	while (1) {
+		for (i = 0; i < batch; i++) {
+			iov[i].iov_base = serv->buf + i * L2TP_MAX_PACKET_SIZE;
+			iov[i].iov_len = L2TP_MAX_PACKET_SIZE;
+
+			memset(&mmsg[i].msg_hdr, 0, sizeof(mmsg[i].msg_hdr));
+			mmsg[i].msg_hdr.msg_name = &addr[i];
+			mmsg[i].msg_hdr.msg_namelen = sizeof(addr[i]);
+			mmsg[i].msg_hdr.msg_iov = &iov[i];
+			mmsg[i].msg_hdr.msg_iovlen = 1;
+			mmsg[i].msg_hdr.msg_control = msg_control[i];
+			mmsg[i].msg_hdr.msg_controllen = sizeof(msg_control[i]);
 		}
 
-		if (conf_verbose) {
-			log_info2("l2tp: recv ");
-			l2tp_packet_print(pack, log_info2);
+		n = recvmmsg(h->fd, mmsg, batch, MSG_DONTWAIT, NULL);
+
+		if (n < 0) {
+			if (errno == EAGAIN)
+				break;
+
+			log_error("l2tp: recvmmsg: %s\n", strerror(errno));
+			break;
 		}
-		if (msg_type->val.uint16 == Message_Type_Start_Ctrl_Conn_Request)
-			l2tp_recv_SCCRQ(serv, pack, &pkt_info);
-		else {
-			log_warn("l2tp: discarding unexpected message from %s:"
-				 " invalid Message Type %i\n",
-				 src_addr, msg_type->val.uint16);
+
+		for (i = 0; i < n; i++) {
+			memset(&pkt_info, 0, sizeof(pkt_info));
+			for (cmsg = CMSG_FIRSTHDR(&mmsg[i].msg_hdr); cmsg;
+			     cmsg = CMSG_NXTHDR(&mmsg[i].msg_hdr, cmsg)) {
+				if (cmsg->cmsg_level == IPPROTO_IP &&
+				    cmsg->cmsg_type == IP_PKTINFO) {
+					memcpy(&pkt_info, CMSG_DATA(cmsg),
+					       sizeof(pkt_info));
+					break;
+				}
+			}
+
+			l2tp_udp_recv(serv, iov[i].iov_base, mmsg[i].msg_len,
+				      &addr[i], &pkt_info);
 		}
-skip:
-		l2tp_packet_free(pack);
 	}
 
 	return 0;
@@ -4599,10 +5062,17 @@ static int start_udp_server(void)
 
 	memcpy(&udp_serv.addr, &addr, sizeof(addr));
 
+	udp_serv.buf = _malloc(RECV_BATCH_MAX * L2TP_MAX_PACKET_SIZE);
+	if (!udp_serv.buf) {
+		log_error("l2tp: impossible to start L2TP server:"
+			  " memory allocation failed\n");
+		goto err_fd;
+	}
+
 	if (triton_context_register(&udp_serv.ctx, NULL) < 0) {
 		log_error("l2tp: impossible to start L2TP server:"
 			  " context registration failed\n");
-		goto err_fd;
+		goto err_buf;
 	}
 	triton_md_register_handler(&udp_serv.ctx, &udp_serv.hnd);
 	if (triton_md_enable_handler(&udp_serv.hnd, MD_MODE_READ) < 0) {
@@ -4617,9 +5087,14 @@ static int start_udp_server(void)
 err_hnd:
 	triton_md_unregister_handler(&udp_serv.hnd, 1);
 	triton_context_unregister(&udp_serv.ctx);
+	_free(udp_serv.buf);
+	udp_serv.buf = NULL;
 
 	return -1;
 
+err_buf:
+	_free(udp_serv.buf);
+	udp_serv.buf = NULL;
 err_fd:
 	close(udp_serv.hnd.fd);
 	udp_serv.hnd.fd = -1;
@@ -4629,12 +5104,37 @@ err_fd:
 
 static int show_stat_exec(const char *cmd, char * const *fields, int fields_cnt, void *client)
 {
+	unsigned int tun_cnt = 0, sess_cnt = 0, sess_max = 0, n;
+	unsigned int i;
+
+	/* Don't block tunnels creation and deletion for the whole scan */
+	pthread_mutex_lock(&l2tp_lock);
+	for (i = 1; i <= UINT16_MAX; i++) {
+		if (i % STAT_SCAN_CHUNK == 0) {
+			pthread_mutex_unlock(&l2tp_lock);
+			sched_yield();
+			pthread_mutex_lock(&l2tp_lock);
+		}
+		if (!l2tp_conn[i])
+			continue;
+		n = l2tp_conn[i]->sess_count;
+		++tun_cnt;
+		sess_cnt += n;
+		if (n > sess_max)
+			sess_max = n;
+	}
+	pthread_mutex_unlock(&l2tp_lock);
+
 	cli_send(client, "l2tp:\r\n");
 	cli_send(client, "  tunnels:\r\n");
 	cli_sendv(client, "    starting: %u\r\n", stat_conn_starting);
 	cli_sendv(client, "    active: %u\r\n", stat_conn_active);
 	cli_sendv(client, "    finishing: %u\r\n", stat_conn_finishing);
 
+	cli_send(client, "  sessions per tunnel:\r\n");
+	cli_sendv(client, "    average: %u\r\n", tun_cnt ? sess_cnt / tun_cnt : 0);
+	cli_sendv(client, "    max: %u\r\n", sess_max);
+
 	cli_send(client, "  sessions (control channels):\r\n");
 	cli_sendv(client, "    starting: %u\r\n", stat_sess_starting);
 	cli_sendv(client, "    active: %u\r\n", stat_sess_active);
@@ -4751,7 +5251,7 @@ static int l2tp_create_tunnel_exec(const char *cmd, char * const *fields,
 		return CLI_CMD_SYNTAX;
 	}
 
-	conn = l2tp_tunnel_alloc(&peer, &host, 3, lns_mode, 0, hide_avps);
+	conn = l2tp_tunnel_alloc(&peer, &host, 3, lns_mode, 0, hide_avps, 0);
 	if (conn == NULL) {
 		cli_send(client, "tunnel allocation failed\r\n");
 		return CLI_CMD_FAILED;
@@ -4867,6 +5367,16 @@ static void load_config(void)
 	if (opt && atoi(opt) >= 0)
 		conf_ephemeral_ports = atoi(opt) > 0;
 
+	opt = conf_get_opt("l2tp", "shared-socket");
+	if (opt && atoi(opt) >= 0)
+		conf_shared_socket = atoi(opt) > 0;
+
+	opt = conf_get_opt("l2tp", "recv-batch");
+	if (opt && atoi(opt) > 0 && atoi(opt) <= RECV_BATCH_MAX)
+		conf_recv_batch = atoi(opt);
+	else
+		conf_recv_batch = DEFAULT_RECV_BATCH;
+
 	opt = conf_get_opt("l2tp", "hide-avps");
 	if (opt && atoi(opt) >= 0)
 		conf_hide_avps = atoi(opt) > 0;
@@ -4988,7 +5498,7 @@ static void load_config(void)
 
 static void l2tp_init(void)
 {
-	int fd;
+	int fd, i;
 
 	fd = socket(AF_PPPOX, SOCK_DGRAM, PX_PROTO_OL2TP);
 	if (fd >= 0)
@@ -4999,6 +5509,9 @@ static void l2tp_init(void)
 	l2tp_conn = _malloc((UINT16_MAX + 1) * sizeof(struct l2tp_conn_t *));
 	memset(l2tp_conn, 0, (UINT16_MAX + 1) * sizeof(struct l2tp_conn_t *));
 
+	for (i = 0; i < (1 << PEER_HASH_BITS); i++)
+		INIT_LIST_HEAD(&l2tp_peer_hash[i]);
+
 	l2tp_conn_pool = mempool_create(sizeof(struct l2tp_conn_t));
 	l2tp_sess_pool = mempool_create(sizeof(struct l2tp_sess_t));
 
@@ -22,6 +22,9 @@
 #define L2TP_DATASEQ_PREFER  1
 #define L2TP_DATASEQ_REQUIRE 2
 
+#define L2TP_IDMAP_CHUNK_SHIFT 12
+#define L2TP_IDMAP_CHUNKS (1 << (16 - L2TP_IDMAP_CHUNK_SHIFT))
+
 typedef union
 {
 	uint32_t uint32;
@@ -72,6 +75,15 @@ struct l2tp_packet_t
 	const char *secret;
 	size_t secret_len;
 	int hide_avps;
+	/* copy of the datagram for received packets, NULL otherwise */
+	uint8_t *data;
+};
+
+/* Set of used 16 bits IDs, chunks of the bitmap are allocated on demand */
+struct l2tp_idmap_t
+{
+	uint64_t *chunk[L2TP_IDMAP_CHUNKS];
+	uint16_t used[L2TP_IDMAP_CHUNKS];
 };
 
 extern int conf_verbose;
@@ -89,19 +101,27 @@ const struct l2tp_dict_value_t *l2tp_dict_find_value(const struct l2tp_dict_attr
 
 int l2tp_recv(int fd, struct l2tp_packet_t **, struct in_pktinfo *,
 	      const char *secret, size_t secret_len);
+int l2tp_packet_parse(uint8_t *buf, int n, const struct sockaddr_in *addr,
+		      struct l2tp_packet_t **,
+		      const char *secret, size_t secret_len);
 void l2tp_packet_free(struct l2tp_packet_t *);
 void l2tp_packet_print(const struct l2tp_packet_t *,
 		       void (*print)(const char *fmt, ...));
 struct l2tp_packet_t *l2tp_packet_alloc(int ver, int msg_type,
 					const struct sockaddr_in *addr, int H,
 					const char *secret, size_t secret_len);
-int l2tp_packet_send(int sock, struct l2tp_packet_t *);
+int l2tp_packet_send(int sock, struct l2tp_packet_t *,
+		     const struct in_pktinfo *pkt_info);
 int l2tp_packet_add_int16(struct l2tp_packet_t *pack, int id, int16_t val, int M);
 int l2tp_packet_add_int32(struct l2tp_packet_t *pack, int id, int32_t val, int M);
 int l2tp_packet_add_int64(struct l2tp_packet_t *pack, int id, int64_t val, int M);
 int l2tp_packet_add_string(struct l2tp_packet_t *pack, int id, const char *val, int M);
 int l2tp_packet_add_octets(struct l2tp_packet_t *pack, int id, const uint8_t *val, int size, int M);
 
+int l2tp_idmap_alloc(struct l2tp_idmap_t *map);
+void l2tp_idmap_free(struct l2tp_idmap_t *map, uint16_t id);
+void l2tp_idmap_destroy(struct l2tp_idmap_t *map);
+
 void l2tp_nl_create_tunnel(int fd, int tid, int peer_tid);
 void l2tp_nl_create_session(int tid, int sid, int peer_sid);
 void l2tp_nl_delete_tunnel(int tid);
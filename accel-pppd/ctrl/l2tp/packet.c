@@ -97,14 +97,19 @@ void l2tp_packet_free(struct l2tp_packet_t *pack)
 
 	while (!list_empty(&pack->attrs)) {
 		attr = list_entry(pack->attrs.next, typeof(*attr), entry);
-		if (attr->H || attr->attr->type == ATTR_TYPE_OCTETS
-		    || attr->attr->type == ATTR_TYPE_STRING)
+		/* values of received attributes point into pack->data */
+		if (!pack->data && (attr->H
+				    || attr->attr->type == ATTR_TYPE_OCTETS
+				    || attr->attr->type == ATTR_TYPE_STRING))
 			_free(attr->val.octets);
 		list_del(&attr->entry);
 		mempool_free(attr);
 	}
 
-	mempool_free(pack);
+	if (pack->data)
+		_free(pack);
+	else
+		mempool_free(pack);
 }
 
 static void memxor(uint8_t *dst, const uint8_t *src, size_t sz)
@@ -142,8 +147,10 @@ static void memxor(uint8_t *dst, const uint8_t *src, size_t sz)
 /*
  * Decipher hidden AVPs, keeping the Hidden AVP Subformat (i.e. the attribute
  * value is prefixed by 2 bytes indicating its length in network byte order).
+ * The AVP header is read from 'avp', the value 'val' is deciphered in place.
  */
-static int decode_avp(struct l2tp_avp_t *avp, const struct l2tp_attr_t *RV,
+static int decode_avp(const struct l2tp_avp_t *avp, uint8_t *val,
+		      const struct l2tp_attr_t *RV,
 		      const char *secret, size_t secret_len)
 {
 	MD5_CTX md5_ctx;
@@ -174,16 +181,16 @@ static int decode_avp(struct l2tp_avp_t *avp, const struct l2tp_attr_t *RV,
 	MD5_Final(p1, &md5_ctx);
 
 	if (attr_len <= MD5_DIGEST_LENGTH) {
-		memxor(avp->val, p1, attr_len);
+		memxor(val, p1, attr_len);
 		return 0;
 	}
 
-	memxor(p1, avp->val, MD5_DIGEST_LENGTH);
+	memxor(p1, val, MD5_DIGEST_LENGTH);
 	orig_attr_len = ntohs(*(uint16_t *)p1);
 
 	if (orig_attr_len <= MD5_DIGEST_LENGTH - 2) {
 		/* Enough bytes decoded already, no need to decode padding */
-		memcpy(avp->val, p1, MD5_DIGEST_LENGTH);
+		memcpy(val, p1, MD5_DIGEST_LENGTH);
 		return 0;
 	}
 
@@ -202,7 +209,7 @@ static int decode_avp(struct l2tp_avp_t *avp, const struct l2tp_attr_t *RV,
 	last_block_len = bytes_left % MD5_DIGEST_LENGTH;
 	blocks_left = bytes_left / MD5_DIGEST_LENGTH;
 	if (last_block_len) {
-		prev_block = avp->val + blocks_left * MD5_DIGEST_LENGTH;
+		prev_block = val + blocks_left * MD5_DIGEST_LENGTH;
 		MD5_Init(&md5_ctx);
 		MD5_Update(&md5_ctx, secret, secret_len);
 		MD5_Update(&md5_ctx, prev_block, MD5_DIGEST_LENGTH);
@@ -210,9 +217,9 @@ static int decode_avp(struct l2tp_avp_t *avp, const struct l2tp_attr_t *RV,
 		memxor(prev_block + MD5_DIGEST_LENGTH, md5, last_block_len);
 		prev_block -= MD5_DIGEST_LENGTH;
 	} else
-		prev_block = avp->val + (blocks_left - 1) * MD5_DIGEST_LENGTH;
+		prev_block = val + (blocks_left - 1) * MD5_DIGEST_LENGTH;
 
-	while (prev_block >= avp->val) {
+	while (prev_block >= val) {
 		MD5_Init(&md5_ctx);
 		MD5_Update(&md5_ctx, secret, secret_len);
 		MD5_Update(&md5_ctx, prev_block, MD5_DIGEST_LENGTH);
@@ -220,7 +227,7 @@ static int decode_avp(struct l2tp_avp_t *avp, const struct l2tp_attr_t *RV,
 		memxor(prev_block + MD5_DIGEST_LENGTH, md5, MD5_DIGEST_LENGTH);
 		prev_block -= MD5_DIGEST_LENGTH;
 	}
-	memcpy(avp->val, p1, MD5_DIGEST_LENGTH);
+	memcpy(val, p1, MD5_DIGEST_LENGTH);
 
 	return 0;
 }
@@ -228,21 +235,13 @@ static int decode_avp(struct l2tp_avp_t *avp, const struct l2tp_attr_t *RV,
 int l2tp_recv(int fd, struct l2tp_packet_t **p, struct in_pktinfo *pkt_info,
 	      const char *secret, size_t secret_len)
 {
-	int n, length;
+	int n;
 	uint8_t *buf;
-	struct l2tp_hdr_t *hdr;
-	struct l2tp_avp_t *avp;
-	struct l2tp_dict_attr_t *da;
-	struct l2tp_attr_t *attr, *RV = NULL;
-	uint8_t *ptr;
-	struct l2tp_packet_t *pack;
 	struct sockaddr_in addr;
 	socklen_t len = sizeof(addr);
 	struct msghdr msg;
 	char msg_control[128];
 	struct cmsghdr *cmsg;
-	uint16_t orig_avp_len;
-	void *orig_avp_val;
 
   *p = NULL;
 
@@ -273,8 +272,6 @@ int l2tp_recv(int fd, struct l2tp_packet_t **p, struct in_pktinfo *pkt_info,
 		log_emerg("l2tp: out of memory\n");
 		return 0;
 	}
-	hdr = (struct l2tp_hdr_t *)buf;
-	ptr = (uint8_t *)(hdr + 1);
 
 	n = recvfrom(fd, buf, L2TP_MAX_PACKET_SIZE, 0, &addr, &len);
 
@@ -289,6 +286,34 @@ int l2tp_recv(int fd, struct l2tp_packet_t **p, struct in_pktinfo *pkt_info,
 		return 0;
 	}
 
+	l2tp_packet_parse(buf, n, &addr, p, secret, secret_len);
+
+	mempool_free(buf);
+
+	return 0;
+}
+
+/* Decodes datagram 'buf' of 'n' bytes received from 'addr'. The datagram is
+ * copied once along with the packet, string and octets attributes reference
+ * that copy instead of being allocated one by one. 'buf' isn't modified.
+ * On success the packet is returned in '*p', on error '*p' is set to NULL. */
+int l2tp_packet_parse(uint8_t *buf, int n, const struct sockaddr_in *addr,
+		      struct l2tp_packet_t **p,
+		      const char *secret, size_t secret_len)
+{
+	int length;
+	struct l2tp_hdr_t *hdr = (struct l2tp_hdr_t *)buf;
+	struct l2tp_avp_t avp_hdr, *avp = &avp_hdr;
+	struct l2tp_dict_attr_t *da;
+	struct l2tp_attr_t *attr, *RV = NULL;
+	uint8_t *ptr, *val;
+	uint8_t *nul = NULL;
+	struct l2tp_packet_t *pack;
+	uint16_t orig_avp_len;
+	uint8_t *orig_avp_val;
+
+	*p = NULL;
+
 	if (n < 6) {
 		if (conf_verbose)
 			log_warn("l2tp: short packet received (%i/%zu)\n", n, sizeof(*hdr));
@@ -331,7 +356,8 @@ int l2tp_recv(int fd, struct l2tp_packet_t **p, struct in_pktinfo *pkt_info,
 		goto out_err_hdr;
 	}
 
-	pack = mempool_alloc(pack_pool);
+	/* One more byte for terminating a string ending the message */
+	pack = _malloc(sizeof(*pack) + n + 1);
 	if (!pack) {
 		log_emerg("l2tp: out of memory\n");
 		goto out_err_hdr;
@@ -339,14 +365,31 @@ int l2tp_recv(int fd, struct l2tp_packet_t **p, struct in_pktinfo *pkt_info,
 
 	memset(pack, 0, sizeof(*pack));
 	INIT_LIST_HEAD(&pack->attrs);
+	pack->data = (uint8_t *)(pack + 1);
+	memcpy(pack->data, buf, n);
 
-	memcpy(&pack->addr, &addr, sizeof(addr));
+	memcpy(&pack->addr, addr, sizeof(*addr));
 	memcpy(&pack->hdr, hdr, sizeof(*hdr));
 	length = ntohs(hdr->length) - sizeof(*hdr);
+	ptr = pack->data + sizeof(*hdr);
 
 	while (length) {
+		if (length < (int)sizeof(*avp)) {
+			if (conf_verbose)
+				log_warn("l2tp: incorrect avp received (exceeds message length)\n");
+			goto out_err;
+		}
+
 		*(uint16_t *)ptr = ntohs(*(uint16_t *)ptr);
-		avp = (struct l2tp_avp_t *)ptr;
+		memcpy(avp, ptr, sizeof(*avp));
+		val = ptr + sizeof(*avp);
+
+		/* Strings are terminated in place, possibly over the first
+		 * byte of the following AVP, whose header is now copied */
+		if (nul) {
+			*nul = 0;
+			nul = NULL;
+		}
 
 		if (avp->length > length) {
 			if (conf_verbose)
@@ -354,6 +397,12 @@ int l2tp_recv(int fd, struct l2tp_packet_t **p, struct in_pktinfo *pkt_info,
 			goto out_err;
 		}
 
+		if (avp->length < sizeof(*avp)) {
+			if (conf_verbose)
+				log_warn("l2tp: incorrect avp received (length %hu too small)\n", avp->length);
+			goto out_err;
+		}
+
 		if (avp->vendor)
 			goto skip;
 
@@ -391,7 +440,7 @@ int l2tp_recv(int fd, struct l2tp_packet_t **p, struct in_pktinfo *pkt_info,
 						  ntohs(avp->type));
 					goto out_err;
 				}
-				if (decode_avp(avp, RV, secret, secret_len) < 0)
+				if (decode_avp(avp, val, RV, secret, secret_len) < 0)
 					goto out_err;
 			}
 
@@ -400,11 +449,11 @@ int l2tp_recv(int fd, struct l2tp_packet_t **p, struct in_pktinfo *pkt_info,
 			list_add_tail(&attr->entry, &pack->attrs);
 
 			if (avp->H) {
-				orig_avp_len = ntohs(*(uint16_t *)avp->val) + sizeof(*avp);
-				orig_avp_val = avp->val + sizeof(uint16_t);
+				orig_avp_len = ntohs(*(uint16_t *)val) + sizeof(*avp);
+				orig_avp_val = val + sizeof(uint16_t);
 			} else {
 				orig_avp_len = avp->length;
-				orig_avp_val = avp->val;
+				orig_avp_val = val;
 			}
 
 			attr->attr = da;
@@ -432,17 +481,11 @@ int l2tp_recv(int fd, struct l2tp_packet_t **p, struct in_pktinfo *pkt_info,
 					attr->val.uint64 = be64toh(*(uint64_t *)orig_avp_val);
 					break;
 				case ATTR_TYPE_OCTETS:
-					attr->val.octets = _malloc(attr->length);
-					if (!attr->val.octets)
-						goto out_err_mem;
-					memcpy(attr->val.octets, orig_avp_val, attr->length);
+					attr->val.octets = orig_avp_val;
 					break;
 				case ATTR_TYPE_STRING:
-					attr->val.string = _malloc(attr->length + 1);
-					if (!attr->val.string)
-						goto out_err_mem;
-					memcpy(attr->val.string, orig_avp_val, attr->length);
-					attr->val.string[attr->length] = 0;
+					attr->val.string = (char *)orig_avp_val;
+					nul = orig_avp_val + attr->length;
 					break;
 			}
 		}
@@ -451,27 +494,25 @@ skip:
 		length -= avp->length;
 	}
 
-	*p = pack;
+	if (nul)
+		*nul = 0;
 
-	mempool_free(buf);
+	*p = pack;
 
 	return 0;
 
 out_err:
 	l2tp_packet_free(pack);
 out_err_hdr:
-	mempool_free(buf);
-	return 0;
+	return -1;
 out_err_len:
 	if (conf_verbose)
 		log_warn("l2tp: incorrect avp received (type=%i, incorrect length %i)\n", ntohs(avp->type), orig_avp_len);
 	goto out_err;
-out_err_mem:
-	log_emerg("l2tp: out of memory\n");
-	goto out_err;
 }
 
-int l2tp_packet_send(int sock, struct l2tp_packet_t *pack)
+int l2tp_packet_send(int sock, struct l2tp_packet_t *pack,
+		     const struct in_pktinfo *pkt_info)
 {
 	uint8_t *buf = mempool_alloc(buf_pool);
 	struct l2tp_avp_t *avp;
@@ -479,6 +520,10 @@ int l2tp_packet_send(int sock, struct l2tp_packet_t *pack)
 	uint8_t *ptr;
 	int n;
 	int len = sizeof(pack->hdr);
+	struct iovec iov;
+	struct msghdr msg;
+	char msg_control[CMSG_SPACE(sizeof(*pkt_info))];
+	struct cmsghdr *cmsg;
 
 	if (!buf) {
 		log_emerg("l2tp: out of memory\n");
@@ -526,8 +571,28 @@ int l2tp_packet_send(int sock, struct l2tp_packet_t *pack)
 	pack->hdr.length = htons(len);
 	memcpy(buf, &pack->hdr, sizeof(pack->hdr));
 
-	n = sendto(sock, buf, ntohs(pack->hdr.length), 0,
-		   &pack->addr, sizeof(pack->addr));
+	iov.iov_base = buf;
+	iov.iov_len = ntohs(pack->hdr.length);
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = &pack->addr;
+	msg.msg_namelen = sizeof(pack->addr);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	/* source address for packets sent over unconnected socket */
+	if (pkt_info) {
+		memset(msg_control, 0, sizeof(msg_control));
+		msg.msg_control = msg_control;
+		msg.msg_controllen = sizeof(msg_control);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = IPPROTO_IP;
+		cmsg->cmsg_type = IP_PKTINFO;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(*pkt_info));
+		memcpy(CMSG_DATA(cmsg), pkt_info, sizeof(*pkt_info));
+	}
+
+	n = sendmsg(sock, &msg, 0);
 	mempool_free(buf);
 
 	if (n < 0) {
@@ -536,7 +601,7 @@ int l2tp_packet_send(int sock, struct l2tp_packet_t *pack)
 				log_warn("l2tp: buffer overflow (packet lost)\n");
 		} else {
 			if (conf_verbose)
-				log_warn("l2tp: sendto: %s\n", strerror(errno));
+				log_warn("l2tp: sendmsg: %s\n", strerror(errno));
 			return -1;
 		}
 	}
@@ -135,6 +135,11 @@ static void show_pado_delay_help(char * const *f, int f_cnt, void *cli)
 	cli_send(cli, "pppoe show PADO-delay - show current PADO delay value\r\n");
 }
 
+static void show_pppoe_stat_help(char * const *f, int f_cnt, void *cli)
+{
+	cli_send(cli, "pppoe show stat - show per-interface PADI drop counters\r\n");
+}
+
 static void show_service_name_help(char * const *f, int f_cnt, void *cli)
 {
 	cli_send(cli, "pppoe show Service-Name - show current Service-Name value\r\n");
@@ -145,6 +150,26 @@ static void show_ac_name_help(char * const *f, int f_cnt, void *cli)
 	cli_send(cli, "pppoe show AC-Name - show current AC-Name tag value\r\n");
 }
 
+static int show_pppoe_stat_exec(const char *cmd, char * const *f, int f_cnt, void *cli)
+{
+	struct pppoe_serv_t *serv;
+
+	if (f_cnt != 3)
+		return CLI_CMD_SYNTAX;
+
+	cli_send(cli, "interface:   PADI-limit:    drop(limit):    drop(dup):    drop(connlimit):\r\n");
+	cli_send(cli, "-------------------------------------------------------------------------\r\n");
+
+	pthread_rwlock_rdlock(&serv_lock);
+	list_for_each_entry(serv, &serv_list, entry) {
+		cli_sendv(cli, "%9s    %10i    %12lu    %10lu    %16lu\r\n", serv->ifname, serv->padi_limit,
+			  serv->stat_padi_drop_limit, serv->stat_padi_drop_dup, serv->stat_padi_drop_connlimit);
+	}
+	pthread_rwlock_unlock(&serv_lock);
+
+	return CLI_CMD_OK;
+}
+
 static int show_verbose_exec(const char *cmd, char * const *f, int f_cnt, void *cli)
 {
 	if (f_cnt != 3)
@@ -278,6 +303,8 @@ static void init(void)
 				 3, "pppoe", "show", "verbose");
 	cli_register_simple_cmd2(show_pado_delay_exec, show_pado_delay_help,
 				 3, "pppoe", "show", "PADO-delay");
+	cli_register_simple_cmd2(show_pppoe_stat_exec, show_pppoe_stat_help,
+				 3, "pppoe", "show", "stat");
 	cli_register_simple_cmd2(show_service_name_exec, show_service_name_help,
 				 3, "pppoe", "show", "Service-Name");
 	cli_register_simple_cmd2(show_ac_name_exec, show_ac_name_help,
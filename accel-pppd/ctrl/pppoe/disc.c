@@ -22,6 +22,7 @@
 
 #define MAX_NET 2
 #define HASH_BITS 0xff
+#define DISC_BATCH_MAX 64
 
 struct tree {
 	pthread_mutex_t lock;
@@ -285,21 +286,98 @@ static void disc_stop(struct disc_net *net)
 }
 
 
+static int disc_check(uint8_t *pack, int n)
+{
+	struct ethhdr *ethhdr = (struct ethhdr *)(pack + 4);
+	struct pppoe_hdr *hdr = (struct pppoe_hdr *)(pack + 4 + ETH_HLEN);
+
+	if (n < ETH_HLEN + sizeof(*hdr)) {
+		if (conf_verbose)
+			log_warn("pppoe: short packet received (%i)\n", n);
+		return -1;
+	}
+
+	if (mac_filter_check(ethhdr->h_source)) {
+		__sync_add_and_fetch(&stat_filtered, 1);
+		return -1;
+	}
+
+	//if (memcmp(ethhdr->h_dest, bc_addr, ETH_ALEN) && memcmp(ethhdr->h_dest, serv->hwaddr, ETH_ALEN))
+	//	return -1;
+
+	if (!memcmp(ethhdr->h_source, bc_addr, ETH_ALEN)) {
+		if (conf_verbose)
+			log_warn("pppoe: discarding packet (host address is broadcast)\n");
+		return -1;
+	}
+
+	if ((ethhdr->h_source[0] & 1) != 0) {
+		if (conf_verbose)
+			log_warn("pppoe: discarding packet (host address is not unicast)\n");
+		return -1;
+	}
+
+	if (n < ETH_HLEN + sizeof(*hdr) + ntohs(hdr->length)) {
+		if (conf_verbose)
+			log_warn("pppoe: short packet received\n");
+		return -1;
+	}
+
+	if (hdr->ver != 1) {
+		if (conf_verbose)
+			log_warn("pppoe: discarding packet (unsupported version %i)\n", hdr->ver);
+		return -1;
+	}
+
+	if (hdr->type != 1) {
+		if (conf_verbose)
+			log_warn("pppoe: discarding packet (unsupported type %i)\n", hdr->type);
+	}
+
+	return 0;
+}
+
 static int disc_read(struct triton_md_handler_t *h)
 {
 	struct disc_net *net = container_of(h, typeof(*net), hnd);
-	uint8_t *pack = NULL;
-	struct ethhdr *ethhdr;
-	struct pppoe_hdr *hdr;
-	int n;
-	struct sockaddr_ll src;
-	socklen_t slen = sizeof(src);
+	uint8_t *pack[DISC_BATCH_MAX];
+	struct sockaddr_ll src[DISC_BATCH_MAX];
+	struct iovec iov[DISC_BATCH_MAX];
+	struct mmsghdr mmsg[DISC_BATCH_MAX];
+	int batch = conf_disc_batch;
+	int i, n, ifindex = 0;
+
+	if (batch < 1)
+		batch = 1;
+	else if (batch > DISC_BATCH_MAX)
+		batch = DISC_BATCH_MAX;
+
+	memset(pack, 0, sizeof(pack));
 
 	while (1) {
-		if (!pack)
-			pack = mempool_alloc(pkt_pool);
+		for (i = 0; i < batch; i++) {
+			if (!pack[i])
+				pack[i] = mempool_alloc(pkt_pool);
+
+			iov[i].iov_base = pack[i] + 4;
+			iov[i].iov_len = ETHER_MAX_LEN;
+
+			memset(&mmsg[i].msg_hdr, 0, sizeof(mmsg[i].msg_hdr));
+			mmsg[i].msg_hdr.msg_name = &src[i];
+			mmsg[i].msg_hdr.msg_namelen = sizeof(src[i]);
+			mmsg[i].msg_hdr.msg_iov = &iov[i];
+			mmsg[i].msg_hdr.msg_iovlen = 1;
+		}
 
-		n = net->net->recvfrom(h->fd, pack + 4, ETHER_MAX_LEN, MSG_DONTWAIT, (struct sockaddr *)&src, &slen);
+		if (batch == 1) {
+			n = net->net->recvfrom(h->fd, iov[0].iov_base, iov[0].iov_len, MSG_DONTWAIT,
+					       (struct sockaddr *)&src[0], &mmsg[0].msg_hdr.msg_namelen);
+			if (n >= 0) {
+				mmsg[0].msg_len = n;
+				n = 1;
+			}
+		} else
+			n = net->net->recvmmsg(h->fd, mmsg, batch, MSG_DONTWAIT);
 
 		if (n < 0) {
 			if (errno == EAGAIN)
@@ -308,68 +386,35 @@ static int disc_read(struct triton_md_handler_t *h)
 			log_error("pppoe: disc: read: %s\n", strerror(errno));
 
 			if (errno == ENETDOWN) {
-				notify_down(net, src.sll_ifindex);
+				if (ifindex)
+					notify_down(net, ifindex);
 				continue;
 			}
 
 			if (errno == EBADE) {
+				for (i = 0; i < batch; i++)
+					mempool_free(pack[i]);
 				disc_stop(net);
 				return 1;
 			}
 			continue;
 		}
 
-		ethhdr = (struct ethhdr *)(pack + 4);
-		hdr = (struct pppoe_hdr *)(pack + 4 + ETH_HLEN);
-
-		if (n < ETH_HLEN + sizeof(*hdr)) {
-			if (conf_verbose)
-				log_warn("pppoe: short packet received (%i)\n", n);
-			continue;
-		}
+		for (i = 0; i < n; i++) {
+			ifindex = src[i].sll_ifindex;
 
-		if (mac_filter_check(ethhdr->h_source)) {
-			__sync_add_and_fetch(&stat_filtered, 1);
-			continue;
-		}
-
-		//if (memcmp(ethhdr->h_dest, bc_addr, ETH_ALEN) && memcmp(ethhdr->h_dest, serv->hwaddr, ETH_ALEN))
-		//	continue;
-
-		if (!memcmp(ethhdr->h_source, bc_addr, ETH_ALEN)) {
-			if (conf_verbose)
-				log_warn("pppoe: discarding packet (host address is broadcast)\n");
-			continue;
-		}
-
-		if ((ethhdr->h_source[0] & 1) != 0) {
-			if (conf_verbose)
-				log_warn("pppoe: discarding packet (host address is not unicast)\n");
-			continue;
-		}
-
-		if (n < ETH_HLEN + sizeof(*hdr) + ntohs(hdr->length)) {
-			if (conf_verbose)
-				log_warn("pppoe: short packet received\n");
-			continue;
-		}
-
-		if (hdr->ver != 1) {
-			if (conf_verbose)
-				log_warn("pppoe: discarding packet (unsupported version %i)\n", hdr->ver);
-			continue;
-		}
+			if (disc_check(pack[i], mmsg[i].msg_len))
+				continue;
 
-		if (hdr->type != 1) {
-			if (conf_verbose)
-				log_warn("pppoe: discarding packet (unsupported type %i)\n", hdr->type);
+			if (forward(net, ifindex, pack[i], mmsg[i].msg_len))
+				pack[i] = NULL;
 		}
-
-		if (forward(net, src.sll_ifindex, pack, n))
-			pack = NULL;
 	}
 
-	mempool_free(pack);
+	for (i = 0; i < batch; i++) {
+		if (pack[i])
+			mempool_free(pack[i]);
+	}
 
 	return 0;
 }
@@ -6,6 +6,7 @@
 #include <net/ethernet.h>
 
 #include "list.h"
+#include "spinlock.h"
 #include "cli.h"
 #include "triton.h"
 #include "log.h"
@@ -14,46 +15,143 @@
 
 #include "pppoe.h"
 
-struct mac_t
+/*
+ * The filter is an immutable sorted array of addresses which is replaced
+ * as a whole on every modification, so readers only hold set_lock for
+ * the time needed to take a reference and never wait for cli updates.
+ */
+struct mac_set
 {
-	struct list_head entry;
-	uint8_t addr[ETH_ALEN];
+	int refs;
+	int count;
+	uint64_t addr[0];
 };
 
-static LIST_HEAD(mac_list);
+static struct mac_set *mac_set;
+static spinlock_t set_lock;
+static pthread_mutex_t update_lock = PTHREAD_MUTEX_INITIALIZER;
 static int type; // -1 - disabled, 1 - allow, 0 - denied
-static pthread_rwlock_t lock = PTHREAD_RWLOCK_INITIALIZER;
 static const char *conf_mac_filter;
 
+static inline uint64_t mac_key(const uint8_t *addr)
+{
+	return ((uint64_t)addr[0] << 40) | ((uint64_t)addr[1] << 32) | ((uint64_t)addr[2] << 24) |
+	       ((uint64_t)addr[3] << 16) | ((uint64_t)addr[4] << 8) | (uint64_t)addr[5];
+}
+
+static struct mac_set *set_alloc(int count)
+{
+	struct mac_set *set = _malloc(sizeof(*set) + count * sizeof(uint64_t));
+
+	set->refs = 1;
+	set->count = count;
+
+	return set;
+}
+
+static struct mac_set *set_get(void)
+{
+	struct mac_set *set;
+
+	spin_lock(&set_lock);
+	set = mac_set;
+	__sync_add_and_fetch(&set->refs, 1);
+	spin_unlock(&set_lock);
+
+	return set;
+}
+
+static void set_put(struct mac_set *set)
+{
+	if (__sync_sub_and_fetch(&set->refs, 1) == 0)
+		_free(set);
+}
+
+static void set_replace(struct mac_set *set)
+{
+	struct mac_set *old;
+
+	spin_lock(&set_lock);
+	old = mac_set;
+	mac_set = set;
+	spin_unlock(&set_lock);
+
+	set_put(old);
+}
+
+static int set_find(struct mac_set *set, uint64_t key)
+{
+	int l = 0, r = set->count - 1, m;
+
+	while (l <= r) {
+		m = (l + r) / 2;
+		if (set->addr[m] == key)
+			return m;
+		if (set->addr[m] < key)
+			l = m + 1;
+		else
+			r = m - 1;
+	}
+
+	return -(l + 1);
+}
+
+static int key_cmp(const void *a, const void *b)
+{
+	uint64_t k1 = *(const uint64_t *)a;
+	uint64_t k2 = *(const uint64_t *)b;
+
+	return k1 < k2 ? -1 : k1 > k2;
+}
+
 int mac_filter_check(const uint8_t *addr)
 {
-	struct mac_t *mac;
+	struct mac_set *set;
 	int res = type;
 
 	if (type == -1)
 		return 0;
 
-	pthread_rwlock_rdlock(&lock);
-	list_for_each_entry(mac, &mac_list, entry) {
-		if (memcmp(mac->addr, addr, ETH_ALEN))
-			continue;
+	set = set_get();
+	if (set_find(set, mac_key(addr)) >= 0)
 		res = !type;
-		break;
-	}
-	pthread_rwlock_unlock(&lock);
+	set_put(set);
 
 	return res;
 }
 
+static int parse_mac(const char *str, uint64_t *key)
+{
+	int n[ETH_ALEN];
+	uint8_t a[ETH_ALEN];
+	int i;
+
+	if (sscanf(str, "%x:%x:%x:%x:%x:%x",
+		n + 0, n + 1, n + 2, n + 3, n + 4, n + 5) != 6)
+		return -1;
+
+	for (i = 0; i < ETH_ALEN; i++) {
+		if (n[i] > 255)
+			return -1;
+		a[i] = n[i];
+	}
+
+	*key = mac_key(a);
+
+	return 0;
+}
+
 static int mac_filter_load(const char *opt)
 {
-	struct mac_t *mac;
+	struct mac_set *set;
 	FILE *f;
 	char *c;
 	char *name = _strdup(opt);
 	char *buf = _malloc(1024);
-	int n[ETH_ALEN];
+	uint64_t *keys = NULL;
+	int cnt = 0, size = 0;
 	int i, line = 0;
+	int t;
 
 	c = strstr(name, ",");
 	if (!c)
@@ -62,9 +160,9 @@ static int mac_filter_load(const char *opt)
 	*c = 0;
 
 	if (!strcmp(c + 1, "allow"))
-		type = 1;
+		t = 1;
 	else if (!strcmp(c + 1, "deny"))
-		type = 0;
+		t = 0;
 	else
 		goto err_inval;
 
@@ -76,37 +174,41 @@ static int mac_filter_load(const char *opt)
 
 	conf_mac_filter = opt;
 
-	pthread_rwlock_wrlock(&lock);
-	while (!list_empty(&mac_list)) {
-		mac = list_entry(mac_list.next, typeof(*mac), entry);
-		list_del(&mac->entry);
-		_free(mac);
-	}
-
 	while (fgets(buf, 1024, f)) {
 		line++;
 		if (buf[0] == '#' || buf[0] == ';' || buf[0] == '\n')
 			continue;
-		if (sscanf(buf, "%x:%x:%x:%x:%x:%x",
-			n + 0, n + 1, n + 2, n + 3, n + 4, n + 5) != 6) {
+		if (cnt == size) {
+			size = size ? size * 2 : 1024;
+			keys = _realloc(keys, size * sizeof(*keys));
+		}
+		if (parse_mac(buf, &keys[cnt])) {
 			log_warn("pppoe: mac-filter:%s:%i: address is invalid\n", name, line);
 			continue;
 		}
-		mac = _malloc(sizeof(*mac));
-		for (i = 0; i < ETH_ALEN; i++) {
-			if (n[i] > 255) {
-				log_warn("pppoe: mac-filter:%s:%i: address is invalid\n", name, line);
-				_free(mac);
-				continue;
-			}
-			mac->addr[i] = n[i];
-		}
-		list_add_tail(&mac->entry, &mac_list);
+		cnt++;
 	}
-	pthread_rwlock_unlock(&lock);
 
 	fclose(f);
 
+	if (cnt)
+		qsort(keys, cnt, sizeof(*keys), key_cmp);
+
+	set = set_alloc(cnt);
+	set->count = 0;
+	for (i = 0; i < cnt; i++) {
+		if (i && keys[i] == keys[i - 1])
+			continue;
+		set->addr[set->count++] = keys[i];
+	}
+
+	pthread_mutex_lock(&update_lock);
+	type = t;
+	set_replace(set);
+	pthread_mutex_unlock(&update_lock);
+
+	if (keys)
+		_free(keys);
 	_free(name);
 	_free(buf);
 
@@ -122,72 +224,61 @@ err:
 
 static void mac_filter_add(const char *addr, void *client)
 {
-	int n[ETH_ALEN];
-	struct mac_t *mac;
-	int i;
+	struct mac_set *set, *old;
+	uint64_t key;
+	int pos;
 
-	if (sscanf(addr, "%x:%x:%x:%x:%x:%x",
-		n + 0, n + 1, n + 2, n + 3, n + 4, n + 5) != 6) {
+	if (parse_mac(addr, &key)) {
 		cli_send(client, "invalid format\r\n");
 		return;
 	}
 
-	mac = _malloc(sizeof(*mac));
-	for (i = 0; i < ETH_ALEN; i++) {
-		if (n[i] > 255) {
-			_free(mac);
-			cli_send(client, "invalid format\r\n");
-			return;
-		}
-		mac->addr[i] = n[i];
+	pthread_mutex_lock(&update_lock);
+	old = mac_set;
+	pos = set_find(old, key);
+	if (pos < 0) {
+		pos = -pos - 1;
+		set = set_alloc(old->count + 1);
+		memcpy(set->addr, old->addr, pos * sizeof(uint64_t));
+		set->addr[pos] = key;
+		memcpy(set->addr + pos + 1, old->addr + pos, (old->count - pos) * sizeof(uint64_t));
+		set_replace(set);
 	}
-
-	pthread_rwlock_wrlock(&lock);
-	list_add_tail(&mac->entry, &mac_list);
-	pthread_rwlock_unlock(&lock);
+	pthread_mutex_unlock(&update_lock);
 }
 
 static void mac_filter_del(const char *addr, void *client)
 {
-	int n[ETH_ALEN];
-	uint8_t a[ETH_ALEN];
-	struct mac_t *mac;
-	int i;
-	int found = 0;
+	struct mac_set *set, *old;
+	uint64_t key;
+	int pos;
 
-	if (sscanf(addr, "%x:%x:%x:%x:%x:%x",
-		n + 0, n + 1, n + 2, n + 3, n + 4, n + 5) != 6) {
+	if (parse_mac(addr, &key)) {
 		cli_send(client, "invalid format\r\n");
 		return;
 	}
 
-	for (i = 0; i < ETH_ALEN; i++) {
-		if (n[i] > 255) {
-			cli_send(client, "invalid format\r\n");
-			return;
-		}
-		a[i] = n[i];
+	pthread_mutex_lock(&update_lock);
+	old = mac_set;
+	pos = set_find(old, key);
+	if (pos >= 0) {
+		set = set_alloc(old->count - 1);
+		memcpy(set->addr, old->addr, pos * sizeof(uint64_t));
+		memcpy(set->addr + pos, old->addr + pos + 1, (old->count - pos - 1) * sizeof(uint64_t));
+		set_replace(set);
 	}
+	pthread_mutex_unlock(&update_lock);
 
-	pthread_rwlock_wrlock(&lock);
-	list_for_each_entry(mac, &mac_list, entry) {
-		if (memcmp(a, mac->addr, ETH_ALEN))
-			continue;
-		list_del(&mac->entry);
-		_free(mac);
-		found = 1;
-		break;
-	}
-	pthread_rwlock_unlock(&lock);
-
-	if (!found)
+	if (pos < 0)
 		cli_send(client, "not found\r\n");
 }
 
 static void mac_filter_show(void *client)
 {
-	struct mac_t *mac;
+	struct mac_set *set;
 	const char *filter_type;
+	uint64_t key;
+	int i;
 
 	if (type == 0)
 		filter_type = "deny";
@@ -198,13 +289,14 @@ static void mac_filter_show(void *client)
 
 	cli_sendv(client, "filter type: %s\r\n", filter_type);
 
-	pthread_rwlock_rdlock(&lock);
-	list_for_each_entry(mac, &mac_list, entry) {
+	set = set_get();
+	for (i = 0; i < set->count; i++) {
+		key = set->addr[i];
 		cli_sendv(client, "%02x:%02x:%02x:%02x:%02x:%02x\r\n",
-			mac->addr[0], mac->addr[1], mac->addr[2],
-			mac->addr[3],	mac->addr[4], mac->addr[5]);
+			(int)(key >> 40) & 0xff, (int)(key >> 32) & 0xff, (int)(key >> 24) & 0xff,
+			(int)(key >> 16) & 0xff, (int)(key >> 8) & 0xff, (int)key & 0xff);
 	}
-	pthread_rwlock_unlock(&lock);
+	set_put(set);
 }
 
 static void cmd_help(char * const *fields, int fields_cnt, void *client);
@@ -272,6 +364,10 @@ static void cmd_help(char * const *fields, int fields_cnt, void *client)
 static void init(void)
 {
 	const char *opt = conf_get_opt("pppoe", "mac-filter");
+
+	spinlock_init(&set_lock);
+	mac_set = set_alloc(0);
+
 	if (!opt || mac_filter_load(opt))
 		type = -1;
 
@@ -42,6 +42,7 @@
 
 struct pppoe_conn_t {
 	struct list_head entry;
+	struct list_head hash_entry;
 	struct triton_context_t ctx;
 	struct pppoe_serv_t *serv;
 	uint16_t sid;
@@ -76,6 +77,7 @@ struct delayed_pado_t
 struct padi_t
 {
 	struct list_head entry;
+	struct list_head hash_entry;
 	struct timespec ts;
 	uint8_t addr[ETH_ALEN];
 };
@@ -95,6 +97,7 @@ int conf_ifname_in_sid;
 char *conf_pado_delay;
 int conf_tr101 = 1;
 int conf_padi_limit = 0;
+int conf_disc_batch = 1;
 int conf_mppe = MPPE_UNSET;
 int conf_sid_uppercase = 0;
 static const char *conf_ip_pool;
@@ -134,6 +137,10 @@ static int sid_idx;
 
 static uint8_t bc_addr[ETH_ALEN] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
 
+#define CONN_HASH_MIN 16
+#define PADI_HASH_MIN 16
+#define PADI_HASH_MAX 4096
+
 static void pppoe_send_PADT(struct pppoe_conn_t *conn);
 void pppoe_server_free(struct pppoe_serv_t *serv);
 static int init_secret(struct pppoe_serv_t *serv);
@@ -141,6 +148,49 @@ static void __pppoe_server_start(const char *ifname, const char *opt, void *cli,
 static void pppoe_serv_timeout(struct triton_timer_t *t);
 static void set_vlan_timeout(struct pppoe_serv_t *serv);
 
+static inline struct list_head *cookie_bucket(struct pppoe_serv_t *serv, const uint8_t *cookie)
+{
+	uint32_t h = cookie[0] | (cookie[1] << 8) | (cookie[2] << 16) | ((uint32_t)cookie[3] << 24);
+
+	return &serv->conn_hash[h & (serv->conn_hash_size - 1)];
+}
+
+static inline struct list_head *padi_bucket(struct pppoe_serv_t *serv, const uint8_t *addr)
+{
+	uint32_t h = addr[2] | (addr[3] << 8) | (addr[4] << 16) | ((uint32_t)addr[5] << 24);
+
+	return &serv->padi_hash[(h * 0x9e3779b1u) >> 20 & (serv->padi_hash_size - 1)];
+}
+
+static void padi_hash_init(struct pppoe_serv_t *serv)
+{
+	unsigned int i;
+
+	serv->padi_hash_size = PADI_HASH_MIN;
+	while (serv->padi_hash_size < serv->padi_limit && serv->padi_hash_size < PADI_HASH_MAX)
+		serv->padi_hash_size <<= 1;
+
+	serv->padi_hash = _malloc(serv->padi_hash_size * sizeof(struct list_head));
+	for (i = 0; i < serv->padi_hash_size; i++)
+		INIT_LIST_HEAD(&serv->padi_hash[i]);
+}
+
+static void conn_hash_resize(struct pppoe_serv_t *serv, unsigned int size)
+{
+	struct pppoe_conn_t *conn;
+	unsigned int i;
+
+	_free(serv->conn_hash);
+
+	serv->conn_hash = _malloc(size * sizeof(struct list_head));
+	serv->conn_hash_size = size;
+	for (i = 0; i < size; i++)
+		INIT_LIST_HEAD(&serv->conn_hash[i]);
+
+	list_for_each_entry(conn, &serv->conn_list, entry)
+		list_add(&conn->hash_entry, cookie_bucket(serv, conn->cookie));
+}
+
 static void pppoe_serv_start_timer(struct pppoe_serv_t *serv)
 {
 	pthread_mutex_lock(&serv->lock);
@@ -182,6 +232,7 @@ static void disconnect(struct pppoe_conn_t *conn)
 
 	pthread_mutex_lock(&serv->lock);
 	list_del(&conn->entry);
+	list_del(&conn->hash_entry);
 	serv->conn_cnt--;
 	if (serv->conn_cnt == 0) {
 		if (serv->stopping) {
@@ -424,6 +475,10 @@ static struct pppoe_conn_t *allocate_channel(struct pppoe_serv_t *serv, const ui
 	if (serv->timer.tpd)
 		triton_timer_del(&serv->timer);
 	serv->conn_cnt++;
+	if (serv->conn_cnt > serv->conn_hash_size * 2)
+		conn_hash_resize(serv, serv->conn_hash_size * 2);
+	else
+		list_add(&conn->hash_entry, cookie_bucket(serv, conn->cookie));
 	pthread_mutex_unlock(&serv->lock);
 
 	return conn;
@@ -487,7 +542,7 @@ static struct pppoe_conn_t *find_channel(struct pppoe_serv_t *serv, const uint8_
 {
 	struct pppoe_conn_t *conn;
 
-	list_for_each_entry(conn, &serv->conn_list, entry) {
+	list_for_each_entry(conn, cookie_bucket(serv, cookie), hash_entry) {
 		if (!memcmp(conn->cookie, cookie, COOKIE_LENGTH - 4))
 			return conn;
 	}
@@ -907,6 +962,7 @@ static void pado_timer(struct triton_timer_t *t)
 static int check_padi_limit(struct pppoe_serv_t *serv, uint8_t *addr)
 {
 	struct padi_t *padi;
+	struct list_head *bucket;
 	struct timespec ts;
 
 	if (serv->padi_limit == 0)
@@ -914,10 +970,12 @@ static int check_padi_limit(struct pppoe_serv_t *serv, uint8_t *addr)
 
 	clock_gettime(CLOCK_MONOTONIC, &ts);
 
+	/* padi_list is ordered by arrival time, so only its head may expire */
 	while (!list_empty(&serv->padi_list)) {
 		padi = list_entry(serv->padi_list.next, typeof(*padi), entry);
 		if ((ts.tv_sec - padi->ts.tv_sec) * 1000 + (ts.tv_nsec - padi->ts.tv_nsec) / 1000000 > 1000) {
 			list_del(&padi->entry);
+			list_del(&padi->hash_entry);
 			mempool_free(padi);
 			serv->padi_cnt--;
 			__sync_sub_and_fetch(&total_padi_cnt, 1);
@@ -925,15 +983,22 @@ static int check_padi_limit(struct pppoe_serv_t *serv, uint8_t *addr)
 			break;
 	}
 
-	if (serv->padi_cnt == serv->padi_limit)
+	if (serv->padi_cnt == serv->padi_limit) {
+		serv->stat_padi_drop_limit++;
 		return -1;
+	}
 
-	if (conf_padi_limit && total_padi_cnt >= conf_padi_limit)
+	if (conf_padi_limit && total_padi_cnt >= conf_padi_limit) {
+		serv->stat_padi_drop_limit++;
 		return -1;
+	}
 
-	list_for_each_entry(padi, &serv->padi_list, entry) {
-		if (memcmp(padi->addr, addr, ETH_ALEN) == 0)
+	bucket = padi_bucket(serv, addr);
+	list_for_each_entry(padi, bucket, hash_entry) {
+		if (memcmp(padi->addr, addr, ETH_ALEN) == 0) {
+			serv->stat_padi_drop_dup++;
 			return -1;
+		}
 	}
 
 	padi = mempool_alloc(padi_pool);
@@ -943,13 +1008,16 @@ static int check_padi_limit(struct pppoe_serv_t *serv, uint8_t *addr)
 	padi->ts = ts;
 	memcpy(padi->addr, addr, ETH_ALEN);
 	list_add_tail(&padi->entry, &serv->padi_list);
+	list_add(&padi->hash_entry, bucket);
 	serv->padi_cnt++;
 
 	__sync_add_and_fetch(&total_padi_cnt, 1);
 
 connlimit_check:
-	if (connlimit_loaded && connlimit_check(cl_key_from_mac(addr)))
+	if (connlimit_loaded && connlimit_check(cl_key_from_mac(addr))) {
+		serv->stat_padi_drop_connlimit++;
 		return -1;
+	}
 
 	return 0;
 }
@@ -1523,6 +1591,10 @@ static void __pppoe_server_start(const char *ifname, const char *opt, void *cli,
 	INIT_LIST_HEAD(&serv->padi_list);
 	serv->padi_limit = padi_limit;
 
+	conn_hash_resize(serv, CONN_HASH_MIN);
+	if (serv->padi_limit)
+		padi_hash_init(serv);
+
 	triton_context_register(&serv->ctx, serv);
 
 	serv->disc_sock = pppoe_disc_start(serv);
@@ -1546,6 +1618,8 @@ static void __pppoe_server_start(const char *ifname, const char *opt, void *cli,
 	return;
 
 out_err:
+	_free(serv->conn_hash);
+	_free(serv->padi_hash);
 	_free(serv);
 }
 
@@ -1598,6 +1672,8 @@ void pppoe_server_free(struct pppoe_serv_t *serv)
 	}
 
 	triton_context_unregister(&serv->ctx);
+	_free(serv->conn_hash);
+	_free(serv->padi_hash);
 	_free(serv->ifname);
 	_free(serv);
 }
@@ -2007,6 +2083,12 @@ static void load_config(void)
 	if (opt)
 		conf_padi_limit = atoi(opt);
 
+	opt = conf_get_opt("pppoe", "disc-batch");
+	if (opt && atoi(opt) > 0)
+		conf_disc_batch = atoi(opt);
+	else
+		conf_disc_batch = 1;
+
 	opt = conf_get_opt("pppoe", "sid-uppercase");
 	if (opt)
 		conf_sid_uppercase = atoi(opt);
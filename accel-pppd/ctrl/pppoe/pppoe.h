@@ -89,14 +89,22 @@ struct pppoe_serv_t
 
 	unsigned int conn_cnt;
 	struct list_head conn_list;
+	struct list_head *conn_hash;
+	unsigned int conn_hash_size;
 
 	struct list_head pado_list;
 
 	struct list_head padi_list;
+	struct list_head *padi_hash;
+	unsigned int padi_hash_size;
 	int padi_cnt;
 	int padi_limit;
 	time_t last_padi_limit_warn;
 
+	unsigned long stat_padi_drop_limit;
+	unsigned long stat_padi_drop_dup;
+	unsigned long stat_padi_drop_connlimit;
+
 	int stopping:1;
 	int vlan_mon:1;
 };
@@ -106,6 +114,7 @@ extern char *conf_service_name[255];
 extern int conf_accept_any_service;
 extern char *conf_ac_name;
 extern char *conf_pado_delay;
+extern int conf_disc_batch;
 
 extern unsigned int stat_starting;
 extern unsigned int stat_active;
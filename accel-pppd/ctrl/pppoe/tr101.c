@@ -30,6 +30,46 @@
 #define ACCESS_LOOP_ENCAP             0x90
 #define IFW_SESSION                   0xFE
 
+static const struct {
+	int id;
+	const char *name;
+} attr_names[] = {
+	{ OPT_CIRCUIT_ID, "ADSL-Agent-Circuit-Id" },
+	{ OPT_REMOTE_AGENT_ID, "ADSL-Agent-Remote-Id" },
+	{ OPT_ACTUAL_DATA_RATE_UP, "Actual-Data-Rate-Upstream" },
+	{ OPT_ACTUAL_DATA_RATE_DOWN, "Actual-Data-Rate-Downstream" },
+	{ OPT_MIN_DATA_RATE_UP, "Minimum-Data-Rate-Upstream" },
+	{ OPT_MIN_DATA_RATE_DOWN, "Minimum-Data-Rate-Downstream" },
+	{ OPT_ATT_DATA_RATE_UP, "Attainable-Data-Rate-Upstream" },
+	{ OPT_ATT_DATA_RATE_DOWN, "Attainable-Data-Rate-Downstream" },
+	{ OPT_MAX_DATA_RATE_UP, "Maximum-Data-Rate-Upstream" },
+	{ OPT_MAX_DATA_RATE_DOWN, "Maximum-Data-Rate-Downstream" },
+	{ OPT_MIN_DATA_RATE_UP_LP, "Minimum-Data-Rate-Upstream-Low-Power" },
+	{ OPT_MIN_DATA_RATE_DOWN_LP, "Minimum-Data-Rate-Downstream-Low-Power" },
+	{ OPT_MAX_INTERL_DELAY_UP, "Maximum-Interleaving-Delay-Upstream" },
+	{ OPT_ACTUAL_INTERL_DELAY_UP, "Actual-Interleaving-Delay-Upstream" },
+	{ OPT_MAX_INTER_DELAY_DOWN, "Maximum-Interleaving-Delay-Downstream" },
+	{ OPT_ACTUAL_INTER_DELAY_DOWN, "Actual-Interleaving-Delay-Downstream" },
+	{ ACCESS_LOOP_ENCAP, "Access-Loop-Encapsulation" },
+	{ IFW_SESSION, "IWF-Session" },
+};
+
+/* dictionary handles indexed by sub-option id, resolved on first use
+ * since the radius dictionary is loaded by the radius module */
+static struct rad_dict_attr_t *attrs[256];
+static int attrs_resolved;
+
+static void resolve_attrs(void)
+{
+	int i;
+
+	for (i = 0; i < sizeof(attr_names) / sizeof(attr_names[0]); i++)
+		attrs[attr_names[i].id] = rad_dict_attr("ADSL-Forum", attr_names[i].name);
+
+	__sync_synchronize();
+	attrs_resolved = 1;
+}
+
 static int tr101_send_request(struct pppoe_tag *tr101, struct rad_packet_t *pack, int type)
 {
 	uint8_t *ptr = (uint8_t *)tr101->tag_data + 4;
@@ -37,6 +77,9 @@ static int tr101_send_request(struct pppoe_tag *tr101, struct rad_packet_t *pack
 	int id, len;
 	char str[64];
 
+	if (!attrs_resolved)
+		resolve_attrs();
+
 	while (ptr < endptr) {
 		if (ptr + 2 > endptr)
 			goto inval;
@@ -61,7 +104,7 @@ static int tr101_send_request(struct pppoe_tag *tr101, struct rad_packet_t *pack
 					goto inval;
 				memcpy(str, ptr, len);
 				str[len] = 0;
-				if (rad_packet_add_str(pack, "ADSL-Forum", "ADSL-Agent-Circuit-Id", str))
+				if (rad_packet_add_attr_str(pack, attrs[id], str))
 					return -1;
 				break;
 			case OPT_REMOTE_AGENT_ID:
@@ -69,91 +112,91 @@ static int tr101_send_request(struct pppoe_tag *tr101, struct rad_packet_t *pack
 					goto inval;
 				memcpy(str, ptr, len);
 				str[len] = 0;
-				if (rad_packet_add_str(pack, "ADSL-Forum", "ADSL-Agent-Remote-Id", str))
+				if (rad_packet_add_attr_str(pack, attrs[id], str))
 					return -1;
 				break;
 			case OPT_ACTUAL_DATA_RATE_UP:
 				if (len != 4)
 					goto inval;
-				if (rad_packet_add_int(pack, "ADSL-Forum", "Actual-Data-Rate-Upstream", ntohl(*(uint32_t *)ptr)))
+				if (rad_packet_add_attr_int(pack, attrs[id], ntohl(*(uint32_t *)ptr)))
 					return -1;
 				break;
 			case OPT_ACTUAL_DATA_RATE_DOWN:
 				if (len != 4)
 					goto inval;
-				if (rad_packet_add_int(pack, "ADSL-Forum", "Actual-Data-Rate-Downstream", ntohl(*(uint32_t *)ptr)))
+				if (rad_packet_add_attr_int(pack, attrs[id], ntohl(*(uint32_t *)ptr)))
 					return -1;
 				break;
 			case OPT_MIN_DATA_RATE_UP:
 				if (len != 4)
 					goto inval;
-				if (rad_packet_add_int(pack, "ADSL-Forum", "Minimum-Data-Rate-Upstream", ntohl(*(uint32_t *)ptr)))
+				if (rad_packet_add_attr_int(pack, attrs[id], ntohl(*(uint32_t *)ptr)))
 					return -1;
 				break;
 			case OPT_MIN_DATA_RATE_DOWN:
 				if (len != 4)
 					goto inval;
-				if (rad_packet_add_int(pack, "ADSL-Forum", "Minimum-Data-Rate-Downstream", ntohl(*(uint32_t *)ptr)))
+				if (rad_packet_add_attr_int(pack, attrs[id], ntohl(*(uint32_t *)ptr)))
 					return -1;
 				break;
 			case OPT_ATT_DATA_RATE_UP:
 				if (len != 4)
 					goto inval;
-				if (rad_packet_add_int(pack, "ADSL-Forum", "Attainable-Data-Rate-Upstream", ntohl(*(uint32_t *)ptr)))
+				if (rad_packet_add_attr_int(pack, attrs[id], ntohl(*(uint32_t *)ptr)))
 					return -1;
 				break;
 			case OPT_ATT_DATA_RATE_DOWN:
 				if (len != 4)
 					goto inval;
-				if (rad_packet_add_int(pack, "ADSL-Forum", "Attainable-Data-Rate-Downstream", ntohl(*(uint32_t *)ptr)))
+				if (rad_packet_add_attr_int(pack, attrs[id], ntohl(*(uint32_t *)ptr)))
 					return -1;
 				break;
 			case OPT_MAX_DATA_RATE_UP:
 				if (len != 4)
 					goto inval;
-				if (rad_packet_add_int(pack, "ADSL-Forum", "Maximum-Data-Rate-Upstream", ntohl(*(uint32_t *)ptr)))
+				if (rad_packet_add_attr_int(pack, attrs[id], ntohl(*(uint32_t *)ptr)))
 					return -1;
 				break;
 			case OPT_MAX_DATA_RATE_DOWN:
 				if (len != 4)
 					goto inval;
-				if (rad_packet_add_int(pack, "ADSL-Forum", "Maximum-Data-Rate-Downstream", ntohl(*(uint32_t *)ptr)))
+				if (rad_packet_add_attr_int(pack, attrs[id], ntohl(*(uint32_t *)ptr)))
 					return -1;
 				break;
 			case OPT_MIN_DATA_RATE_UP_LP:
 				if (len != 4)
 					goto inval;
-				if (rad_packet_add_int(pack, "ADSL-Forum", "Minimum-Data-Rate-Upstream-Low-Power", ntohl(*(uint32_t *)ptr)))
+				if (rad_packet_add_attr_int(pack, attrs[id], ntohl(*(uint32_t *)ptr)))
 					return -1;
 				break;
 			case OPT_MIN_DATA_RATE_DOWN_LP:
 				if (len != 4)
 					goto inval;
-				if (rad_packet_add_int(pack, "ADSL-Forum", "Minimum-Data-Rate-Downstream-Low-Power", ntohl(*(uint32_t *)ptr)))
+				if (rad_packet_add_attr_int(pack, attrs[id], ntohl(*(uint32_t *)ptr)))
 					return -1;
 				break;
 			case OPT_MAX_INTERL_DELAY_UP:
 				if (len != 4)
 					goto inval;
-				if (rad_packet_add_int(pack, "ADSL-Forum", "Maximum-Interleaving-Delay-Upstream", ntohl(*(uint32_t *)ptr)))
+				if (rad_packet_add_attr_int(pack, attrs[id], ntohl(*(uint32_t *)ptr)))
 					return -1;
 				break;
 			case OPT_ACTUAL_INTERL_DELAY_UP:
 				if (len != 4)
 					goto inval;
-				if (rad_packet_add_int(pack, "ADSL-Forum", "Actual-Interleaving-Delay-Upstream", ntohl(*(uint32_t *)ptr)))
+				if (rad_packet_add_attr_int(pack, attrs[id], ntohl(*(uint32_t *)ptr)))
 					return -1;
 				break;
 			case OPT_MAX_INTER_DELAY_DOWN:
 				if (len != 4)
 					goto inval;
-				if (rad_packet_add_int(pack, "ADSL-Forum", "Maximum-Interleaving-Delay-Downstream", ntohl(*(uint32_t *)ptr)))
+				if (rad_packet_add_attr_int(pack, attrs[id], ntohl(*(uint32_t *)ptr)))
 					return -1;
 				break;
 			case OPT_ACTUAL_INTER_DELAY_DOWN:
 				if (len != 4)
 					goto inval;
-				if (rad_packet_add_int(pack, "ADSL-Forum", "Actual-Interleaving-Delay-Downstream", ntohl(*(uint32_t *)ptr)))
+				if (rad_packet_add_attr_int(pack, attrs[id], ntohl(*(uint32_t *)ptr)))
 					return -1;
 				break;
 			case ACCESS_LOOP_ENCAP:
@@ -173,13 +216,13 @@ static int tr101_send_request(struct pppoe_tag *tr101, struct rad_packet_t *pack
 				 * RFC 4679 format would require conversion.
 				 */
 				memcpy(str, ptr, 3);
-				if (rad_packet_add_octets(pack, "ADSL-Forum", "Access-Loop-Encapsulation", (uint8_t *)str, 3))
+				if (rad_packet_add_attr_octets(pack, attrs[id], (uint8_t *)str, 3))
 					return -1;
 				break;
 			case IFW_SESSION:
 				if (len != 0)
 					goto inval;
-				if (rad_packet_add_octets(pack, "ADSL-Forum", "IWF-Session", NULL, 0))
+				if (rad_packet_add_attr_octets(pack, attrs[id], NULL, 0))
 					return -1;
 				break;
 		}
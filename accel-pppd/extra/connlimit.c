@@ -7,10 +7,16 @@
 #include "ppp.h"
 #include "events.h"
 #include "triton.h"
+#include "spinlock.h"
+#include "mempool.h"
 #include "log.h"
+#include "cli.h"
 
 #include "memdebug.h"
 
+#define HASH_BITS 12
+#define HASH_SIZE (1 << HASH_BITS)
+
 struct item
 {
 	struct list_head entry;
@@ -19,90 +25,137 @@ struct item
 	int count;
 };
 
+/*
+ * Items within a bucket are kept ordered by ts (most recent first),
+ * so expired items are always at the tail of the bucket.
+ */
+struct bucket
+{
+	spinlock_t lock;
+	struct list_head items;
+};
+
 static int conf_burst = 3;
 static int conf_burst_timeout = 60 * 1000;
 static int conf_limit_timeout = 5000;
 
-static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
-static LIST_HEAD(items);
+static struct bucket *hash;
+static unsigned int sweep_pos;
+static mempool_t item_pool;
+
+static unsigned int stat_entries;
+static unsigned long stat_accept;
+static unsigned long stat_drop;
+static unsigned long stat_evict;
+
+static inline struct bucket *key_bucket(uint64_t key)
+{
+	return &hash[(key * 0x9e3779b97f4a7c15ull) >> (64 - HASH_BITS)];
+}
+
+static inline unsigned int elapsed(struct timespec *ts, struct timespec *it_ts)
+{
+	return (ts->tv_sec - it_ts->tv_sec) * 1000 + (ts->tv_nsec - it_ts->tv_nsec) / 1000000;
+}
+
+static void expire_bucket(struct bucket *b, struct timespec *ts, struct list_head *tmp_list)
+{
+	struct item *it;
+
+	while (!list_empty(&b->items)) {
+		it = list_entry(b->items.prev, typeof(*it), entry);
+		if (elapsed(ts, &it->ts) < conf_burst_timeout)
+			break;
+		log_debug("connlimit: remove %" PRIu64 "\n", it->key);
+		list_move(&it->entry, tmp_list);
+	}
+}
 
 int __export connlimit_check(uint64_t key)
 {
+	struct bucket *b = key_bucket(key);
+	struct bucket *s;
 	struct item *it;
 	struct timespec ts;
-	unsigned int d;
-	struct list_head *pos, *n;
 	LIST_HEAD(tmp_list);
 	int r = 1;
 
-
 	clock_gettime(CLOCK_MONOTONIC, &ts);
 
-	pthread_mutex_lock(&lock);
+	/* expire one more bucket per call so idle keys don't accumulate */
+	s = &hash[__sync_fetch_and_add(&sweep_pos, 1) & (HASH_SIZE - 1)];
+	if (s != b) {
+		spin_lock(&s->lock);
+		expire_bucket(s, &ts, &tmp_list);
+		spin_unlock(&s->lock);
+	}
+
+	spin_lock(&b->lock);
 	log_debug("connlimit: check entry %" PRIu64 "\n", key);
-	list_for_each_safe(pos, n, &items) {
-		it = list_entry(pos, typeof(*it), entry);
+	expire_bucket(b, &ts, &tmp_list);
 
-		d = (ts.tv_sec - it->ts.tv_sec) * 1000 + (ts.tv_nsec - it->ts.tv_nsec) / 1000000;
+	list_for_each_entry(it, &b->items, entry) {
+		if (it->key != key)
+			continue;
 
-		if (it->key == key) {
-			if (d >= conf_burst_timeout) {
+		it->count++;
+		if (it->count >= conf_burst) {
+			if (elapsed(&ts, &it->ts) >= conf_limit_timeout) {
 				it->ts = ts;
-				list_move(&it->entry, &items);
-				it->count = 0;
+				list_move(&it->entry, &b->items);
 				r = 0;
-				break;
-			}
-			it->count++;
-			if (it->count >= conf_burst) {
-				if (d >= conf_limit_timeout) {
-					it->ts = ts;
-					list_move(&it->entry, &items);
-					r = 0;
-				} else
-					r = -1;
 			} else
-				r = 0;
-			break;
-		}
-
-		if (d > conf_burst_timeout) {
-			log_debug("connlimit: remove %" PRIu64 "\n", it->key);
-			list_move(&it->entry, &tmp_list);
-		}
+				r = -1;
+		} else
+			r = 0;
+		break;
 	}
-	pthread_mutex_unlock(&lock);
 
 	if (r == 1) {
-		it = _malloc(sizeof(*it));
+		it = mempool_alloc(item_pool);
 		memset(it, 0, sizeof(*it));
 		it->ts = ts;
 		it->key = key;
 
 		log_debug("connlimit: add entry %" PRIu64 "\n", key);
 
-		pthread_mutex_lock(&lock);
-		list_add(&it->entry, &items);
-		pthread_mutex_unlock(&lock);
+		list_add(&it->entry, &b->items);
+		__sync_add_and_fetch(&stat_entries, 1);
 
 		r = 0;
 	}
+	spin_unlock(&b->lock);
 
-	if (r == 0)
+	if (r == 0) {
+		__sync_add_and_fetch(&stat_accept, 1);
 		log_debug("connlimit: accept %" PRIu64 "\n", key);
-	else
+	} else {
+		__sync_add_and_fetch(&stat_drop, 1);
 		log_debug("connlimit: drop %" PRIu64 "\n", key);
-
+	}
 
 	while (!list_empty(&tmp_list)) {
 		it = list_entry(tmp_list.next, typeof(*it), entry);
 		list_del(&it->entry);
-		_free(it);
+		mempool_free(it);
+		__sync_sub_and_fetch(&stat_entries, 1);
+		__sync_add_and_fetch(&stat_evict, 1);
 	}
 
 	return r;
 }
 
+static int show_stat_exec(const char *cmd, char * const *fields, int fields_cnt, void *client)
+{
+	cli_send(client, "connlimit:\r\n");
+	cli_sendv(client, "  entries: %u\r\n", stat_entries);
+	cli_sendv(client, "  accept: %lu\r\n", stat_accept);
+	cli_sendv(client, "  drop: %lu\r\n", stat_drop);
+	cli_sendv(client, "  evict: %lu\r\n", stat_evict);
+
+	return CLI_CMD_OK;
+}
+
 static int parse_limit(const char *opt, int *limit, int *time)
 {
 	char *endptr;
@@ -164,8 +217,20 @@ static void load_config()
 
 static void init()
 {
+	int i;
+
+	hash = _malloc(HASH_SIZE * sizeof(*hash));
+	for (i = 0; i < HASH_SIZE; i++) {
+		spinlock_init(&hash[i].lock);
+		INIT_LIST_HEAD(&hash[i].items);
+	}
+
+	item_pool = mempool_create(sizeof(struct item));
+
 	load_config();
 
+	cli_register_simple_cmd2(show_stat_exec, NULL, 2, "show", "stat");
+
 	triton_event_register_handler(EV_CONFIG_RELOAD, (triton_event_func)load_config);
 }
 
@@ -3,12 +3,16 @@
 #include <stdint.h>
 #include <unistd.h>
 #include <string.h>
+#include <pthread.h>
 #include <arpa/inet.h>
 
+#include "triton.h"
 #include "events.h"
+#include "cli.h"
 #include "log.h"
 #include "list.h"
 #include "spinlock.h"
+#include "mempool.h"
 #include "backup.h"
 #include "ap_session_backup.h"
 
@@ -20,61 +24,117 @@
 
 #include "memdebug.h"
 
-struct ippool_t;
+#define ALLOC_P2P   0
+#define ALLOC_NET30 1
 
-typedef void (*generate_func)(struct ippool_t *);
+/* Addresses of all ranges of a pool form one sequence, as if the ranges
+ * were concatenated in configuration order. Items of the pool are
+ * positions in that sequence (every position for p2p, every 4th for
+ * net30) and their state is kept in a bitmap, so memory is one bit per
+ * item and nothing is pre-generated. */
+struct ippool_range_t
+{
+	uint32_t startip;
+	uint32_t cnt;
+	uint32_t pos;
+};
+
+struct ippool_layout_t
+{
+	int allocator;
+	int range_cnt;
+	struct ippool_range_t *ranges;
+	uint32_t addr_cnt;
+	uint32_t gw_cnt;
+	in_addr_t gw_addr;
+	uint32_t size;
+	int reserved;
+
+	uint32_t words;
+	uint32_t full_words;
+	uint64_t *map;  /* bit is set if item is in use */
+	uint64_t *full; /* bit is set if word of map is full */
+	uint32_t free_cnt;
+	uint32_t cursor;
+};
 
 struct ippool_t
 {
 	struct list_head entry;
 	char *name;
-	struct list_head gw_list;
-	struct list_head tunnel_list;
-	struct list_head items;
-	uint32_t startip;
-	uint32_t endip;
 	struct ippool_t *next;
-	generate_func generate;
 	spinlock_t lock;
+	struct ippool_layout_t *l;
+	unsigned int gen;
+	int exhausted;
+
+	/* configuration being loaded */
+	struct ippool_layout_t *nl;
+	struct ippool_t *nnext;
 };
 
 struct ippool_item_t
 {
-	struct list_head entry;
 	struct ippool_t *pool;
+	uint32_t idx;
+	unsigned int gen;
 	struct ipv4db_item_t it;
 };
 
-struct ipaddr_t
-{
-	struct list_head entry;
-	in_addr_t addr;
-};
-
 static struct ipdb_t ipdb;
 
 static in_addr_t conf_gw_ip_address;
 static int conf_shuffle;
+static int conf_sticky;
+static int conf_loaded;
 
 #ifdef RADIUS
 static int conf_vendor = 0;
 static int conf_attr = 88; // Framed-Pool
 #endif
 
-static int cnt;
 static LIST_HEAD(pool_list);
 static struct ippool_t *def_pool;
+/* protects pool_list and next links of pools, changed on reload */
+static pthread_rwlock_t pool_lock = PTHREAD_RWLOCK_INITIALIZER;
+static mempool_t item_pool;
+
+/* totals over all pools, excluding reserved gw-ip-address */
+static unsigned int stat_size;
+static unsigned int stat_used;
+static unsigned int stat_free;
+
+static __thread uint32_t rnd_state;
 
-struct ippool_t *create_pool(char *name)
+static struct ippool_layout_t *layout_alloc(void)
 {
-	struct ippool_t *p = malloc(sizeof(*p));
+	struct ippool_layout_t *l = _malloc(sizeof(*l));
+
+	memset(l, 0, sizeof(*l));
+	l->reserved = -1;
+
+	return l;
+}
+
+static void layout_free(struct ippool_layout_t *l)
+{
+	if (l->ranges)
+		_free(l->ranges);
+	if (l->map)
+		_free(l->map);
+	if (l->full)
+		_free(l->full);
+	_free(l);
+}
+
+static struct ippool_t *create_pool(char *name)
+{
+	struct ippool_t *p = _malloc(sizeof(*p));
 
 	memset(p, 0, sizeof(*p));
 	p->name = name;
+	p->l = layout_alloc();
 
-	INIT_LIST_HEAD(&p->gw_list);
-	INIT_LIST_HEAD(&p->tunnel_list);
-	INIT_LIST_HEAD(&p->items);
 	spinlock_init(&p->lock);
 
 	if (name)
@@ -83,7 +143,7 @@ struct ippool_t *create_pool(char *name)
 	return p;
 }
 
-struct ippool_t *find_pool(char *name, int create)
+static struct ippool_t *find_pool(const char *name, int create)
 {
 	struct ippool_t *p;
 
@@ -93,7 +153,7 @@ struct ippool_t *find_pool(char *name, int create)
 	}
 
 	if (create)
-		return create_pool(name);
+		return create_pool(_strdup(name));
 
 	return NULL;
 }
@@ -158,179 +218,302 @@ static int parse2(const char *str, uint32_t *begin, uint32_t *end)
 	return 0;
 }
 
-static void add_range(struct ippool_t *p, struct list_head *list, const char *name, void (*generate)(struct ippool_t *))
+static int add_range(struct ippool_layout_t *l, int gw, const char *name, int allocator)
 {
-	uint32_t i,startip, endip;
-	struct ipaddr_t *ip;
+	uint32_t startip, endip;
+	struct ippool_range_t *r;
 
 	if (parse1(name, &startip, &endip)) {
 		if (parse2(name, &startip, &endip)) {
-			fprintf(stderr, "ippool: cann't parse '%s'\n", name);
-			_exit(EXIT_FAILURE);
+			log_emerg("ippool: cann't parse '%s'\n", name);
+			return -1;
 		}
 	}
 
-	for (i = startip; i <= endip; i++) {
-		ip = malloc(sizeof(*ip));
-		ip->addr = htonl(i);
-		list_add_tail(&ip->entry, list);
-		cnt++;
+	l->allocator = allocator;
+
+	if (gw) {
+		l->gw_cnt += endip - startip + 1;
+		return 0;
+	}
+
+	if (endip - startip + 1 > UINT32_MAX / 2 - l->addr_cnt) {
+		log_emerg("ippool: '%s': pool is too large\n", name);
+		return -1;
+	}
+
+	r = _realloc(l->ranges, (l->range_cnt + 1) * sizeof(*r));
+	if (!r) {
+		log_emerg("ippool: out of memory\n");
+		return -1;
 	}
 
-	p->startip = startip;
-	p->endip = endip;
-	p->generate = generate;
+	l->ranges = r;
+	r += l->range_cnt++;
+	r->startip = startip;
+	r->cnt = endip - startip + 1;
+	r->pos = l->addr_cnt;
+	l->addr_cnt += r->cnt;
+
+	return 0;
 }
 
-static uint8_t get_random()
+static in_addr_t pos_to_addr(struct ippool_layout_t *l, uint32_t pos)
 {
-	static uint8_t buf[128];
-	static int pos = 0;
-	int r;
+	int lo = 0, hi = l->range_cnt - 1, i;
 
-	if (pos == 0)
-		read(urandom_fd, buf, 128);
+	while (lo < hi) {
+		i = (lo + hi + 1) / 2;
+		if (l->ranges[i].pos <= pos)
+			lo = i;
+		else
+			hi = i - 1;
+	}
 
-	r = buf[pos++];
+	return htonl(l->ranges[lo].startip + pos - l->ranges[lo].pos);
+}
 
-	if (pos == 128)
-		pos = 0;
+static in_addr_t idx_to_addr(struct ippool_layout_t *l, uint32_t idx)
+{
+	if (l->allocator == ALLOC_NET30)
+		return pos_to_addr(l, idx * 4 + 2);
 
-	return r;
+	return pos_to_addr(l, idx);
 }
 
-static void generate_pool_p2p(struct ippool_t *p)
+static int addr_to_idx(struct ippool_layout_t *l, in_addr_t addr)
 {
-	struct ippool_item_t *it;
-	struct ipaddr_t *addr = NULL;
-	struct ipaddr_t *peer_addr;
-	struct list_head *pos, *pos1 = p->tunnel_list.next, *pos2 = p->tunnel_list.prev;
-	uint8_t r, t = 0;
-
-	while (1) {
-		if (list_empty(&p->tunnel_list))
-			break;
-		else {
-			if (conf_shuffle) {
-				if (pos1 == &p->tunnel_list)
-					pos1 = pos1->next;
+	uint32_t a = ntohl(addr), pos;
+	int i;
 
-				if (pos2 == &p->tunnel_list)
-					pos2 = pos2->prev;
+	for (i = 0; i < l->range_cnt; i++) {
+		if (a < l->ranges[i].startip || a - l->ranges[i].startip >= l->ranges[i].cnt)
+			continue;
 
-				if (t++ < 10)
-					r = get_random();
-				else
-					r = get_random()%64;
+		pos = l->ranges[i].pos + a - l->ranges[i].startip;
 
-				if (r < 32)
-					pos = pos1;
-				else if (r < 64)
-					pos = pos2;
+		if (l->allocator == ALLOC_NET30) {
+			if (pos % 4 != 2)
+				continue;
+			pos /= 4;
+		}
 
-				pos1 = pos1->next;
-				pos2 = pos2->prev;
+		if (pos < l->size)
+			return pos;
+	}
 
-				if (r >= 64)
-					continue;
+	return -1;
+}
 
-				peer_addr = list_entry(pos, typeof(*peer_addr), entry);
-				if (pos == pos1)
-					pos1 = pos1->next;
+static int map_test(struct ippool_layout_t *l, uint32_t idx)
+{
+	return (l->map[idx / 64] >> (idx % 64)) & 1;
+}
 
-				if (pos == pos2)
-					pos2 = pos2->prev;
+static void map_set(struct ippool_layout_t *l, uint32_t idx)
+{
+	uint32_t w = idx / 64;
 
-				list_del(&peer_addr->entry);
-				t = 0;
-			} else {
-				peer_addr = list_entry(p->tunnel_list.next, typeof(*peer_addr), entry);
-				list_del(&peer_addr->entry);
-			}
-		}
+	l->map[w] |= 1ull << (idx % 64);
+	if (l->map[w] == ~0ull)
+		l->full[w / 64] |= 1ull << (w % 64);
+	l->free_cnt--;
+}
 
-		if (!conf_gw_ip_address) {
-			if (list_empty(&p->gw_list))
-				break;
-			else {
-				addr = list_entry(p->gw_list.next, typeof(*addr), entry);
-				list_del(&addr->entry);
-			}
-		} else if (conf_gw_ip_address == peer_addr->addr)
-			continue;
+static void map_clear(struct ippool_layout_t *l, uint32_t idx)
+{
+	uint32_t w = idx / 64;
 
-		it = malloc(sizeof(*it));
-		if (!it) {
-			fprintf(stderr, "ippool: out of memory\n");
-			break;
-		}
+	l->map[w] &= ~(1ull << (idx % 64));
+	l->full[w / 64] &= ~(1ull << (w % 64));
+	l->free_cnt++;
+}
 
-		memset(it, 0, sizeof(*it));
-		it->pool = p;
-		it->it.owner = &ipdb;
-		if (conf_gw_ip_address)
-			it->it.addr = conf_gw_ip_address;
-		else
-			it->it.addr = addr->addr;
+/* first word at or after 'w' having a free item */
+static int map_find_word(struct ippool_layout_t *l, uint32_t w)
+{
+	uint32_t fw = w / 64;
+	uint64_t m;
 
-		it->it.peer_addr = peer_addr->addr;
+	if (w >= l->words)
+		return -1;
 
-		list_add_tail(&it->entry, &p->items);
+	m = ~l->full[fw] & (~0ull << (w % 64));
+	while (!m) {
+		if (++fw == l->full_words)
+			return -1;
+		m = ~l->full[fw];
 	}
+
+	return fw * 64 + __builtin_ctzll(m);
 }
 
-static void generate_pool_net30(struct ippool_t *p)
+/* first free item at or after 'start', wrapping around */
+static int map_find(struct ippool_layout_t *l, uint32_t start)
 {
-	struct ippool_item_t *it;
-	struct ipaddr_t *addr[4];
+	uint32_t w = start / 64;
+	uint64_t m;
 	int i;
 
-	while (1) {
-		memset(addr, 0, sizeof(addr));
+	if (!l->free_cnt)
+		return -1;
 
-		for (i = 0; i < 4; i++) {
-			if (list_empty(&p->tunnel_list))
-				break;
+	m = ~l->map[w] & (~0ull << (start % 64));
+	if (m)
+		return w * 64 + __builtin_ctzll(m);
 
-			addr[i] = list_entry(p->tunnel_list.next, typeof(*addr[i]), entry);
-			list_del(&addr[i]->entry);
-		}
+	i = map_find_word(l, w + 1);
+	if (i < 0)
+		i = map_find_word(l, 0);
 
-		if (!addr[2])
-			break;
+	return i * 64 + __builtin_ctzll(~l->map[i]);
+}
 
+static int layout_build(struct ippool_layout_t *l)
+{
+	uint32_t i;
 
-		it = malloc(sizeof(*it));
-		if (!it) {
-			log_emerg("ippool: out of memory\n");
-			break;
-		}
+	if (l->allocator == ALLOC_NET30)
+		l->size = l->addr_cnt / 4 + (l->addr_cnt % 4 == 3);
+	else if (!l->gw_addr)
+		l->size = l->addr_cnt < l->gw_cnt ? l->addr_cnt : l->gw_cnt;
+	else
+		l->size = l->addr_cnt;
 
-		memset(it, 0, sizeof(*it));
-		it->pool = p;
-		it->it.owner = &ipdb;
-		it->it.addr = addr[1]->addr;
-		it->it.peer_addr = addr[2]->addr;
+	l->words = (l->size + 63) / 64;
+	l->full_words = (l->words + 63) / 64;
+	l->free_cnt = l->size;
+
+	if (!l->size)
+		return 0;
+
+	l->map = _malloc(l->words * sizeof(uint64_t));
+	l->full = _malloc(l->full_words * sizeof(uint64_t));
+	if (!l->map || !l->full) {
+		log_emerg("ippool: out of memory\n");
+		return -1;
+	}
+
+	memset(l->map, 0, l->words * sizeof(uint64_t));
+	memset(l->full, 0, l->full_words * sizeof(uint64_t));
 
-		list_add_tail(&it->entry, &p->items);
+	/* tail bits past the last item are never free */
+	if (l->size % 64)
+		l->map[l->words - 1] = ~0ull << (l->size % 64);
+	if (l->words % 64)
+		l->full[l->full_words - 1] = ~0ull << (l->words % 64);
+
+	if (l->allocator == ALLOC_P2P && l->gw_addr) {
+		l->reserved = addr_to_idx(l, l->gw_addr);
+		if (l->reserved >= 0)
+			map_set(l, l->reserved);
+	}
+
+	for (i = 0; i < l->words; i++) {
+		if (l->map[i] == ~0ull)
+			l->full[i / 64] |= 1ull << (i % 64);
+	}
+
+	return 0;
+}
 
-		for (i = 0; i < 4; i++) {
-			if (addr[i])
-				free(addr[i]);
+static int layout_equal(struct ippool_layout_t *l1, struct ippool_layout_t *l2)
+{
+	if (l1->allocator != l2->allocator || l1->addr_cnt != l2->addr_cnt ||
+	    l1->gw_cnt != l2->gw_cnt || l1->gw_addr != l2->gw_addr ||
+	    l1->range_cnt != l2->range_cnt)
+		return 0;
+
+	if (!l1->range_cnt)
+		return 1;
+
+	return !memcmp(l1->ranges, l2->ranges, l1->range_cnt * sizeof(*l1->ranges));
+}
+
+/* carry addresses in use over to the new layout of the pool */
+static void layout_migrate(struct ippool_layout_t *l, struct ippool_layout_t *nl)
+{
+	uint32_t w, idx;
+	uint64_t m;
+	int i;
+
+	for (w = 0; w < l->words; w++) {
+		for (m = l->map[w]; m; m &= m - 1) {
+			idx = w * 64 + __builtin_ctzll(m);
+			if (idx >= l->size || (int)idx == l->reserved)
+				continue;
+
+			i = addr_to_idx(nl, idx_to_addr(l, idx));
+			if (i >= 0 && !map_test(nl, i))
+				map_set(nl, i);
 		}
 	}
+}
 
-	for (i = 0; i < 4; i++) {
-		if (addr[i])
-			free(addr[i]);
+static uint32_t layout_size(struct ippool_layout_t *l)
+{
+	return l->size - (l->reserved >= 0);
+}
+
+static uint32_t layout_used(struct ippool_layout_t *l)
+{
+	return l->size - l->free_cnt - (l->reserved >= 0);
+}
+
+static void stat_update(int size, int used)
+{
+	__sync_add_and_fetch(&stat_size, size);
+	__sync_add_and_fetch(&stat_used, used);
+	__sync_add_and_fetch(&stat_free, size - used);
+}
+
+static uint32_t get_random(void)
+{
+	uint32_t x = rnd_state;
+
+	if (!x) {
+		read(urandom_fd, &x, sizeof(x));
+		x |= 1;
 	}
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+
+	rnd_state = x;
+
+	return x;
 }
 
+static uint32_t sticky_hash(struct ap_session *ses)
+{
+	const char *key = ses->username ? ses->username : ses->ctrl->calling_station_id;
+	uint32_t h = 2166136261u;
+
+	if (!key)
+		return 0;
+
+	for (; *key; key++)
+		h = (h ^ (uint8_t)*key) * 16777619u;
+
+	return h;
+}
 
 static struct ipv4db_item_t *get_ip(struct ap_session *ses)
 {
 	struct ippool_item_t *it;
-	struct ippool_t *p;
+	struct ippool_layout_t *l;
+	struct ippool_t *p, *first;
+	uint32_t start = 0, h = 0;
+	int idx, skipped = 0, nocache = 0;
+
+	it = mempool_alloc(item_pool);
+	if (!it) {
+		log_emerg("ippool: out of memory\n");
+		return NULL;
+	}
+
+	pthread_rwlock_rdlock(&pool_lock);
 
 	if (ses->ipv4_pool_name)
 		p = find_pool(ses->ipv4_pool_name, 0);
@@ -338,18 +521,55 @@ static struct ipv4db_item_t *get_ip(struct ap_session *ses)
 		p = def_pool;
 
 	if (!p)
-		return NULL;
+		goto out_free;
+
+	first = p;
+
+	memset(it, 0, sizeof(*it));
+
+	if (conf_sticky)
+		h = sticky_hash(ses);
+	else if (conf_shuffle)
+		h = get_random();
 
 again:
+	/* exhausted pools are passed without locking, unless every pool of
+	 * the chain was found exhausted this way */
+	if (p->exhausted && !nocache) {
+		skipped = 1;
+		idx = -1;
+		goto next;
+	}
+
 	spin_lock(&p->lock);
-	if (!list_empty(&p->items)) {
-		it = list_entry(p->items.next, typeof(*it), entry);
-		list_del(&it->entry);
+	l = p->l;
+	if (l->size) {
+		if (conf_sticky || conf_shuffle)
+			start = h % l->size;
+		else
+			start = l->cursor;
+	}
+
+	idx = map_find(l, start);
+	if (idx >= 0) {
+		map_set(l, idx);
+		l->cursor = idx + 1 == l->size ? 0 : idx + 1;
+		it->pool = p;
+		it->idx = idx;
+		it->gen = p->gen;
+		it->it.peer_addr = idx_to_addr(l, idx);
 	} else
-		it = NULL;
+		p->exhausted = 1;
 	spin_unlock(&p->lock);
 
-	if (it) {
+next:
+	if (idx >= 0) {
+		pthread_rwlock_unlock(&pool_lock);
+
+		stat_update(0, 1);
+
+		it->it.owner = &ipdb;
+
 		if (ses->ctrl->ppp)
 			it->it.addr = conf_gw_ip_address;
 		else
@@ -361,18 +581,46 @@ again:
 	} else if (p->next) {
 		p = p->next;
 		goto again;
+	} else if (skipped && !nocache) {
+		nocache = 1;
+		p = first;
+		goto again;
 	}
 
+out_free:
+	pthread_rwlock_unlock(&pool_lock);
+
+	mempool_free(it);
+
 	return NULL;
 }
 
 static void put_ip(struct ap_session *ses, struct ipv4db_item_t *it)
 {
 	struct ippool_item_t *pit = container_of(it, typeof(*pit), it);
+	struct ippool_t *p = pit->pool;
+	struct ippool_layout_t *l;
+	int idx;
+
+	spin_lock(&p->lock);
+	l = p->l;
+	if (pit->gen == p->gen)
+		idx = pit->idx;
+	else {
+		/* pool was reloaded while address was in use */
+		idx = addr_to_idx(l, it->peer_addr);
+		if (idx == l->reserved)
+			idx = -1;
+	}
+
+	if (idx >= 0 && map_test(l, idx)) {
+		map_clear(l, idx);
+		p->exhausted = 0;
+		stat_update(0, -1);
+	}
+	spin_unlock(&p->lock);
 
-	spin_lock(&pit->pool->lock);
-	list_add_tail(&pit->entry, &pit->pool->items);
-	spin_unlock(&pit->pool->lock);
+	mempool_free(pit);
 }
 
 static struct ipdb_t ipdb = {
@@ -398,12 +646,32 @@ static int session_save(struct ap_session *ses, struct backup_mod *m)
 	return 0;
 }
 
+static int restore_ip(struct ippool_t *p, in_addr_t peer_addr, struct ippool_item_t *it)
+{
+	int idx, r = -1;
+
+	spin_lock(&p->lock);
+	idx = addr_to_idx(p->l, peer_addr);
+	if (idx >= 0 && !map_test(p->l, idx)) {
+		map_set(p->l, idx);
+		p->exhausted = !p->l->free_cnt;
+		stat_update(0, 1);
+		it->pool = p;
+		it->idx = idx;
+		it->gen = p->gen;
+		r = 0;
+	}
+	spin_unlock(&p->lock);
+
+	return r;
+}
+
 static int session_restore(struct ap_session *ses, struct backup_mod *m)
 {
 	struct backup_tag *tag;
-	in_addr_t addr = 0, peer_addr;
+	in_addr_t addr = 0, peer_addr = 0;
 	struct ippool_t *p;
-	struct ippool_item_t *it, *it0 = NULL;
+	struct ippool_item_t *it;
 
 	m = backup_find_mod(m->data, MODID_COMMON);
 
@@ -418,35 +686,31 @@ static int session_restore(struct ap_session *ses, struct backup_mod *m)
 		}
 	}
 
-	spin_lock(&def_pool->lock);
-	list_for_each_entry(it, &def_pool->items, entry) {
-		if (peer_addr == it->it.peer_addr && addr == it->it.addr) {
-			list_del(&it->entry);
-			it0 = it;
-			break;
-		}
-	}
-	spin_unlock(&def_pool->lock);
+	it = mempool_alloc(item_pool);
+	if (it) {
+		memset(it, 0, sizeof(*it));
 
-	if (!it0) {
-		list_for_each_entry(p, &pool_list, entry) {
-			spin_lock(&p->lock);
-			list_for_each_entry(it, &p->items, entry) {
-				if (peer_addr == it->it.peer_addr && addr == it->it.addr) {
-					list_del(&it->entry);
-					it0 = it;
+		if (restore_ip(def_pool, peer_addr, it)) {
+			pthread_rwlock_rdlock(&pool_lock);
+			list_for_each_entry(p, &pool_list, entry) {
+				if (!restore_ip(p, peer_addr, it))
 					break;
-				}
 			}
-			spin_unlock(&p->lock);
-			if (it0)
-				break;
+			pthread_rwlock_unlock(&pool_lock);
+
+			if (!it->pool) {
+				mempool_free(it);
+				it = NULL;
+			}
 		}
 	}
 
-	if (it0)
-		ses->ipv4 = &it0->it;
-	else {
+	if (it) {
+		it->it.owner = &ipdb;
+		it->it.peer_addr = peer_addr;
+		it->it.addr = addr;
+		ses->ipv4 = &it->it;
+	} else {
 		ses->ipv4 = _malloc(sizeof(*ses->ipv4));
 		memset(ses->ipv4, 0, sizeof(*ses->ipv4));
 		ses->ipv4->addr = addr;
@@ -536,7 +800,7 @@ static int parse_vendor_opt(const char *opt)
 }
 #endif
 
-static void parse_options(const char *opt, char **pool_name, generate_func *generate, struct ippool_t **next)
+static void parse_options(const char *opt, char **pool_name, int *allocator, struct ippool_t **next)
 {
 	char *ptr1, *ptr2;
 	int len;
@@ -559,9 +823,9 @@ static void parse_options(const char *opt, char **pool_name, generate_func *gene
 		len = ptr2 - ptr1;
 
 		if (len == 3 && memcmp(ptr1, "p2p", 3) == 0)
-			*generate = generate_pool_p2p;
+			*allocator = ALLOC_P2P;
 		else if (len == 5 && memcmp(ptr1, "net30", 5) == 0)
-			*generate = generate_pool_net30;
+			*allocator = ALLOC_NET30;
 		else
 			log_error("ipool: '%s': unknown allocator\n", opt);
 	}
@@ -595,24 +859,63 @@ static void parse_options(const char *opt, char **pool_name, generate_func *gene
 	}
 }
 
-static void ippool_init1(void)
+/* Pools whose ranges didn't change keep their state, changed pools get
+ * a new bitmap with addresses in use carried over. Pools are never
+ * freed since sessions may still hold their addresses. */
+static void pool_commit(struct ippool_t *p)
 {
-	ipdb_register(&ipdb);
+	struct ippool_layout_t *l, *nl = p->nl;
+
+	p->nl = NULL;
+	p->next = p->nnext;
+
+	nl->gw_addr = conf_gw_ip_address;
+
+	if (layout_equal(p->l, nl) || layout_build(nl)) {
+		layout_free(nl);
+		return;
+	}
+
+	spin_lock(&p->lock);
+	l = p->l;
+	layout_migrate(l, nl);
+	p->l = nl;
+	p->gen++;
+	p->exhausted = !nl->free_cnt;
+	stat_update((int)layout_size(nl) - (int)layout_size(l), (int)layout_used(nl) - (int)layout_used(l));
+	spin_unlock(&p->lock);
+
+	layout_free(l);
 }
 
-static void ippool_init2(void)
+static void pool_prepare(struct ippool_t *p)
+{
+	p->nl = layout_alloc();
+	p->nnext = NULL;
+}
+
+static void load_config(void)
 {
 	struct conf_sect_t *s = conf_get_section("ip-pool");
 	struct conf_option_t *opt;
 	struct ippool_t *p;
-	char *pool_name = NULL;
-	generate_func generate;
+	char *pool_name;
+	int allocator;
 	struct ippool_t *next;
+	int r;
 
 	if (!s)
 		return;
 
-	def_pool = create_pool(NULL);
+	pthread_rwlock_wrlock(&pool_lock);
+
+	conf_gw_ip_address = 0;
+	conf_shuffle = 0;
+	conf_sticky = 0;
+
+	pool_prepare(def_pool);
+	list_for_each_entry(p, &pool_list, entry)
+		pool_prepare(p);
 
 	list_for_each_entry(opt, &s->items, entry) {
 #ifdef RADIUS
@@ -632,31 +935,131 @@ static void ippool_init2(void)
 			parse_gw_ip_address(opt->val);
 		else if (!strcmp(opt->name, "shuffle"))
 			conf_shuffle = atoi(opt->val);
+		else if (!strcmp(opt->name, "sticky"))
+			conf_sticky = atoi(opt->val);
 		else {
 			pool_name = NULL;
-			generate = generate_pool_p2p;
+			allocator = ALLOC_P2P;
 			next = NULL;
+			r = 0;
 
-			parse_options(opt->raw, &pool_name, &generate, &next);
+			parse_options(opt->raw, &pool_name, &allocator, &next);
 
-			p = pool_name ? find_pool(pool_name, 1) : def_pool;
+			if (pool_name) {
+				p = find_pool(pool_name, 1);
+				_free(pool_name);
+				if (!p->nl)
+					pool_prepare(p);
+			} else
+				p = def_pool;
 
 			if (!strcmp(opt->name, "gw"))
-				add_range(p, &p->gw_list, opt->val, generate);
+				r = add_range(p->nl, 1, opt->val, allocator);
 			else if (!strcmp(opt->name, "tunnel"))
-				add_range(p, &p->tunnel_list, opt->val, generate);
+				r = add_range(p->nl, 0, opt->val, allocator);
 			else if (!opt->val || strchr(opt->name, ','))
-				add_range(p, &p->tunnel_list, opt->name, generate);
+				r = add_range(p->nl, 0, opt->name, allocator);
+
+			/* invalid ranges are fatal on startup, on reload
+			 * the range is skipped and the rest is applied */
+			if (r < 0 && !conf_loaded) {
+				fprintf(stderr, "ippool: invalid range '%s'\n", opt->raw);
+				_exit(EXIT_FAILURE);
+			}
 
-			p->next = next;
+			p->nnext = next;
 		}
 	}
 
-	if (def_pool->generate)
-		def_pool->generate(def_pool);
+	pool_commit(def_pool);
+	list_for_each_entry(p, &pool_list, entry)
+		pool_commit(p);
+
+	conf_loaded = 1;
+
+	pthread_rwlock_unlock(&pool_lock);
+}
 
+void __export ippool_get_stat(unsigned int **size, unsigned int **used, unsigned int **free)
+{
+	*size = &stat_size;
+	*used = &stat_used;
+	*free = &stat_free;
+}
+
+static void show_pool(struct ippool_t *p, struct ippool_t *next, void *client)
+{
+	uint32_t size, used;
+	int exhausted;
+
+	spin_lock(&p->lock);
+	size = layout_size(p->l);
+	used = layout_used(p->l);
+	exhausted = p->exhausted;
+	spin_unlock(&p->lock);
+
+	cli_sendv(client, "%s: size=%u used=%u free=%u%s%s%s\r\n",
+		p->name ? p->name : "(default)", size, used, size - used,
+		next ? " next=" : "", next ? next->name : "",
+		exhausted ? " exhausted" : "");
+}
+
+static int show_exec(const char *cmd, char * const *f, int f_cnt, void *cli)
+{
+	struct ippool_t *p, **pools;
+	int i, n = 1;
+
+	if (f_cnt != 2)
+		return CLI_CMD_SYNTAX;
+
+	/* Pools are never freed, so only the list and next links are taken
+	 * under the lock, and the client is written to without it */
+	pthread_rwlock_rdlock(&pool_lock);
 	list_for_each_entry(p, &pool_list, entry)
-		p->generate(p);
+		n++;
+
+	pools = _malloc(2 * n * sizeof(*pools));
+	if (!pools) {
+		pthread_rwlock_unlock(&pool_lock);
+		return CLI_CMD_FAILED;
+	}
+
+	i = 0;
+	pools[i++] = def_pool;
+	pools[i++] = def_pool->next;
+	list_for_each_entry(p, &pool_list, entry) {
+		pools[i++] = p;
+		pools[i++] = p->next;
+	}
+	pthread_rwlock_unlock(&pool_lock);
+
+	for (i = 0; i < n; i++)
+		show_pool(pools[2 * i], pools[2 * i + 1], cli);
+
+	_free(pools);
+
+	return CLI_CMD_OK;
+}
+
+static void show_help(char * const *f, int f_cnt, void *cli)
+{
+	cli_send(cli, "ippool show - show ip pools utilization\r\n");
+}
+
+static void ippool_init1(void)
+{
+	ipdb_register(&ipdb);
+}
+
+static void ippool_init2(void)
+{
+	if (!conf_get_section("ip-pool"))
+		return;
+
+	item_pool = mempool_create(sizeof(struct ippool_item_t));
+	def_pool = create_pool(NULL);
+
+	load_config();
 
 #ifdef USE_BACKUP
 	backup_register_module(&backup_mod);
@@ -666,8 +1069,11 @@ static void ippool_init2(void)
 	if (triton_module_loaded("radius"))
 		triton_event_register_handler(EV_RADIUS_ACCESS_ACCEPT, (triton_event_func)ev_radius_access_accept);
 #endif
+
+	triton_event_register_handler(EV_CONFIG_RELOAD, (triton_event_func)load_config);
+
+	cli_register_simple_cmd2(show_exec, show_help, 2, "ippool", "show");
 }
 
 DEFINE_INIT(51, ippool_init1);
 DEFINE_INIT2(52, ippool_init2);
-
@@ -18,6 +18,7 @@
 #include "statPPPOE.h"
 #include "statIPOE.h"
 #include "statSSTP.h"
+#include "statIPPool.h"
 #include "terminate.h"
 #include "shutdown.h"
 #include "sessionTable.h"
@@ -110,6 +111,7 @@ static void *snmp_thread(void *a)
 	init_statPPPOE();
 	init_statIPOE();
 	init_statSSTP();
+	init_statIPPool();
 	init_terminate();
 	init_shutdown();
 	init_sessionTable();
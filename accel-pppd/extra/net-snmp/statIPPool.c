@@ -0,0 +1,109 @@
+/*
+ * Note: this file originally auto-generated by mib2c using
+ *        : mib2c.int_watch.conf 13957 2005-12-20 15:33:08Z tanders $
+ */
+
+#include <net-snmp/net-snmp-config.h>
+#include <net-snmp/net-snmp-includes.h>
+#include <net-snmp/agent/net-snmp-agent-includes.h>
+
+#include "triton.h"
+#include "statIPPool.h"
+
+/*
+ * The variables we want to tie the relevant OIDs to.
+ * The agent will handle all GET and (if applicable) SET requests
+ * to these variables automatically, changing the values as needed.
+ */
+
+void ippool_get_stat(unsigned int **, unsigned int **, unsigned int **);
+
+static unsigned int *stat_size;
+static unsigned int *stat_used;
+static unsigned int *stat_free;
+
+/*
+ * Our initialization routine, called automatically by the agent
+ * (Note that the function name must match init_FILENAME())
+ */
+void
+init_statIPPool(void)
+{
+  netsnmp_handler_registration *reg;
+  netsnmp_watcher_info         *winfo;
+
+    static oid statIPPoolSize_oid[] = { 1,3,6,1,4,1,8072,100,1,9,1 };
+    static oid statIPPoolUsed_oid[] = { 1,3,6,1,4,1,8072,100,1,9,2 };
+    static oid statIPPoolFree_oid[] = { 1,3,6,1,4,1,8072,100,1,9,3 };
+
+  /*
+   * a debugging statement.  Run the agent with -DstatIPPool to see
+   * the output of this debugging statement.
+   */
+  DEBUGMSGTL(("statIPPool", "Initializing the statIPPool module\n"));
+
+	if (!triton_module_loaded("ippool"))
+		return;
+
+	ippool_get_stat(&stat_size, &stat_used, &stat_free);
+
+    /*
+     * Register scalar watchers for each of the MIB objects.
+     * The ASN type and RO/RW status are taken from the MIB definition,
+     * but can be adjusted if needed.
+     *
+     * In most circumstances, the scalar watcher will handle all
+     * of the necessary processing.  But the NULL parameter in the
+     * netsnmp_create_handler_registration() call can be used to
+     * supply a user-provided handler if necessary.
+     *
+     * This approach can also be used to handle Counter64, string-
+     * and OID-based watched scalars (although variable-sized writeable
+     * objects will need some more specialised initialisation).
+     */
+    DEBUGMSGTL(("statIPPool",
+                "Initializing statIPPoolSize scalar integer.  Default value = %d\n",
+                0));
+    reg = netsnmp_create_handler_registration(
+             "statIPPoolSize", NULL,
+              statIPPoolSize_oid, OID_LENGTH(statIPPoolSize_oid),
+              HANDLER_CAN_RONLY);
+    winfo = netsnmp_create_watcher_info(
+                stat_size, sizeof(*stat_size),
+                 ASN_INTEGER, WATCHER_FIXED_SIZE);
+    if (netsnmp_register_watched_scalar( reg, winfo ) < 0 ) {
+        snmp_log( LOG_ERR, "Failed to register watched statIPPoolSize" );
+    }
+
+    DEBUGMSGTL(("statIPPool",
+                "Initializing statIPPoolUsed scalar integer.  Default value = %d\n",
+                0));
+    reg = netsnmp_create_handler_registration(
+             "statIPPoolUsed", NULL,
+              statIPPoolUsed_oid, OID_LENGTH(statIPPoolUsed_oid),
+              HANDLER_CAN_RONLY);
+    winfo = netsnmp_create_watcher_info(
+                stat_used, sizeof(*stat_used),
+                 ASN_INTEGER, WATCHER_FIXED_SIZE);
+    if (netsnmp_register_watched_scalar( reg, winfo ) < 0 ) {
+        snmp_log( LOG_ERR, "Failed to register watched statIPPoolUsed" );
+    }
+
+    DEBUGMSGTL(("statIPPool",
+                "Initializing statIPPoolFree scalar integer.  Default value = %d\n",
+                0));
+    reg = netsnmp_create_handler_registration(
+             "statIPPoolFree", NULL,
+              statIPPoolFree_oid, OID_LENGTH(statIPPoolFree_oid),
+              HANDLER_CAN_RONLY);
+    winfo = netsnmp_create_watcher_info(
+                stat_free, sizeof(*stat_free),
+                 ASN_INTEGER, WATCHER_FIXED_SIZE);
+    if (netsnmp_register_watched_scalar( reg, winfo ) < 0 ) {
+        snmp_log( LOG_ERR, "Failed to register watched statIPPoolFree" );
+    }
+
+
+  DEBUGMSGTL(("statIPPool",
+              "Done initalizing statIPPool module\n"));
+}
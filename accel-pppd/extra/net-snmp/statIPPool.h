@@ -0,0 +1,11 @@
+/*
+ * Note: this file originally auto-generated by mib2c using
+ *        : mib2c.int_watch.conf 13957 2005-12-20 15:33:08Z tanders $
+ */
+#ifndef STATIPPOOL_H
+#define STATIPPOOL_H
+
+/* function declarations */
+void init_statIPPool(void);
+
+#endif /* STATIPPOOL_H */
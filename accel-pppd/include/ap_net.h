@@ -17,6 +17,7 @@ struct ap_net {
 	int (*listen)(int sock, int backlog);
 	ssize_t (*read)(int sock, void *buf, size_t len);
 	ssize_t (*recvfrom)(int sock, void *buf, size_t len, int flags, struct sockaddr *src_addr, socklen_t *addrlen);
+	int (*recvmmsg)(int sock, struct mmsghdr *msgvec, unsigned int vlen, int flags);
 	ssize_t (*write)(int sock, const void *buf, size_t len);
 	ssize_t (*sendto)(int sock, const void *buf, size_t len, int flags, const struct sockaddr *dest_addr, socklen_t addrlen);
 	int (*set_nonblocking)(int sock, int f);
@@ -67,6 +67,7 @@ struct ap_private
 struct ap_session
 {
 	struct list_head entry;
+	struct list_head user_entry;
 
 	int state;
 	char *chan_name;
@@ -118,6 +119,7 @@ struct ap_session
 	uint32_t acct_rx_bytes_i;
 	uint32_t acct_tx_bytes_i;
 	int acct_start;
+	uint64_t stats_ts;
 };
 
 struct ap_session_stat
@@ -146,6 +148,7 @@ void ap_session_terminate(struct ap_session *ses, int cause, int hard);
 void ap_session_activate(struct ap_session *ses);
 void ap_session_accounting_started(struct ap_session *ses);
 int ap_session_set_username(struct ap_session *ses, char *username);
+void ap_session_set_failed_username(struct ap_session *ses, char *username);
 int ap_check_username(const char *username);
 
 void ap_session_ifup(struct ap_session *ses);
@@ -153,6 +156,7 @@ void ap_session_ifdown(struct ap_session *ses);
 int ap_session_rename(struct ap_session *ses, const char *ifname, int len);
 
 int ap_session_read_stats(struct ap_session *ses, struct rtnl_link_stats *stats);
+void ap_session_stats_cache_free(struct ap_net *net);
 
 int ap_shutdown_soft(void (*cb)(void), int term);
 
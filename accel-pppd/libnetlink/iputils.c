@@ -103,6 +103,57 @@ out_err:
 	return -1;
 }
 
+struct stats_arg
+{
+	iplink_stats_func func;
+	void *arg;
+};
+
+static int stats_nlmsg(const struct sockaddr_nl *who, struct nlmsghdr *n, void *arg)
+{
+	struct ifinfomsg *ifi = NLMSG_DATA(n);
+	struct rtattr *tb[IFLA_MAX + 1];
+	struct stats_arg *a = arg;
+
+	if (n->nlmsg_type != RTM_NEWLINK)
+		return 0;
+
+	if (n->nlmsg_len < NLMSG_LENGTH(sizeof(*ifi)))
+		return -1;
+
+	memset(tb, 0, sizeof(tb));
+	parse_rtattr(tb, IFLA_MAX, IFLA_RTA(ifi), IFLA_PAYLOAD(n));
+
+	if (tb[IFLA_STATS] == NULL)
+		return 0;
+
+	return a->func(ifi->ifi_index, RTA_DATA(tb[IFLA_STATS]), a->arg);
+}
+
+/* Statistics of all links of current net in a single RTM_GETLINK dump */
+int __export iplink_stats_list(iplink_stats_func func, void *arg)
+{
+	struct rtnl_handle rth;
+	struct stats_arg a = { .func = func, .arg = arg };
+	int r = -1;
+
+	if (net->rtnl_open(&rth, NETLINK_ROUTE))
+		return -1;
+
+	if (rtnl_wilddump_request(&rth, AF_PACKET, RTM_GETLINK) < 0)
+		goto out;
+
+	if (rtnl_dump_filter(&rth, stats_nlmsg, &a, NULL, NULL) < 0)
+		goto out;
+
+	r = 0;
+
+out:
+	rtnl_close(&rth);
+
+	return r;
+}
+
 int __export iplink_get_stats(int ifindex, struct rtnl_link_stats *stats)
 {
 	struct iplink_req {
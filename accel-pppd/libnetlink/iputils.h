@@ -6,9 +6,11 @@
 #include <stdint.h>
 
 typedef int (*iplink_list_func)(int index, int flags, const char *name, int iflink, int vid, void *arg);
+typedef int (*iplink_stats_func)(int index, const struct rtnl_link_stats *stats, void *arg);
 
 int iplink_list(iplink_list_func func, void *arg);
 int iplink_get_stats(int ifindex, struct rtnl_link_stats *stats);
+int iplink_stats_list(iplink_stats_func func, void *arg);
 int iplink_set_mtu(int ifindex, int mtu);
 
 int iplink_vlan_add(const char *ifname, int ifindex, int vid);
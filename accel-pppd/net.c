@@ -17,6 +17,7 @@
 #include "log.h"
 #include "libnetlink.h"
 #include "ap_net.h"
+#include "ap_session.h"
 #include "memdebug.h"
 
 #ifndef HAVE_SETNS
@@ -75,6 +76,11 @@ static ssize_t def_recvfrom(int sock, void *buf, size_t len, int flags, struct s
 	return recvfrom(sock, buf, len, flags, src_addr, addrlen);
 }
 
+static int def_recvmmsg(int sock, struct mmsghdr *msgvec, unsigned int vlen, int flags)
+{
+	return recvmmsg(sock, msgvec, vlen, flags, NULL);
+}
+
 static ssize_t def_write(int sock, const void *buf, size_t len)
 {
 	return write(sock, buf, len);
@@ -252,6 +258,8 @@ static void def_release(struct ap_net *d)
 
 	log_debug("close ns %s\n", n->net.name);
 
+	ap_session_stats_cache_free(d);
+
 	close(n->sock);
 	close(n->sock6);
 	close(n->ns_fd);
@@ -302,6 +310,7 @@ static struct ap_net *alloc_net(const char *name)
 	net->listen = def_listen;
 	net->read = def_read;
 	net->recvfrom = def_recvfrom;
+	net->recvmmsg = def_recvmmsg;
 	net->write = def_write;
 	net->sendto = def_sendto;
 	net->set_nonblocking = def_set_nonblocking;
@@ -306,13 +306,7 @@ int __export ppp_auth_succeeded(struct ppp_t *ppp, char *username)
 void __export ppp_auth_failed(struct ppp_t *ppp, char *username)
 {
 	if (username) {
-		pthread_rwlock_wrlock(&ses_lock);
-		if (!ppp->ses.username)
-			ppp->ses.username = username;
-		else
-			_free(username);
-		ppp->ses.terminate_cause = TERM_AUTH_ERROR;
-		pthread_rwlock_unlock(&ses_lock);
+		ap_session_set_failed_username(&ppp->ses, username);
 		log_ppp_info1("%s: authentication failed\n", ppp->ses.username);
 		log_info1("%s: authentication failed\n", ppp->ses.username);
 		triton_event_fire(EV_SES_AUTH_FAILED, ppp);
@@ -52,16 +52,16 @@ static int req_set_stat(struct rad_req_t *req, struct ap_session *ses)
 		clock_gettime(CLOCK_MONOTONIC, &ts);
 
 	if (ap_session_read_stats(ses, &stats) == 0) {
-		rad_packet_change_int(req->pack, NULL, "Acct-Input-Octets", stats.rx_bytes);
-		rad_packet_change_int(req->pack, NULL, "Acct-Output-Octets", stats.tx_bytes);
-		rad_packet_change_int(req->pack, NULL, "Acct-Input-Packets", stats.rx_packets);
-		rad_packet_change_int(req->pack, NULL, "Acct-Output-Packets", stats.tx_packets);
-		rad_packet_change_int(req->pack, NULL, "Acct-Input-Gigawords", rpd->ses->acct_input_gigawords);
-		rad_packet_change_int(req->pack, NULL, "Acct-Output-Gigawords", rpd->ses->acct_output_gigawords);
+		rad_packet_change_attr_int(req->pack, rad_attr.acct_input_octets, stats.rx_bytes);
+		rad_packet_change_attr_int(req->pack, rad_attr.acct_output_octets, stats.tx_bytes);
+		rad_packet_change_attr_int(req->pack, rad_attr.acct_input_packets, stats.rx_packets);
+		rad_packet_change_attr_int(req->pack, rad_attr.acct_output_packets, stats.tx_packets);
+		rad_packet_change_attr_int(req->pack, rad_attr.acct_input_gigawords, rpd->ses->acct_input_gigawords);
+		rad_packet_change_attr_int(req->pack, rad_attr.acct_output_gigawords, rpd->ses->acct_output_gigawords);
 	} else
 		ret = -1;
 
-	rad_packet_change_int(req->pack, NULL, "Acct-Session-Time", ts.tv_sec - ses->start_time);
+	rad_packet_change_attr_int(req->pack, rad_attr.acct_session_time, ts.tv_sec - ses->start_time);
 
 	return ret;
 }
@@ -73,10 +73,7 @@ static void rad_acct_sent(struct rad_req_t *req, int res)
 
 	__sync_add_and_fetch(&req->serv->stat_interim_sent, 1);
 
-	if (!req->hnd.tpd)
-		triton_md_register_handler(req->rpd->ses->ctrl->ctx, &req->hnd);
-
-	triton_md_enable_handler(&req->hnd, MD_MODE_READ);
+	rad_req_listen(req, req->rpd->ses->ctrl->ctx);
 
 	if (req->timeout.tpd)
 		triton_timer_mod(&req->timeout, 0);
@@ -95,7 +92,7 @@ static void rad_acct_recv(struct rad_req_t *req)
 	if (req->timeout.tpd)
 		triton_timer_del(&req->timeout);
 
-	triton_md_unregister_handler(&req->hnd, 1);
+	rad_req_close_socket(req);
 
 	rad_packet_free(req->reply);
 	req->reply = NULL;
@@ -116,7 +113,7 @@ static void rad_acct_timeout(struct triton_timer_t *t)
 
 	if (conf_acct_timeout == 0) {
 		triton_timer_del(t);
-		triton_md_unregister_handler(&req->hnd, 1);
+		rad_req_close_socket(req);
 		return;
 	}
 
@@ -149,10 +146,10 @@ static void rad_acct_timeout(struct triton_timer_t *t)
 	}
 }
 
-static void rad_acct_interim_update(struct triton_timer_t *t)
+static void __rad_acct_interim_update(struct radius_pd_t *rpd, int shaped)
 {
-	struct radius_pd_t *rpd = container_of(t, typeof(*rpd), acct_interim_timer);
 	struct ap_session *ses = rpd->ses;
+	struct triton_timer_t *t = &rpd->acct_interim_timer;
 	struct timespec ts;
 	int force = 0;
 
@@ -163,6 +160,9 @@ static void rad_acct_interim_update(struct triton_timer_t *t)
 			rpd->session_timeout.expire_tv.tv_sec - (_time() - ses->start_time) < INTERIM_SAFE_TIME)
 			return;
 
+	if (shaped && rpd->acct_interim_interval && rad_server_interim_enter(rpd))
+		return;
+
 	if (req_set_stat(rpd->acct_req, rpd->ses)) {
 		ap_session_terminate(rpd->ses, TERM_LOST_CARRIER, 0);
 		return;
@@ -171,7 +171,7 @@ static void rad_acct_interim_update(struct triton_timer_t *t)
 	if (ses->ipv6_dp && !rpd->ipv6_dp_sent) {
 		struct ipv6db_addr_t *a;
 		list_for_each_entry(a, &ses->ipv6_dp->prefix_list, entry)
-			rad_packet_add_ipv6prefix(rpd->acct_req->pack, NULL, "Delegated-IPv6-Prefix", &a->addr, a->prefix_len);
+			rad_packet_add_attr_ipv6prefix(rpd->acct_req->pack, rad_attr.delegated_ipv6_prefix, &a->addr, a->prefix_len);
 		rpd->ipv6_dp_sent = 1;
 		force = 1;
 	}
@@ -192,7 +192,7 @@ static void rad_acct_interim_update(struct triton_timer_t *t)
 	if (rad_req_send(rpd->acct_req) && conf_acct_timeout) {
 		log_ppp_warn("radius:acct: no servers available, terminating session...\n");
 		ap_session_terminate(rpd->ses, TERM_NAS_ERROR, 0);
-	} else if (rpd->acct_interim_interval && rpd->acct_interim_jitter) {
+	} else if (rpd->acct_interim_interval && rpd->acct_interim_jitter && t->tpd) {
 		t->period = max(rpd->acct_interim_interval -
 					rpd->acct_interim_jitter, INTERIM_SAFE_TIME) * 1000;
 		t->period += ((rpd->acct_interim_interval +
@@ -201,12 +201,45 @@ static void rad_acct_interim_update(struct triton_timer_t *t)
 	}
 }
 
+static void rad_acct_interim_update(struct triton_timer_t *t)
+{
+	struct radius_pd_t *rpd = container_of(t, typeof(*rpd), acct_interim_timer);
+
+	__rad_acct_interim_update(rpd, 1);
+}
+
+void rad_acct_interim_wakeup(struct radius_pd_t *rpd)
+{
+	rpd->interim_serv = NULL;
+
+	if (!rpd->acct_req)
+		return;
+
+	__rad_acct_interim_update(rpd, 0);
+}
+
 void rad_acct_force_interim_update(struct radius_pd_t *rpd)
 {
 	if (!rpd->acct_req)
 		return;
 
-	rad_acct_interim_update(&rpd->acct_interim_timer);
+	rad_server_interim_cancel(rpd);
+
+	__rad_acct_interim_update(rpd, 0);
+}
+
+/* Offset of the first interim update within the interval. Consecutive
+ * sessions take successive points of a golden ratio sequence, so any
+ * burst of session starts is spread evenly over the whole interval. */
+static int interim_spread_delay(int interval)
+{
+	static unsigned int seq;
+	unsigned int frac = __sync_add_and_fetch(&seq, 1) * 2654435769u;
+
+	if (interval <= INTERIM_SAFE_TIME)
+		return interval * 1000;
+
+	return INTERIM_SAFE_TIME * 1000 + (int)((uint64_t)frac * ((interval - INTERIM_SAFE_TIME) * 1000) >> 32);
 }
 
 static int rad_acct_before_send(struct rad_req_t *req)
@@ -215,7 +248,7 @@ static int rad_acct_before_send(struct rad_req_t *req)
 
 	clock_gettime(CLOCK_MONOTONIC, &ts);
 
-	rad_packet_change_int(req->pack, NULL, "Acct-Delay-Time", ts.tv_sec - req->ts);
+	rad_packet_change_attr_int(req->pack, rad_attr.acct_delay_time, ts.tv_sec - req->ts);
 	req_set_RA(req, req->serv->secret);
 
 	return 0;
@@ -230,10 +263,7 @@ static void rad_acct_start_sent(struct rad_req_t *req, int res)
 
 	__sync_add_and_fetch(&req->serv->stat_acct_sent, 1);
 
-	if (!req->hnd.tpd)
-		triton_md_register_handler(req->rpd->ses->ctrl->ctx, &req->hnd);
-
-	triton_md_enable_handler(&req->hnd, MD_MODE_READ);
+	rad_req_listen(req, req->rpd->ses->ctrl->ctx);
 
 	if (req->timeout.tpd)
 		triton_timer_mod(&req->timeout, 0);
@@ -252,13 +282,13 @@ static void rad_acct_start_recv(struct rad_req_t *req)
 
 	triton_timer_del(&req->timeout);
 
-	triton_md_unregister_handler(&req->hnd, 1);
+	rad_req_close_socket(req);
 
 	if (rpd->acct_interim_interval) {
 		rad_packet_free(req->reply);
 		req->reply = NULL;
 
-		rad_packet_change_val(req->pack, NULL, "Acct-Status-Type", "Interim-Update");
+		rad_packet_change_attr_val(req->pack, rad_attr.acct_status_type, rad_attr.acct_status_interim);
 		rpd->acct_interim_timer.expire = rad_acct_interim_update;
 		if (rpd->acct_interim_jitter) {
 			rpd->acct_interim_timer.period = max(rpd->acct_interim_interval -
@@ -267,7 +297,14 @@ static void rad_acct_start_recv(struct rad_req_t *req)
 						rpd->acct_interim_jitter) * 1000 - rpd->acct_interim_timer.period) * random() / RAND_MAX;
 		} else
 			rpd->acct_interim_timer.period = rpd->acct_interim_interval * 1000;
+		if (conf_acct_interim_spread) {
+			int delay = interim_spread_delay(rpd->acct_interim_interval);
+			rpd->acct_interim_timer.expire_tv.tv_sec = delay / 1000;
+			rpd->acct_interim_timer.expire_tv.tv_usec = (delay % 1000) * 1000;
+		}
 		triton_timer_add(rpd->ses->ctrl->ctx, &rpd->acct_interim_timer, 0);
+		rpd->acct_interim_timer.expire_tv.tv_sec = 0;
+		rpd->acct_interim_timer.expire_tv.tv_usec = 0;
 
 		req->timeout.expire = rad_acct_timeout;
 		req->recv = rad_acct_recv;
@@ -354,10 +391,7 @@ static void rad_acct_stop_sent(struct rad_req_t *req, int res)
 
 	__sync_add_and_fetch(&req->serv->stat_acct_sent, 1);
 
-	if (!req->hnd.tpd)
-		triton_md_register_handler(req->rpd ? req->rpd->ses->ctrl->ctx : NULL, &req->hnd);
-
-	triton_md_enable_handler(&req->hnd, MD_MODE_READ);
+	rad_req_listen(req, req->rpd ? req->rpd->ses->ctrl->ctx : NULL);
 
 	if (req->timeout.tpd)
 		triton_timer_mod(&req->timeout, 0);
@@ -418,9 +452,10 @@ static void rad_acct_stop_timeout(struct triton_timer_t *t)
 static void start_deferred(struct rad_req_t *req)
 {
 	log_switch(triton_context_self(), NULL);
-	if (req->hnd.fd != -1) {
-		triton_md_register_handler(NULL, &req->hnd);
-		triton_md_enable_handler(&req->hnd, MD_MODE_READ);
+	if (req->sock)
+		rad_req_listen(req, NULL);
+	else if (req->hnd.fd != -1) {
+		rad_req_listen(req, NULL);
 		if (rad_req_read(&req->hnd))
 			return;
 	}
@@ -433,8 +468,7 @@ void rad_acct_stop_defer(struct radius_pd_t *rpd)
 	struct rad_req_t *req = rpd->acct_req;
 
 	rad_server_req_cancel(req, 1);
-	if (req->hnd.tpd)
-		triton_md_unregister_handler(&req->hnd, 0);
+	rad_req_unlisten(req);
 	rpd->acct_req = NULL;
 
 	req->rpd = NULL;
@@ -452,6 +486,8 @@ int rad_acct_stop(struct radius_pd_t *rpd)
 	if (rpd->acct_interim_timer.tpd)
 		triton_timer_del(&rpd->acct_interim_timer);
 
+	rad_server_interim_cancel(rpd);
+
 	if (req) {
 		rad_server_req_cancel(req, 1);
 
@@ -505,7 +541,7 @@ int rad_acct_stop(struct radius_pd_t *rpd)
 
 	req->pack->id++;
 
-	rad_packet_change_val(req->pack, NULL, "Acct-Status-Type", "Stop");
+	rad_packet_change_attr_val(req->pack, rad_attr.acct_status_type, rad_attr.acct_status_stop);
 	req_set_stat(req, rpd->ses);
 	req_set_RA(req, req->serv->secret);
 
@@ -223,10 +223,7 @@ static void rad_auth_sent(struct rad_req_t *req, int res)
 
 	__sync_add_and_fetch(&req->serv->stat_auth_sent, 1);
 
-	if (!req->hnd.tpd)
-		triton_md_register_handler(req->rpd->ses->ctrl->ctx, &req->hnd);
-
-	triton_md_enable_handler(&req->hnd, MD_MODE_READ);
+	rad_req_listen(req, req->rpd->ses->ctrl->ctx);
 
 	if (req->timeout.tpd)
 		triton_timer_mod(&req->timeout, 0);
@@ -242,12 +239,12 @@ static struct rad_req_t *rad_auth_req_alloc(struct radius_pd_t *rpd, const char
 		return NULL;
 
 	if (conf_sid_in_auth) {
-		if (rad_packet_add_str(req->pack, NULL, "Acct-Session-Id", rpd->ses->sessionid))
+		if (rad_packet_add_attr_str(req->pack, rad_attr.acct_session_id, rpd->ses->sessionid))
 			goto out;
 	}
 
 	if (rpd->attr_state) {
-		if (rad_packet_add_octets(req->pack, NULL, "State", rpd->attr_state, rpd->attr_state_len))
+		if (rad_packet_add_attr_octets(req->pack, rad_attr.state, rpd->attr_state, rpd->attr_state_len))
 			goto out;
 	}
 
@@ -284,7 +281,7 @@ int rad_auth_pap(struct radius_pd_t *rpd, const char *username, va_list args)
 	if (!epasswd)
 		return PWDB_DENIED;
 
-	r = rad_packet_add_octets(req->pack, NULL, "User-Password", epasswd, epasswd_len);
+	r = rad_packet_add_attr_octets(req->pack, rad_attr.user_password, epasswd, epasswd_len);
 	if (epasswd_len)
 		_free(epasswd);
 
@@ -315,10 +312,10 @@ int rad_auth_chap_md5(struct radius_pd_t *rpd, const char *username, va_list arg
 	if (challenge_len == 16)
 		memcpy(req->RA, challenge, 16);
 
-	if (rad_packet_add_octets(req->pack, NULL, "CHAP-Challenge", challenge, challenge_len))
+	if (rad_packet_add_attr_octets(req->pack, rad_attr.chap_challenge, challenge, challenge_len))
 		return PWDB_DENIED;
 
-	if (rad_packet_add_octets(req->pack, NULL, "CHAP-Password", chap_password, 17))
+	if (rad_packet_add_attr_octets(req->pack, rad_attr.chap_password, chap_password, 17))
 		return PWDB_DENIED;
 
 	if (rad_req_send(req))
@@ -377,7 +374,7 @@ static int rad_auth_mschap_v1_recv(struct rad_req_t *req)
 	if (req->reply->code == CODE_ACCESS_ACCEPT)
 		setup_mppe(req, req->rpd->auth_ctx->challenge);
 	else {
-		struct rad_attr_t *ra = rad_packet_find_attr(req->reply, "Microsoft", "MS-CHAP-Error");
+		struct rad_attr_t *ra = rad_packet_find_dict_attr(req->reply, rad_attr.ms_chap_error);
 		if (ra) {
 			char **mschap_error = req->rpd->auth_ctx->mschap_error;
 			*mschap_error = _malloc(ra->len + 1);
@@ -412,10 +409,10 @@ int rad_auth_mschap_v1(struct radius_pd_t *rpd, const char *username, va_list ar
 	memcpy(response + 2, lm_response, 24);
 	memcpy(response + 2 + 24, nt_response, 24);
 
-	if (rad_packet_add_octets(req->pack, "Microsoft", "MS-CHAP-Challenge", challenge, challenge_len))
+	if (rad_packet_add_attr_octets(req->pack, rad_attr.ms_chap_challenge, challenge, challenge_len))
 		return PWDB_DENIED;
 
-	if (rad_packet_add_octets(req->pack, "Microsoft", "MS-CHAP-Response", response, sizeof(response)))
+	if (rad_packet_add_attr_octets(req->pack, rad_attr.ms_chap_response, response, sizeof(response)))
 		return PWDB_DENIED;
 
 	if (rad_req_send(req))
@@ -430,7 +427,7 @@ static int rad_auth_mschap_v2_recv(struct rad_req_t *req)
 	struct rad_attr_t *ra;
 
 	if (req->reply->code == CODE_ACCESS_ACCEPT) {
-		ra = rad_packet_find_attr(req->reply, "Microsoft", "MS-CHAP2-Success");
+		ra = rad_packet_find_dict_attr(req->reply, rad_attr.ms_chap2_success);
 		if (!ra) {
 			log_error("radius:auth:mschap-v2: 'MS-CHAP-Success' not found in radius response\n");
 			return -1;
@@ -439,7 +436,7 @@ static int rad_auth_mschap_v2_recv(struct rad_req_t *req)
 
 		setup_mppe(rpd->auth_ctx->req, NULL);
 	} else {
-		ra = rad_packet_find_attr(req->reply, "Microsoft", "MS-CHAP-Error");
+		ra = rad_packet_find_dict_attr(req->reply, rad_attr.ms_chap_error);
 		if (ra) {
 			char **mschap_error = req->rpd->auth_ctx->mschap_error;
 			*mschap_error = _malloc(ra->len + 1);
@@ -447,7 +444,7 @@ static int rad_auth_mschap_v2_recv(struct rad_req_t *req)
 			(*mschap_error)[ra->len] = 0;
 		}
 
-		ra = rad_packet_find_attr(req->reply, NULL, "Reply-Message");
+		ra = rad_packet_find_dict_attr(req->reply, rad_attr.reply_message);
 		if (ra) {
 			char **reply_msg = req->rpd->auth_ctx->reply_msg;
 			*reply_msg = _malloc(ra->len + 1);
@@ -483,10 +480,10 @@ int rad_auth_mschap_v2(struct radius_pd_t *rpd, const char *username, va_list ar
 	memcpy(mschap_response + 2 + 16, reserved, 8);
 	memcpy(mschap_response + 2 + 16 + 8, response, 24);
 
-	if (rad_packet_add_octets(req->pack, "Microsoft", "MS-CHAP-Challenge", challenge, 16))
+	if (rad_packet_add_attr_octets(req->pack, rad_attr.ms_chap_challenge, challenge, 16))
 		return PWDB_DENIED;
 
-	if (rad_packet_add_octets(req->pack, "Microsoft", "MS-CHAP2-Response", mschap_response, sizeof(mschap_response)))
+	if (rad_packet_add_attr_octets(req->pack, rad_attr.ms_chap2_response, mschap_response, sizeof(mschap_response)))
 		return PWDB_DENIED;
 
 	if (rad_req_send(req))
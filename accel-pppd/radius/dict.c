@@ -10,8 +10,39 @@
 
 #include "memdebug.h"
 
+#define ATTR_HASH_BITS 10
+#define ATTR_HASH_SIZE (1 << ATTR_HASH_BITS)
+#define VENDOR_HASH_SIZE 64
+
 static struct rad_dict_t *dict;
 
+static struct list_head attr_name_hash[ATTR_HASH_SIZE];
+static struct list_head attr_id_hash[ATTR_HASH_SIZE];
+static struct list_head vendor_name_hash[VENDOR_HASH_SIZE];
+static struct list_head vendor_id_hash[VENDOR_HASH_SIZE];
+
+struct rad_attrs_t rad_attr;
+
+static inline unsigned int str_hash(const char *name)
+{
+	unsigned int h = 2166136261u;
+
+	for (; *name; name++)
+		h = (h ^ (uint8_t)*name) * 16777619u;
+
+	return h;
+}
+
+static inline unsigned int attr_name_key(struct rad_dict_vendor_t *vendor, const char *name)
+{
+	return (str_hash(name) ^ (vendor ? vendor->id : 0)) & (ATTR_HASH_SIZE - 1);
+}
+
+static inline unsigned int attr_id_key(struct rad_dict_vendor_t *vendor, int id)
+{
+	return (id ^ ((vendor ? vendor->id : 0) * 2654435761u)) & (ATTR_HASH_SIZE - 1);
+}
+
 static char *skip_word(char *ptr)
 {
 	for(; *ptr; ptr++)
@@ -64,6 +95,17 @@ struct rad_dict_attr_t *find_attr(struct list_head *items, const char *name)
 	return NULL;
 }
 
+static struct rad_dict_vendor_t *find_vendor(const char *name)
+{
+	struct rad_dict_vendor_t *vendor;
+
+	list_for_each_entry(vendor, &dict->vendors, entry)
+		if (!strcmp(vendor->name, name))
+			return vendor;
+
+	return NULL;
+}
+
 #define BUF_SIZE 1024
 
 static char *path, *fname1, *buf;
@@ -135,7 +177,7 @@ static int dict_load(const char *fname)
 				if (r < 1)
 					goto out_err_syntax;
 
-				vendor = rad_dict_find_vendor_name(ptr[0]);
+				vendor = find_vendor(ptr[0]);
 				if (!vendor) {
 					log_emerg("radius:%s:%i: vendor not found\n", fname, n);
 					goto out_err;
@@ -261,6 +303,107 @@ out_err:
 	return -1;
 }
 
+static void index_reset(void)
+{
+	int i;
+
+	for (i = 0; i < ATTR_HASH_SIZE; i++) {
+		INIT_LIST_HEAD(&attr_name_hash[i]);
+		INIT_LIST_HEAD(&attr_id_hash[i]);
+	}
+
+	for (i = 0; i < VENDOR_HASH_SIZE; i++) {
+		INIT_LIST_HEAD(&vendor_name_hash[i]);
+		INIT_LIST_HEAD(&vendor_id_hash[i]);
+	}
+}
+
+static void index_attrs(struct rad_dict_vendor_t *vendor, struct list_head *items)
+{
+	struct rad_dict_attr_t *attr;
+
+	/* tail insertion keeps the first definition of duplicates winning, as the list scan did */
+	list_for_each_entry(attr, items, entry) {
+		attr->vendor = vendor;
+		list_add_tail(&attr->name_hash, &attr_name_hash[attr_name_key(vendor, attr->name)]);
+		list_add_tail(&attr->id_hash, &attr_id_hash[attr_id_key(vendor, attr->id)]);
+	}
+}
+
+static void index_build(void)
+{
+	struct rad_dict_vendor_t *vendor;
+
+	index_reset();
+
+	index_attrs(NULL, &dict->items);
+
+	list_for_each_entry(vendor, &dict->vendors, entry) {
+		list_add_tail(&vendor->name_hash, &vendor_name_hash[str_hash(vendor->name) % VENDOR_HASH_SIZE]);
+		list_add_tail(&vendor->id_hash, &vendor_id_hash[(unsigned int)vendor->id % VENDOR_HASH_SIZE]);
+		index_attrs(vendor, &vendor->items);
+	}
+}
+
+static struct rad_dict_value_t *find_val(struct rad_dict_attr_t *attr, const char *name)
+{
+	return attr ? rad_dict_find_val_name(attr, name) : NULL;
+}
+
+static void resolve_attrs(void)
+{
+	struct rad_attrs_t *a = &rad_attr;
+
+	a->user_name = rad_dict_attr(NULL, "User-Name");
+	a->user_password = rad_dict_attr(NULL, "User-Password");
+	a->chap_challenge = rad_dict_attr(NULL, "CHAP-Challenge");
+	a->chap_password = rad_dict_attr(NULL, "CHAP-Password");
+	a->ms_chap_challenge = rad_dict_attr("Microsoft", "MS-CHAP-Challenge");
+	a->ms_chap_response = rad_dict_attr("Microsoft", "MS-CHAP-Response");
+	a->ms_chap2_response = rad_dict_attr("Microsoft", "MS-CHAP2-Response");
+	a->ms_chap2_success = rad_dict_attr("Microsoft", "MS-CHAP2-Success");
+	a->ms_chap_error = rad_dict_attr("Microsoft", "MS-CHAP-Error");
+	a->reply_message = rad_dict_attr(NULL, "Reply-Message");
+	a->state = rad_dict_attr(NULL, "State");
+	a->class = rad_dict_attr(NULL, "Class");
+	a->nas_identifier = rad_dict_attr(NULL, "NAS-Identifier");
+	a->nas_ip_address = rad_dict_attr(NULL, "NAS-IP-Address");
+	a->nas_port = rad_dict_attr(NULL, "NAS-Port");
+	a->nas_port_id = rad_dict_attr(NULL, "NAS-Port-Id");
+	a->nas_port_type = rad_dict_attr(NULL, "NAS-Port-Type");
+	a->service_type = rad_dict_attr(NULL, "Service-Type");
+	a->framed_protocol = rad_dict_attr(NULL, "Framed-Protocol");
+	a->calling_station_id = rad_dict_attr(NULL, "Calling-Station-Id");
+	a->called_station_id = rad_dict_attr(NULL, "Called-Station-Id");
+	a->framed_ip_address = rad_dict_attr(NULL, "Framed-IP-Address");
+	a->framed_interface_id = rad_dict_attr(NULL, "Framed-Interface-Id");
+	a->framed_ipv6_prefix = rad_dict_attr(NULL, "Framed-IPv6-Prefix");
+	a->delegated_ipv6_prefix = rad_dict_attr(NULL, "Delegated-IPv6-Prefix");
+	a->acct_status_type = rad_dict_attr(NULL, "Acct-Status-Type");
+	a->acct_authentic = rad_dict_attr(NULL, "Acct-Authentic");
+	a->acct_session_id = rad_dict_attr(NULL, "Acct-Session-Id");
+	a->acct_session_time = rad_dict_attr(NULL, "Acct-Session-Time");
+	a->acct_input_octets = rad_dict_attr(NULL, "Acct-Input-Octets");
+	a->acct_output_octets = rad_dict_attr(NULL, "Acct-Output-Octets");
+	a->acct_input_packets = rad_dict_attr(NULL, "Acct-Input-Packets");
+	a->acct_output_packets = rad_dict_attr(NULL, "Acct-Output-Packets");
+	a->acct_input_gigawords = rad_dict_attr(NULL, "Acct-Input-Gigawords");
+	a->acct_output_gigawords = rad_dict_attr(NULL, "Acct-Output-Gigawords");
+	a->acct_delay_time = rad_dict_attr(NULL, "Acct-Delay-Time");
+	a->acct_terminate_cause = rad_dict_attr(NULL, "Acct-Terminate-Cause");
+
+	a->nas_port_type_ethernet = find_val(a->nas_port_type, "Ethernet");
+	a->nas_port_type_virtual = find_val(a->nas_port_type, "Virtual");
+	a->service_type_framed_user = find_val(a->service_type, "Framed-User");
+	a->framed_protocol_ppp = find_val(a->framed_protocol, "PPP");
+	a->acct_authentic_radius = find_val(a->acct_authentic, "RADIUS");
+	a->acct_status_start = find_val(a->acct_status_type, "Start");
+	a->acct_status_stop = find_val(a->acct_status_type, "Stop");
+	a->acct_status_interim = find_val(a->acct_status_type, "Interim-Update");
+	a->acct_status_on = find_val(a->acct_status_type, "Accounting-On");
+	a->acct_status_off = find_val(a->acct_status_type, "Accounting-Off");
+}
+
 int rad_dict_load(const char *fname)
 {
 	int r = -1;
@@ -274,6 +417,7 @@ int rad_dict_load(const char *fname)
 		}
 		INIT_LIST_HEAD(&dict->items);
 		INIT_LIST_HEAD(&dict->vendors);
+		index_reset();
 	}
 
 	path = _malloc(PATH_MAX);
@@ -305,6 +449,10 @@ out_free_path:
 out_free_dict:
 	if (r)
 		rad_dict_free(dict);
+	else {
+		index_build();
+		resolve_attrs();
+	}
 	return r;
 }
 
@@ -328,14 +476,17 @@ void rad_dict_free(struct rad_dict_t *dict)
 		_free(attr);
 	}
 	free(dict);
+
+	index_reset();
+	memset(&rad_attr, 0, sizeof(rad_attr));
 }
 
-static struct rad_dict_attr_t *dict_find_attr(struct list_head *items, const char *name)
+static struct rad_dict_attr_t *dict_find_attr(struct rad_dict_vendor_t *vendor, const char *name)
 {
 	struct rad_dict_attr_t *attr;
 
-	list_for_each_entry(attr, items, entry)
-		if (!strcmp(attr->name, name))
+	list_for_each_entry(attr, &attr_name_hash[attr_name_key(vendor, name)], name_hash)
+		if (attr->vendor == vendor && !strcmp(attr->name, name))
 			return attr;
 
 	return NULL;
@@ -343,16 +494,15 @@ static struct rad_dict_attr_t *dict_find_attr(struct list_head *items, const cha
 
 __export struct rad_dict_attr_t *rad_dict_find_attr(const char *name)
 {
-	return dict_find_attr(&dict->items, name);
+	return dict_find_attr(NULL, name);
 }
 
 __export struct rad_dict_attr_t *rad_dict_find_attr_id(struct rad_dict_vendor_t *vendor, int id)
 {
 	struct rad_dict_attr_t *attr;
-	struct list_head *items = vendor ? &vendor->items : &dict->items;
 
-	list_for_each_entry(attr, items, entry)
-		if (attr->id == id)
+	list_for_each_entry(attr, &attr_id_hash[attr_id_key(vendor, id)], id_hash)
+		if (attr->vendor == vendor && attr->id == id)
 			return attr;
 
 	return NULL;
@@ -387,7 +537,7 @@ __export struct rad_dict_vendor_t *rad_dict_find_vendor_name(const char *name)
 {
 	struct rad_dict_vendor_t *vendor;
 
-	list_for_each_entry(vendor, &dict->vendors, entry) {
+	list_for_each_entry(vendor, &vendor_name_hash[str_hash(name) % VENDOR_HASH_SIZE], name_hash) {
 		if (!strcmp(vendor->name, name))
 			return vendor;
 	}
@@ -399,7 +549,7 @@ __export struct rad_dict_vendor_t *rad_dict_find_vendor_id(int id)
 {
 	struct rad_dict_vendor_t *vendor;
 
-	list_for_each_entry(vendor, &dict->vendors, entry) {
+	list_for_each_entry(vendor, &vendor_id_hash[(unsigned int)id % VENDOR_HASH_SIZE], id_hash) {
 		if (vendor->id == id)
 			return vendor;
 	}
@@ -409,6 +559,18 @@ __export struct rad_dict_vendor_t *rad_dict_find_vendor_id(int id)
 
 __export struct rad_dict_attr_t *rad_dict_find_vendor_attr(struct rad_dict_vendor_t *vendor, const char *name)
 {
-	return dict_find_attr(&vendor->items, name);
+	return dict_find_attr(vendor, name);
 }
 
+__export struct rad_dict_attr_t *rad_dict_attr(const char *vendor_name, const char *name)
+{
+	struct rad_dict_vendor_t *vendor = NULL;
+
+	if (vendor_name) {
+		vendor = rad_dict_find_vendor_name(vendor_name);
+		if (!vendor)
+			return NULL;
+	}
+
+	return dict_find_attr(vendor, name);
+}
@@ -163,7 +163,7 @@ static void coa_request(struct radius_pd_t *rpd)
 	if (ev.res)
 		dm_coa_send_nak(serv.hnd.fd, rpd->dm_coa_req, &rpd->dm_coa_addr, 0);
 	else {
-		class = rad_packet_find_attr(rpd->dm_coa_req, NULL, "Class");
+		class = rad_packet_find_dict_attr(rpd->dm_coa_req, rad_attr.class);
 		if (class) {
 			if (rpd->attr_class_len < class->len) {
 				if (rpd->attr_class)
@@ -176,9 +176,9 @@ static void coa_request(struct radius_pd_t *rpd)
 
 			if (rpd->acct_req && rpd->acct_req->pack) {
 				if (prev_class)
-					rad_packet_change_octets(rpd->acct_req->pack, NULL, "Class", rpd->attr_class, rpd->attr_class_len);
+					rad_packet_change_attr_octets(rpd->acct_req->pack, rad_attr.class, rpd->attr_class, rpd->attr_class_len);
 				else
-					rad_packet_add_octets(rpd->acct_req->pack, NULL, "Class", rpd->attr_class, rpd->attr_class_len);
+					rad_packet_add_attr_octets(rpd->acct_req->pack, rad_attr.class, rpd->attr_class, rpd->attr_class_len);
 			}
 		}
 
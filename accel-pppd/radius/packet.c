@@ -169,6 +169,11 @@ int rad_packet_recv(int fd, struct rad_packet_t **p, struct sockaddr_in *addr)
 		goto out_err;
 	}
 
+	if (pack->len < 20) {
+		log_ppp_warn("radius:packet: short packet length %i received\n", pack->len);
+		goto out_err;
+	}
+
 	ptr += 16;
 	n -= 20;
 
@@ -404,26 +409,14 @@ void rad_packet_print(struct rad_packet_t *pack, struct rad_server_t *s, void (*
 	print("]\n");
 }
 
-int __export rad_packet_add_int(struct rad_packet_t *pack, const char *vendor_name, const char *name, int val)
+int __export rad_packet_add_attr_int(struct rad_packet_t *pack, struct rad_dict_attr_t *attr, int val)
 {
 	struct rad_attr_t *ra;
-	struct rad_dict_attr_t *attr;
-	struct rad_dict_vendor_t *vendor;
 
-	if (pack->len + (vendor_name ? 8 : 2) + 4 >= REQ_LENGTH_MAX)
+	if (!attr)
 		return -1;
 
-	if (vendor_name) {
-		vendor = rad_dict_find_vendor_name(vendor_name);
-		if (!vendor)
-			return -1;
-		attr = rad_dict_find_vendor_attr(vendor, name);
-	} else {
-		vendor = NULL;
-		attr = rad_dict_find_attr(name);
-	}
-
-	if (!attr)
+	if (pack->len + (attr->vendor ? 8 : 2) + 4 >= REQ_LENGTH_MAX)
 		return -1;
 
 	ra = mempool_alloc(attr_pool);
@@ -431,22 +424,27 @@ int __export rad_packet_add_int(struct rad_packet_t *pack, const char *vendor_na
 		return -1;
 
 	memset(ra, 0, sizeof(*ra));
-	ra->vendor = vendor;
+	ra->vendor = attr->vendor;
 	ra->attr = attr;
 	ra->len = 4;
 	ra->val.integer = val;
 	ra->raw = &ra->val;
 	list_add_tail(&ra->entry, &pack->attrs);
-	pack->len += (vendor_name ? 8 : 2) + 4;
+	pack->len += (attr->vendor ? 8 : 2) + 4;
 
 	return 0;
 }
 
-int __export rad_packet_change_int(struct rad_packet_t *pack, const char *vendor_name, const char *name, int val)
+int __export rad_packet_add_int(struct rad_packet_t *pack, const char *vendor_name, const char *name, int val)
+{
+	return rad_packet_add_attr_int(pack, rad_dict_attr(vendor_name, name), val);
+}
+
+int __export rad_packet_change_attr_int(struct rad_packet_t *pack, struct rad_dict_attr_t *attr, int val)
 {
 	struct rad_attr_t *ra;
 
-	ra = rad_packet_find_attr(pack, vendor_name, name);
+	ra = rad_packet_find_dict_attr(pack, attr);
 	if (!ra)
 		return -1;
 
@@ -455,28 +453,29 @@ int __export rad_packet_change_int(struct rad_packet_t *pack, const char *vendor
 	return 0;
 }
 
-int __export rad_packet_add_octets(struct rad_packet_t *pack, const char *vendor_name, const char *name, const uint8_t *val, int len)
+int __export rad_packet_change_int(struct rad_packet_t *pack, const char *vendor_name, const char *name, int val)
 {
 	struct rad_attr_t *ra;
-	struct rad_dict_attr_t *attr;
-	struct rad_dict_vendor_t *vendor;
 
-	if (pack->len + (vendor_name ? 8 : 2) + len >= REQ_LENGTH_MAX)
+	ra = rad_packet_find_attr(pack, vendor_name, name);
+	if (!ra)
 		return -1;
 
-	if (vendor_name) {
-		vendor = rad_dict_find_vendor_name(vendor_name);
-		if (!vendor)
-			return -1;
-		attr = rad_dict_find_vendor_attr(vendor, name);
-	} else {
-		vendor = NULL;
-		attr = rad_dict_find_attr(name);
-	}
+	ra->val.integer = val;
+
+	return 0;
+}
+
+int __export rad_packet_add_attr_octets(struct rad_packet_t *pack, struct rad_dict_attr_t *attr, const uint8_t *val, int len)
+{
+	struct rad_attr_t *ra;
 
 	if (!attr)
 		return -1;
 
+	if (pack->len + (attr->vendor ? 8 : 2) + len >= REQ_LENGTH_MAX)
+		return -1;
+
 	ra = mempool_alloc(attr_pool);
 	if (!ra) {
 		log_emerg("radius: out of memory\n");
@@ -484,7 +483,7 @@ int __export rad_packet_add_octets(struct rad_packet_t *pack, const char *vendor
 	}
 
 	memset(ra, 0, sizeof(*ra));
-	ra->vendor = vendor;
+	ra->vendor = attr->vendor;
 	ra->attr = attr;
 	ra->len = len;
 
@@ -502,19 +501,18 @@ int __export rad_packet_add_octets(struct rad_packet_t *pack, const char *vendor
 	ra->raw = ra->val.octets;
 
 	list_add_tail(&ra->entry, &pack->attrs);
-	pack->len += (vendor_name ? 8 : 2) + len;
+	pack->len += (attr->vendor ? 8 : 2) + len;
 
 	return 0;
 }
 
-int __export rad_packet_change_octets(struct rad_packet_t *pack, const char *vendor_name, const char *name, const uint8_t *val, int len)
+int __export rad_packet_add_octets(struct rad_packet_t *pack, const char *vendor_name, const char *name, const uint8_t *val, int len)
 {
-	struct rad_attr_t *ra;
-
-	ra = rad_packet_find_attr(pack, vendor_name, name);
-	if (!ra)
-		return -1;
+	return rad_packet_add_attr_octets(pack, rad_dict_attr(vendor_name, name), val, len);
+}
 
+static int change_octets(struct rad_packet_t *pack, struct rad_attr_t *ra, const uint8_t *val, int len)
+{
 	if (ra->len != len) {
 		if (pack->len - ra->len + len >= REQ_LENGTH_MAX)
 			return -1;
@@ -537,30 +535,39 @@ int __export rad_packet_change_octets(struct rad_packet_t *pack, const char *ven
 	return 0;
 }
 
+int __export rad_packet_change_attr_octets(struct rad_packet_t *pack, struct rad_dict_attr_t *attr, const uint8_t *val, int len)
+{
+	struct rad_attr_t *ra;
 
-int __export rad_packet_add_str(struct rad_packet_t *pack, const char *vendor_name, const char *name, const char *val)
+	ra = rad_packet_find_dict_attr(pack, attr);
+	if (!ra)
+		return -1;
+
+	return change_octets(pack, ra, val, len);
+}
+
+int __export rad_packet_change_octets(struct rad_packet_t *pack, const char *vendor_name, const char *name, const uint8_t *val, int len)
 {
 	struct rad_attr_t *ra;
-	struct rad_dict_attr_t *attr;
-	struct rad_dict_vendor_t *vendor;
-	int len = strlen(val);
 
-	if (pack->len + (vendor_name ? 8 : 2) + len >= REQ_LENGTH_MAX)
+	ra = rad_packet_find_attr(pack, vendor_name, name);
+	if (!ra)
 		return -1;
 
-	if (vendor_name) {
-		vendor = rad_dict_find_vendor_name(vendor_name);
-		if (!vendor)
-			return -1;
-		attr = rad_dict_find_vendor_attr(vendor, name);
-	} else {
-		vendor = NULL;
-		attr = rad_dict_find_attr(name);
-	}
+	return change_octets(pack, ra, val, len);
+}
+
+int __export rad_packet_add_attr_str(struct rad_packet_t *pack, struct rad_dict_attr_t *attr, const char *val)
+{
+	struct rad_attr_t *ra;
+	int len = strlen(val);
 
 	if (!attr)
 		return -1;
 
+	if (pack->len + (attr->vendor ? 8 : 2) + len >= REQ_LENGTH_MAX)
+		return -1;
+
 	ra = mempool_alloc(attr_pool);
 	if (!ra) {
 		log_emerg("radius: out of memory\n");
@@ -568,7 +575,7 @@ int __export rad_packet_add_str(struct rad_packet_t *pack, const char *vendor_na
 	}
 
 	memset(ra, 0, sizeof(*ra));
-	ra->vendor = vendor;
+	ra->vendor = attr->vendor;
 	ra->attr = attr;
 	ra->len = len;
 	ra->alloc = 1;
@@ -582,11 +589,16 @@ int __export rad_packet_add_str(struct rad_packet_t *pack, const char *vendor_na
 	ra->val.string[len] = 0;
 	ra->raw = ra->val.string;
 	list_add_tail(&ra->entry, &pack->attrs);
-	pack->len += (vendor_name ? 8 : 2) + len;
+	pack->len += (attr->vendor ? 8 : 2) + len;
 
 	return 0;
 }
 
+int __export rad_packet_add_str(struct rad_packet_t *pack, const char *vendor_name, const char *name, const char *val)
+{
+	return rad_packet_add_attr_str(pack, rad_dict_attr(vendor_name, name), val);
+}
+
 int __export rad_packet_change_str(struct rad_packet_t *pack, const char *vendor_name, const char *name, const char *val, int len)
 {
 	struct rad_attr_t *ra;
@@ -617,31 +629,14 @@ int __export rad_packet_change_str(struct rad_packet_t *pack, const char *vendor
 	return 0;
 }
 
-int __export rad_packet_add_val(struct rad_packet_t *pack, const char *vendor_name, const char *name, const char *val)
+int __export rad_packet_add_attr_val(struct rad_packet_t *pack, struct rad_dict_attr_t *attr, struct rad_dict_value_t *val)
 {
 	struct rad_attr_t *ra;
-	struct rad_dict_attr_t *attr;
-	struct rad_dict_value_t *v;
-	struct rad_dict_vendor_t *vendor;
 
-	if (pack->len + (vendor_name ? 8 : 2) + 4 >= REQ_LENGTH_MAX)
+	if (!attr || !val)
 		return -1;
 
-	if (vendor_name) {
-		vendor = rad_dict_find_vendor_name(vendor_name);
-		if (!vendor)
-			return -1;
-		attr = rad_dict_find_vendor_attr(vendor, name);
-	} else {
-		vendor = NULL;
-		attr = rad_dict_find_attr(name);
-	}
-
-	if (!attr)
-		return -1;
-
-	v = rad_dict_find_val_name(attr, val);
-	if (!v)
+	if (pack->len + (attr->vendor ? 8 : 2) + 4 >= REQ_LENGTH_MAX)
 		return -1;
 
 	ra = mempool_alloc(attr_pool);
@@ -649,13 +644,40 @@ int __export rad_packet_add_val(struct rad_packet_t *pack, const char *vendor_na
 		return -1;
 
 	memset(ra, 0, sizeof(*ra));
-	ra->vendor = vendor;
+	ra->vendor = attr->vendor;
 	ra->attr = attr;
 	ra->len = 4;
-	ra->val = v->val;
+	ra->val = val->val;
 	ra->raw = &ra->val;
 	list_add_tail(&ra->entry, &pack->attrs);
-	pack->len += (vendor_name ? 8 : 2) + 4;
+	pack->len += (attr->vendor ? 8 : 2) + 4;
+
+	return 0;
+}
+
+int __export rad_packet_add_val(struct rad_packet_t *pack, const char *vendor_name, const char *name, const char *val)
+{
+	struct rad_dict_attr_t *attr;
+
+	attr = rad_dict_attr(vendor_name, name);
+	if (!attr)
+		return -1;
+
+	return rad_packet_add_attr_val(pack, attr, rad_dict_find_val_name(attr, val));
+}
+
+int __export rad_packet_change_attr_val(struct rad_packet_t *pack, struct rad_dict_attr_t *attr, struct rad_dict_value_t *val)
+{
+	struct rad_attr_t *ra;
+
+	if (!val)
+		return -1;
+
+	ra = rad_packet_find_dict_attr(pack, attr);
+	if (!ra)
+		return -1;
+
+	ra->val = val->val;
 
 	return 0;
 }
@@ -678,31 +700,24 @@ int __export rad_packet_change_val(struct rad_packet_t *pack, const char *vendor
 	return 0;
 }
 
+int __export rad_packet_add_attr_ipaddr(struct rad_packet_t *pack, struct rad_dict_attr_t *attr, in_addr_t ipaddr)
+{
+	return rad_packet_add_attr_int(pack, attr, ipaddr);
+}
+
 int __export rad_packet_add_ipaddr(struct rad_packet_t *pack, const char *vendor_name, const char *name, in_addr_t ipaddr)
 {
 	return rad_packet_add_int(pack, vendor_name, name, ipaddr);
 }
 
-int rad_packet_add_ifid(struct rad_packet_t *pack, const char *vendor_name, const char *name, uint64_t ifid)
+int rad_packet_add_attr_ifid(struct rad_packet_t *pack, struct rad_dict_attr_t *attr, uint64_t ifid)
 {
 	struct rad_attr_t *ra;
-	struct rad_dict_attr_t *attr;
-	struct rad_dict_vendor_t *vendor;
 
-	if (pack->len + (vendor_name ? 8 : 2) + 8 >= REQ_LENGTH_MAX)
+	if (!attr)
 		return -1;
 
-	if (vendor_name) {
-		vendor = rad_dict_find_vendor_name(vendor_name);
-		if (!vendor)
-			return -1;
-		attr = rad_dict_find_vendor_attr(vendor, name);
-	} else {
-		vendor = NULL;
-		attr = rad_dict_find_attr(name);
-	}
-
-	if (!attr)
+	if (pack->len + (attr->vendor ? 8 : 2) + 8 >= REQ_LENGTH_MAX)
 		return -1;
 
 	ra = mempool_alloc(attr_pool);
@@ -710,37 +725,30 @@ int rad_packet_add_ifid(struct rad_packet_t *pack, const char *vendor_name, cons
 		return -1;
 
 	memset(ra, 0, sizeof(*ra));
-	ra->vendor = vendor;
+	ra->vendor = attr->vendor;
 	ra->attr = attr;
 	ra->len = 8;
 	ra->val.ifid = ifid;
 	ra->raw = &ra->val;
 	list_add_tail(&ra->entry, &pack->attrs);
-	pack->len += (vendor_name ? 8 : 2) + 8;
+	pack->len += (attr->vendor ? 8 : 2) + 8;
 
 	return 0;
 }
 
-int rad_packet_add_ipv6prefix(struct rad_packet_t *pack, const char *vendor_name, const char *name, struct in6_addr *prefix, int len)
+int rad_packet_add_ifid(struct rad_packet_t *pack, const char *vendor_name, const char *name, uint64_t ifid)
+{
+	return rad_packet_add_attr_ifid(pack, rad_dict_attr(vendor_name, name), ifid);
+}
+
+int rad_packet_add_attr_ipv6prefix(struct rad_packet_t *pack, struct rad_dict_attr_t *attr, struct in6_addr *prefix, int len)
 {
 	struct rad_attr_t *ra;
-	struct rad_dict_attr_t *attr;
-	struct rad_dict_vendor_t *vendor;
 
-	if (pack->len + (vendor_name ? 8 : 2) + 18 >= REQ_LENGTH_MAX)
+	if (!attr)
 		return -1;
 
-	if (vendor_name) {
-		vendor = rad_dict_find_vendor_name(vendor_name);
-		if (!vendor)
-			return -1;
-		attr = rad_dict_find_vendor_attr(vendor, name);
-	} else {
-		vendor = NULL;
-		attr = rad_dict_find_attr(name);
-	}
-
-	if (!attr)
+	if (pack->len + (attr->vendor ? 8 : 2) + 18 >= REQ_LENGTH_MAX)
 		return -1;
 
 	ra = mempool_alloc(attr_pool);
@@ -748,18 +756,37 @@ int rad_packet_add_ipv6prefix(struct rad_packet_t *pack, const char *vendor_name
 		return -1;
 
 	memset(ra, 0, sizeof(*ra));
-	ra->vendor = vendor;
+	ra->vendor = attr->vendor;
 	ra->attr = attr;
 	ra->len = 18;
 	ra->val.ipv6prefix.len = len;
 	ra->val.ipv6prefix.prefix = *prefix;
 	ra->raw = &ra->val;
 	list_add_tail(&ra->entry, &pack->attrs);
-	pack->len += (vendor_name ? 8 : 2) + 18;
+	pack->len += (attr->vendor ? 8 : 2) + 18;
 
 	return 0;
 }
 
+int rad_packet_add_ipv6prefix(struct rad_packet_t *pack, const char *vendor_name, const char *name, struct in6_addr *prefix, int len)
+{
+	return rad_packet_add_attr_ipv6prefix(pack, rad_dict_attr(vendor_name, name), prefix, len);
+}
+
+struct rad_attr_t __export *rad_packet_find_dict_attr(struct rad_packet_t *pack, struct rad_dict_attr_t *attr)
+{
+	struct rad_attr_t *ra;
+
+	if (!attr)
+		return NULL;
+
+	list_for_each_entry(ra, &pack->attrs, entry) {
+		if (ra->attr == attr)
+			return ra;
+	}
+
+	return NULL;
+}
 
 struct rad_attr_t __export *rad_packet_find_attr(struct rad_packet_t *pack, const char *vendor_name, const char *name)
 {
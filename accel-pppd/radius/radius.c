@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
@@ -42,17 +43,45 @@ int conf_sid_in_auth;
 int conf_require_nas_ident;
 int conf_acct_interim_interval;
 int conf_acct_interim_jitter;
+int conf_acct_interim_spread;
 
 int conf_accounting;
 int conf_fail_time;
 int conf_req_limit;
+int conf_shared_sockets;
 
 static const char *conf_default_realm;
 static int conf_default_realm_len;
 
 const char *conf_attr_tunnel_type;
 
+/*
+ * Sessions are indexed by Acct-Session-Id from the start and by
+ * User-Name, Framed-IP-Address and Calling-Station-Id once started.
+ * Until then they stay on the unindexed list, sessions without
+ * address/calling station id are kept on the *_any lists since they
+ * match any value of that attribute.
+ */
+#define SES_HASH_BITS 13
+#define SES_HASH_SIZE (1 << SES_HASH_BITS)
+
+struct ses_key {
+	const char *sessionid;
+	const char *username;
+	const char *port_id;
+	int port;
+	in_addr_t ipaddr;
+	const char *csid;
+};
+
 static LIST_HEAD(sessions);
+static struct list_head sid_hash[SES_HASH_SIZE];
+static struct list_head user_hash[SES_HASH_SIZE];
+static struct list_head ip_hash[SES_HASH_SIZE];
+static struct list_head csid_hash[SES_HASH_SIZE];
+static LIST_HEAD(unindexed);
+static LIST_HEAD(ip_any);
+static LIST_HEAD(csid_any);
 static pthread_rwlock_t sessions_lock = PTHREAD_RWLOCK_INITIALIZER;
 
 static void *pd_key;
@@ -537,6 +566,21 @@ void rad_update_session_timeout(struct radius_pd_t *rpd, int timeout)
 		triton_timer_add(rpd->ses->ctrl->ctx, &rpd->session_timeout, 0);
 }
 
+static unsigned int str_hash(const char *str)
+{
+	unsigned int h = 2166136261u;
+
+	for (; *str; str++)
+		h = (h ^ (uint8_t)*str) * 16777619u;
+
+	return h & (SES_HASH_SIZE - 1);
+}
+
+static unsigned int ip_hash_fn(in_addr_t addr)
+{
+	return ((uint32_t)addr * 2654435761u) >> (32 - SES_HASH_BITS);
+}
+
 static void ses_starting(struct ap_session *ses)
 {
 	struct radius_pd_t *rpd = mempool_alloc(rpd_pool);
@@ -558,8 +602,13 @@ static void ses_starting(struct ap_session *ses)
 
 	list_add_tail(&rpd->pd.entry, &ses->pd_list);
 
+	INIT_LIST_HEAD(&rpd->ip_entry);
+	INIT_LIST_HEAD(&rpd->csid_entry);
+
 	pthread_rwlock_wrlock(&sessions_lock);
 	list_add_tail(&rpd->entry, &sessions);
+	list_add_tail(&rpd->sid_entry, &sid_hash[str_hash(ses->sessionid)]);
+	list_add_tail(&rpd->user_entry, &unindexed);
 	pthread_rwlock_unlock(&sessions_lock);
 
 #ifdef USE_BACKUP
@@ -592,6 +641,22 @@ static void ses_started(struct ap_session *ses)
 	struct framed_ip6_route *fr6;
 	struct framed_route *fr;
 
+	pthread_rwlock_wrlock(&sessions_lock);
+	list_del(&rpd->user_entry);
+	if (ses->username)
+		list_add_tail(&rpd->user_entry, &user_hash[str_hash(ses->username)]);
+	else
+		INIT_LIST_HEAD(&rpd->user_entry);
+	if (ses->ipv4)
+		list_add_tail(&rpd->ip_entry, &ip_hash[ip_hash_fn(ses->ipv4->peer_addr)]);
+	else
+		list_add_tail(&rpd->ip_entry, &ip_any);
+	if (ses->ctrl->calling_station_id)
+		list_add_tail(&rpd->csid_entry, &csid_hash[str_hash(ses->ctrl->calling_station_id)]);
+	else
+		list_add_tail(&rpd->csid_entry, &csid_any);
+	pthread_rwlock_unlock(&sessions_lock);
+
 	if (rpd->session_timeout.expire_tv.tv_sec) {
 		rpd->session_timeout.expire = session_timeout;
 		triton_timer_add(ses->ctrl->ctx, &rpd->session_timeout, 0);
@@ -666,6 +731,10 @@ static void ses_finished(struct ap_session *ses)
 	pthread_rwlock_wrlock(&sessions_lock);
 	pthread_mutex_lock(&rpd->lock);
 	list_del(&rpd->entry);
+	list_del(&rpd->sid_entry);
+	list_del(&rpd->user_entry);
+	list_del(&rpd->ip_entry);
+	list_del(&rpd->csid_entry);
 	pthread_mutex_unlock(&rpd->lock);
 	pthread_rwlock_unlock(&sessions_lock);
 
@@ -676,6 +745,8 @@ static void ses_finished(struct ap_session *ses)
 		rpd->auth_ctx = NULL;
 	}
 
+	rad_server_interim_cancel(rpd);
+
 	if (rpd->acct_req) {
 		if (rpd->acct_started)
 			rad_acct_stop_defer(rpd);
@@ -779,32 +850,79 @@ void release_pd(struct radius_pd_t *rpd)
 		mempool_free(rpd);
 }
 
+static int ses_match(struct radius_pd_t *rpd, const struct ses_key *k)
+{
+	if (!rpd->ses->username)
+		return 0;
+	if (k->sessionid && strcmp(k->sessionid, rpd->ses->sessionid))
+		return 0;
+	if (k->username && strcmp(k->username, rpd->ses->username))
+		return 0;
+	if (k->port >= 0 && k->port != rpd->ses->unit_idx)
+		return 0;
+	if (k->port_id && strcmp(k->port_id, rpd->ses->ifname))
+		return 0;
+	if (k->ipaddr && rpd->ses->ipv4 && k->ipaddr != rpd->ses->ipv4->peer_addr)
+		return 0;
+	if (k->csid && rpd->ses->ctrl->calling_station_id && strcmp(k->csid, rpd->ses->ctrl->calling_station_id))
+		return 0;
+
+	return 1;
+}
+
+static struct radius_pd_t *ses_scan(struct list_head *head, size_t off, const struct ses_key *k)
+{
+	struct list_head *pos;
+	struct radius_pd_t *rpd;
+
+	list_for_each(pos, head) {
+		rpd = (struct radius_pd_t *)((char *)pos - off);
+		if (ses_match(rpd, k))
+			return rpd;
+	}
+
+	return NULL;
+}
+
 struct radius_pd_t *rad_find_session(const char *sessionid, const char *username, const char *port_id, int port, in_addr_t ipaddr, const char *csid)
 {
 	struct radius_pd_t *rpd;
+	struct ses_key k = {
+		.sessionid = sessionid,
+		.username = username,
+		.port_id = port_id,
+		.port = port,
+		.ipaddr = ipaddr,
+		.csid = csid,
+	};
 
 	pthread_rwlock_rdlock(&sessions_lock);
-	list_for_each_entry(rpd, &sessions, entry) {
-		if (!rpd->ses->username)
-			continue;
-		if (sessionid && strcmp(sessionid, rpd->ses->sessionid))
-			continue;
-		if (username && strcmp(username, rpd->ses->username))
-			continue;
-		if (port >= 0 && port != rpd->ses->unit_idx)
-			continue;
-		if (port_id && strcmp(port_id, rpd->ses->ifname))
-			continue;
-		if (ipaddr && rpd->ses->ipv4 && ipaddr != rpd->ses->ipv4->peer_addr)
-			continue;
-		if (csid && rpd->ses->ctrl->calling_station_id && strcmp(csid, rpd->ses->ctrl->calling_station_id))
-			continue;
+	if (sessionid)
+		rpd = ses_scan(&sid_hash[str_hash(sessionid)], offsetof(typeof(*rpd), sid_entry), &k);
+	else if (ipaddr) {
+		rpd = ses_scan(&ip_hash[ip_hash_fn(ipaddr)], offsetof(typeof(*rpd), ip_entry), &k);
+		if (!rpd)
+			rpd = ses_scan(&ip_any, offsetof(typeof(*rpd), ip_entry), &k);
+		if (!rpd)
+			rpd = ses_scan(&unindexed, offsetof(typeof(*rpd), user_entry), &k);
+	} else if (username) {
+		rpd = ses_scan(&user_hash[str_hash(username)], offsetof(typeof(*rpd), user_entry), &k);
+		if (!rpd)
+			rpd = ses_scan(&unindexed, offsetof(typeof(*rpd), user_entry), &k);
+	} else if (csid) {
+		rpd = ses_scan(&csid_hash[str_hash(csid)], offsetof(typeof(*rpd), csid_entry), &k);
+		if (!rpd)
+			rpd = ses_scan(&csid_any, offsetof(typeof(*rpd), csid_entry), &k);
+		if (!rpd)
+			rpd = ses_scan(&unindexed, offsetof(typeof(*rpd), user_entry), &k);
+	} else
+		rpd = ses_scan(&sessions, offsetof(typeof(*rpd), entry), &k);
+
+	if (rpd)
 		pthread_mutex_lock(&rpd->lock);
-		pthread_rwlock_unlock(&sessions_lock);
-		return rpd;
-	}
 	pthread_rwlock_unlock(&sessions_lock);
-	return NULL;
+
+	return rpd;
 }
 
 struct radius_pd_t *rad_find_session_pack(struct rad_packet_t *pack)
@@ -974,6 +1092,10 @@ static int load_config(void)
 	else if (conf_nas_ip_address)
 		conf_bind = conf_nas_ip_address;
 
+	opt = conf_get_opt("radius", "shared-sockets");
+	if (opt && atoi(opt) >= 0)
+		conf_shared_sockets = atoi(opt);
+
 	opt = conf_get_opt("radius", "dae-server");
 	if (opt && parse_server(opt, &conf_dm_coa_server, &conf_dm_coa_port, &conf_dm_coa_secret)) {
 		log_emerg("radius: failed to parse dae-server\n");
@@ -996,6 +1118,12 @@ static int load_config(void)
 	if (opt && atoi(opt) >= 0)
 		conf_acct_interim_jitter = atoi(opt);
 
+	opt = conf_get_opt("radius", "acct-interim-spread");
+	if (opt)
+		conf_acct_interim_spread = atoi(opt) > 0;
+	else
+		conf_acct_interim_spread = 0;
+
 	opt = conf_get_opt("radius", "acct-delay-time");
 	if (opt)
 		conf_acct_delay_time = atoi(opt);
@@ -1014,10 +1142,18 @@ static void radius_init(void)
 	const char *dict = NULL;
 	struct conf_sect_t *s = conf_get_section("radius");
 	struct conf_option_t *opt1;
+	int i;
 
 	rpd_pool = mempool_create(sizeof(struct radius_pd_t));
 	auth_ctx_pool = mempool_create(sizeof(struct radius_auth_ctx));
 
+	for (i = 0; i < SES_HASH_SIZE; i++) {
+		INIT_LIST_HEAD(&sid_hash[i]);
+		INIT_LIST_HEAD(&user_hash[i]);
+		INIT_LIST_HEAD(&ip_hash[i]);
+		INIT_LIST_HEAD(&csid_hash[i]);
+	}
+
 	if (load_config())
 		_exit(EXIT_FAILURE);
 
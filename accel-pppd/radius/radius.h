@@ -65,6 +65,8 @@ struct rad_dict_vendor_t
 	int len;
 	const char *name;
 	struct list_head items;
+	struct list_head name_hash;
+	struct list_head id_hash;
 };
 
 struct rad_dict_value_t
@@ -84,6 +86,9 @@ struct rad_dict_attr_t
 	int size;
 	struct list_head values;
 	struct list_head tlv;
+	struct rad_dict_vendor_t *vendor;
+	struct list_head name_hash;
+	struct list_head id_hash;
 };
 
 struct rad_attr_t
@@ -125,6 +130,7 @@ struct rad_dict_value_t *rad_dict_find_val(struct rad_dict_attr_t *, rad_value_t
 struct rad_dict_vendor_t *rad_dict_find_vendor_name(const char *name);
 struct rad_dict_vendor_t *rad_dict_find_vendor_id(int id);
 struct rad_dict_attr_t *rad_dict_find_vendor_attr(struct rad_dict_vendor_t *vendor, const char *name);
+struct rad_dict_attr_t *rad_dict_attr(const char *vendor, const char *name);
 
 struct rad_attr_t *rad_packet_find_attr(struct rad_packet_t *pack, const char *vendor, const char *name);
 int rad_packet_add_int(struct rad_packet_t *pack, const char *vendor, const char *name, int val);
@@ -138,5 +144,18 @@ int rad_packet_add_ipaddr(struct rad_packet_t *pack, const char *vendor, const c
 int rad_packet_add_ifid(struct rad_packet_t *pack, const char *vendor, const char *name, uint64_t ifid);
 int rad_packet_add_ipv6prefix(struct rad_packet_t *pack, const char *vendor, const char *name, struct in6_addr *prefix, int len);
 
+/* attribute handle variants, attr is obtained once by rad_dict_attr() */
+struct rad_attr_t *rad_packet_find_dict_attr(struct rad_packet_t *pack, struct rad_dict_attr_t *attr);
+int rad_packet_add_attr_int(struct rad_packet_t *pack, struct rad_dict_attr_t *attr, int val);
+int rad_packet_add_attr_val(struct rad_packet_t *pack, struct rad_dict_attr_t *attr, struct rad_dict_value_t *val);
+int rad_packet_add_attr_str(struct rad_packet_t *pack, struct rad_dict_attr_t *attr, const char *val);
+int rad_packet_add_attr_octets(struct rad_packet_t *pack, struct rad_dict_attr_t *attr, const uint8_t *val, int len);
+int rad_packet_add_attr_ipaddr(struct rad_packet_t *pack, struct rad_dict_attr_t *attr, in_addr_t ipaddr);
+int rad_packet_add_attr_ifid(struct rad_packet_t *pack, struct rad_dict_attr_t *attr, uint64_t ifid);
+int rad_packet_add_attr_ipv6prefix(struct rad_packet_t *pack, struct rad_dict_attr_t *attr, struct in6_addr *prefix, int len);
+int rad_packet_change_attr_int(struct rad_packet_t *pack, struct rad_dict_attr_t *attr, int val);
+int rad_packet_change_attr_val(struct rad_packet_t *pack, struct rad_dict_attr_t *attr, struct rad_dict_value_t *val);
+int rad_packet_change_attr_octets(struct rad_packet_t *pack, struct rad_dict_attr_t *attr, const uint8_t *val, int len);
+
 #endif
 
@@ -12,6 +12,7 @@
 #include "pwdb.h"
 
 struct rad_server_t;
+struct rad_sock_t;
 
 struct radius_auth_ctx {
 	struct rad_req_t *req;
@@ -43,6 +44,10 @@ struct framed_ip6_route {
 
 struct radius_pd_t {
 	struct list_head entry;
+	struct list_head sid_entry;
+	struct list_head user_entry;
+	struct list_head ip_entry;
+	struct list_head csid_entry;
 	struct ap_private pd;
 	struct ap_session *ses;
 	pthread_mutex_t lock;
@@ -56,6 +61,8 @@ struct radius_pd_t {
 
 	struct rad_req_t *acct_req;
 	struct triton_timer_t acct_interim_timer;
+	struct list_head interim_entry;
+	struct rad_server_t *interim_serv;
 
 	struct triton_timer_t session_timeout;
 
@@ -94,6 +101,8 @@ struct rad_req_t {
 
 	struct radius_pd_t *rpd;
 	struct rad_server_t *serv;
+	struct rad_sock_t *sock;
+	int sock_id;
 
 	in_addr_t server_addr;
 
@@ -127,22 +136,36 @@ struct rad_server_t {
 	int req_limit;
 	int req_cnt;
 	int queue_cnt;
+	int queue_len[2];
+	int queue_max[2];
+	int interim_rate;
+	int interim_queue_cnt;
 	int fail_timeout;
 	int max_fail;
 
 	struct list_head req_queue[2];
+	struct list_head interim_queue;
+	struct triton_timer_t interim_timer;
+	uint64_t interim_ts;
+	long interim_credit;
 	int client_cnt[2];
 	time_t fail_time;
 	int timeout_cnt;
 	int weight;
 	pthread_mutex_t lock;
 
+	pthread_mutex_t sock_lock;
+	struct list_head sock_list[2];
+	int sock_cnt[2];
+
 	unsigned long stat_auth_sent;
 	unsigned long stat_auth_lost;
 	unsigned long stat_acct_sent;
 	unsigned long stat_acct_lost;
 	unsigned long stat_interim_sent;
 	unsigned long stat_interim_lost;
+	unsigned long stat_interim_delayed;
+	unsigned long stat_queued[2];
 	unsigned long stat_fail_cnt;
 
 	struct stat_accm_t *stat_auth_lost_1m;
@@ -170,6 +193,58 @@ struct rad_server_t {
 #define RAD_SERV_AUTH 0
 #define RAD_SERV_ACCT 1
 
+/* attribute handles used to build requests, resolved when dictionary is loaded */
+struct rad_attrs_t {
+	struct rad_dict_attr_t *user_name;
+	struct rad_dict_attr_t *user_password;
+	struct rad_dict_attr_t *chap_challenge;
+	struct rad_dict_attr_t *chap_password;
+	struct rad_dict_attr_t *ms_chap_challenge;
+	struct rad_dict_attr_t *ms_chap_response;
+	struct rad_dict_attr_t *ms_chap2_response;
+	struct rad_dict_attr_t *ms_chap2_success;
+	struct rad_dict_attr_t *ms_chap_error;
+	struct rad_dict_attr_t *reply_message;
+	struct rad_dict_attr_t *state;
+	struct rad_dict_attr_t *class;
+	struct rad_dict_attr_t *nas_identifier;
+	struct rad_dict_attr_t *nas_ip_address;
+	struct rad_dict_attr_t *nas_port;
+	struct rad_dict_attr_t *nas_port_id;
+	struct rad_dict_attr_t *nas_port_type;
+	struct rad_dict_attr_t *service_type;
+	struct rad_dict_attr_t *framed_protocol;
+	struct rad_dict_attr_t *calling_station_id;
+	struct rad_dict_attr_t *called_station_id;
+	struct rad_dict_attr_t *framed_ip_address;
+	struct rad_dict_attr_t *framed_interface_id;
+	struct rad_dict_attr_t *framed_ipv6_prefix;
+	struct rad_dict_attr_t *delegated_ipv6_prefix;
+	struct rad_dict_attr_t *acct_status_type;
+	struct rad_dict_attr_t *acct_authentic;
+	struct rad_dict_attr_t *acct_session_id;
+	struct rad_dict_attr_t *acct_session_time;
+	struct rad_dict_attr_t *acct_input_octets;
+	struct rad_dict_attr_t *acct_output_octets;
+	struct rad_dict_attr_t *acct_input_packets;
+	struct rad_dict_attr_t *acct_output_packets;
+	struct rad_dict_attr_t *acct_input_gigawords;
+	struct rad_dict_attr_t *acct_output_gigawords;
+	struct rad_dict_attr_t *acct_delay_time;
+	struct rad_dict_attr_t *acct_terminate_cause;
+
+	struct rad_dict_value_t *nas_port_type_ethernet;
+	struct rad_dict_value_t *nas_port_type_virtual;
+	struct rad_dict_value_t *service_type_framed_user;
+	struct rad_dict_value_t *framed_protocol_ppp;
+	struct rad_dict_value_t *acct_authentic_radius;
+	struct rad_dict_value_t *acct_status_start;
+	struct rad_dict_value_t *acct_status_stop;
+	struct rad_dict_value_t *acct_status_interim;
+	struct rad_dict_value_t *acct_status_on;
+	struct rad_dict_value_t *acct_status_off;
+};
+
 extern int conf_max_try;
 extern int conf_timeout;
 extern int conf_acct_timeout;
@@ -188,8 +263,12 @@ extern in_addr_t conf_dm_coa_server;
 extern int conf_dm_coa_port;
 extern int conf_acct_interim_interval;
 extern int conf_acct_interim_jitter;
+extern int conf_acct_interim_spread;
 extern int conf_accounting;
 extern const char *conf_attr_tunnel_type;
+extern int conf_shared_sockets;
+
+extern struct rad_attrs_t rad_attr;
 
 int rad_check_nas_pack(struct rad_packet_t *pack);
 struct radius_pd_t *rad_find_session(const char *sessionid, const char *username, const char *port_id, int port, in_addr_t ipaddr, const char *csid);
@@ -206,6 +285,11 @@ void rad_req_free(struct rad_req_t *);
 int rad_req_send(struct rad_req_t *req);
 int __rad_req_send(struct rad_req_t *req, int async);
 int rad_req_read(struct triton_md_handler_t *h);
+void __rad_req_recv(struct rad_req_t *req, struct rad_packet_t *pack);
+void rad_req_listen(struct rad_req_t *req, struct triton_context_t *ctx);
+void rad_req_unlisten(struct rad_req_t *req);
+void rad_req_close_socket(struct rad_req_t *req);
+void rad_server_close_sockets(struct rad_server_t *serv);
 
 struct radius_pd_t *find_pd(struct ap_session *ses);
 int rad_proc_attrs(struct rad_req_t *req);
@@ -222,6 +306,7 @@ int rad_acct_start(struct radius_pd_t *rpd);
 int rad_acct_stop(struct radius_pd_t *rpd);
 void rad_acct_stop_defer(struct radius_pd_t *rpd);
 void rad_acct_force_interim_update(struct radius_pd_t *rpd);
+void rad_acct_interim_wakeup(struct radius_pd_t *rpd);
 
 struct rad_packet_t *rad_packet_alloc(int code);
 int rad_packet_build(struct rad_packet_t *pack, uint8_t *RA);
@@ -242,6 +327,8 @@ int rad_server_realloc(struct rad_req_t *);
 void rad_server_fail(struct rad_server_t *);
 void rad_server_timeout(struct rad_server_t *);
 void rad_server_reply(struct rad_server_t *);
+int rad_server_interim_enter(struct radius_pd_t *rpd);
+void rad_server_interim_cancel(struct radius_pd_t *rpd);
 
 void rad_update_session_timeout(struct radius_pd_t *rpd, int timeout);
 
@@ -251,11 +338,12 @@ struct rtnl_link_stats;
 int rad_read_stats(struct radius_pd_t *rpd, struct rtnl_link_stats *stats);
 
 struct stat_accm_t;
-struct stat_accm_t *stat_accm_create(unsigned int time);
+struct stat_accm_t *stat_accm_create(unsigned int time, int hist);
 void stat_accm_free(struct stat_accm_t *);
 void stat_accm_add(struct stat_accm_t *, unsigned int);
 unsigned long stat_accm_get_cnt(struct stat_accm_t *);
 unsigned long stat_accm_get_avg(struct stat_accm_t *);
+unsigned long stat_accm_get_pct(struct stat_accm_t *, unsigned int pct);
 
 #endif
 
@@ -9,14 +9,55 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
+#include "crypto.h"
+
 #include "log.h"
 #include "radius_p.h"
 #include "mempool.h"
 
 #include "memdebug.h"
 
+#define SOCK_ID_CNT 256
+
+/*
+ * Shared sockets (radius.shared-sockets > 0): requests to a server
+ * are multiplexed over a few long-lived sockets connected to it.
+ * Every in-flight request owns an identifier slot on one of them and
+ * replies are matched by identifier and verified by the response
+ * authenticator, then handed over to the request's context.
+ */
+struct rad_sock_reply_t {
+	struct rad_sock_t *sock;
+	int id;
+	unsigned int seq;
+};
+
+struct rad_sock_slot_t {
+	struct rad_req_t *req;
+	struct rad_packet_t *reply;
+	struct rad_sock_reply_t *pending;
+	struct triton_context_t *ctx;
+	uint8_t RA[16];
+	unsigned int seq;
+	int listen;
+	int sent;
+};
+
+struct rad_sock_t {
+	struct list_head entry;
+	struct triton_md_handler_t hnd;
+	struct rad_server_t *serv;
+	pthread_mutex_t lock;
+	int refs;
+	int free_cnt;
+	int next_id;
+	struct rad_sock_slot_t slot[SOCK_ID_CNT];
+};
+
 static int make_socket(struct rad_req_t *req);
+static void rad_sock_detach(struct rad_req_t *req);
 static mempool_t req_pool;
+static mempool_t reply_pool;
 
 static struct rad_req_t *__rad_req_alloc(struct radius_pd_t *rpd, int code, const char *username, in_addr_t addr, int port, int prio)
 {
@@ -75,47 +116,47 @@ static struct rad_req_t *__rad_req_alloc(struct radius_pd_t *rpd, int code, cons
 	if (code == CODE_ACCOUNTING_REQUEST && rpd->acct_username)
 		username = rpd->acct_username;
 
-	if (rad_packet_add_str(req->pack, NULL, "User-Name", username))
+	if (rad_packet_add_attr_str(req->pack, rad_attr.user_name, username))
 		goto out_err;
 
 	if (conf_nas_identifier)
-		if (rad_packet_add_str(req->pack, NULL, "NAS-Identifier", conf_nas_identifier))
+		if (rad_packet_add_attr_str(req->pack, rad_attr.nas_identifier, conf_nas_identifier))
 			goto out_err;
 
 	if (conf_nas_ip_address)
-		if (rad_packet_add_ipaddr(req->pack, NULL, "NAS-IP-Address", conf_nas_ip_address))
+		if (rad_packet_add_attr_ipaddr(req->pack, rad_attr.nas_ip_address, conf_nas_ip_address))
 			goto out_err;
 
-	if (rpd->ses->unit_idx != -1 && rad_packet_add_int(req->pack, NULL, "NAS-Port", rpd->ses->unit_idx))
+	if (rpd->ses->unit_idx != -1 && rad_packet_add_attr_int(req->pack, rad_attr.nas_port, rpd->ses->unit_idx))
 		goto out_err;
 
-	if (*rpd->ses->ifname && rad_packet_add_str(req->pack, NULL, "NAS-Port-Id", rpd->ses->ifname))
+	if (*rpd->ses->ifname && rad_packet_add_attr_str(req->pack, rad_attr.nas_port_id, rpd->ses->ifname))
 		goto out_err;
 
 	if (req->rpd->ses->ctrl->type == CTRL_TYPE_IPOE) {
-		if (rad_packet_add_val(req->pack, NULL, "NAS-Port-Type", "Ethernet"))
+		if (rad_packet_add_attr_val(req->pack, rad_attr.nas_port_type, rad_attr.nas_port_type_ethernet))
 			goto out_err;
 	} else {
-		if (rad_packet_add_val(req->pack, NULL, "NAS-Port-Type", "Virtual"))
+		if (rad_packet_add_attr_val(req->pack, rad_attr.nas_port_type, rad_attr.nas_port_type_virtual))
 			goto out_err;
 
-		if (rad_packet_add_val(req->pack, NULL, "Service-Type", "Framed-User"))
+		if (rad_packet_add_attr_val(req->pack, rad_attr.service_type, rad_attr.service_type_framed_user))
 			goto out_err;
 
-		if (rad_packet_add_val(req->pack, NULL, "Framed-Protocol", "PPP"))
+		if (rad_packet_add_attr_val(req->pack, rad_attr.framed_protocol, rad_attr.framed_protocol_ppp))
 			goto out_err;
 	}
 
 	if (rpd->ses->ctrl->calling_station_id)
-		if (rad_packet_add_str(req->pack, NULL, "Calling-Station-Id", rpd->ses->ctrl->calling_station_id))
+		if (rad_packet_add_attr_str(req->pack, rad_attr.calling_station_id, rpd->ses->ctrl->calling_station_id))
 			goto out_err;
 
 	if (rpd->ses->ctrl->called_station_id)
-		if (rad_packet_add_str(req->pack, NULL, "Called-Station-Id", rpd->ses->ctrl->called_station_id))
+		if (rad_packet_add_attr_str(req->pack, rad_attr.called_station_id, rpd->ses->ctrl->called_station_id))
 			goto out_err;
 
 	if (rpd->attr_class)
-		if (rad_packet_add_octets(req->pack, NULL, "Class", rpd->attr_class, rpd->attr_class_len))
+		if (rad_packet_add_attr_octets(req->pack, rad_attr.class, rpd->attr_class, rpd->attr_class_len))
 			goto out_err;
 
 	if (conf_attr_tunnel_type)
@@ -192,39 +233,39 @@ int rad_req_acct_fill(struct rad_req_t *req)
 
 	memset(req->RA, 0, sizeof(req->RA));
 
-	if (rad_packet_add_val(req->pack, NULL, "Acct-Status-Type", "Start"))
+	if (rad_packet_add_attr_val(req->pack, rad_attr.acct_status_type, rad_attr.acct_status_start))
 		return -1;
-	if (rad_packet_add_val(req->pack, NULL, "Acct-Authentic", "RADIUS"))
+	if (rad_packet_add_attr_val(req->pack, rad_attr.acct_authentic, rad_attr.acct_authentic_radius))
 		return -1;
-	if (rad_packet_add_str(req->pack, NULL, "Acct-Session-Id", req->rpd->ses->sessionid))
+	if (rad_packet_add_attr_str(req->pack, rad_attr.acct_session_id, req->rpd->ses->sessionid))
 		return -1;
-	if (rad_packet_add_int(req->pack, NULL, "Acct-Session-Time", 0))
+	if (rad_packet_add_attr_int(req->pack, rad_attr.acct_session_time, 0))
 		return -1;
-	if (rad_packet_add_int(req->pack, NULL, "Acct-Input-Octets", 0))
+	if (rad_packet_add_attr_int(req->pack, rad_attr.acct_input_octets, 0))
 		return -1;
-	if (rad_packet_add_int(req->pack, NULL, "Acct-Output-Octets", 0))
+	if (rad_packet_add_attr_int(req->pack, rad_attr.acct_output_octets, 0))
 		return -1;
-	if (rad_packet_add_int(req->pack, NULL, "Acct-Input-Packets", 0))
+	if (rad_packet_add_attr_int(req->pack, rad_attr.acct_input_packets, 0))
 		return -1;
-	if (rad_packet_add_int(req->pack, NULL, "Acct-Output-Packets", 0))
+	if (rad_packet_add_attr_int(req->pack, rad_attr.acct_output_packets, 0))
 		return -1;
-	if (rad_packet_add_int(req->pack, NULL, "Acct-Input-Gigawords", 0))
+	if (rad_packet_add_attr_int(req->pack, rad_attr.acct_input_gigawords, 0))
 		return -1;
-	if (rad_packet_add_int(req->pack, NULL, "Acct-Output-Gigawords", 0))
+	if (rad_packet_add_attr_int(req->pack, rad_attr.acct_output_gigawords, 0))
 		return -1;
 	if (conf_acct_delay_time) {
-		if (rad_packet_add_int(req->pack, NULL, "Acct-Delay-Time", 0))
+		if (rad_packet_add_attr_int(req->pack, rad_attr.acct_delay_time, 0))
 			return -1;
 	}
 	if (req->rpd->ses->ipv4) {
-		if (rad_packet_add_ipaddr(req->pack, NULL, "Framed-IP-Address", req->rpd->ses->ipv4->peer_addr))
+		if (rad_packet_add_attr_ipaddr(req->pack, rad_attr.framed_ip_address, req->rpd->ses->ipv4->peer_addr))
 			return -1;
 	}
 	if (req->rpd->ses->ipv6) {
-		if (rad_packet_add_ifid(req->pack, NULL, "Framed-Interface-Id", req->rpd->ses->ipv6->peer_intf_id))
+		if (rad_packet_add_attr_ifid(req->pack, rad_attr.framed_interface_id, req->rpd->ses->ipv6->peer_intf_id))
 			return -1;
 		list_for_each_entry(a, &req->rpd->ses->ipv6->addr_list, entry) {
-			if (rad_packet_add_ipv6prefix(req->pack, NULL, "Framed-IPv6-Prefix", &a->addr, a->prefix_len))
+			if (rad_packet_add_attr_ipv6prefix(req->pack, rad_attr.framed_ipv6_prefix, &a->addr, a->prefix_len))
 				return -1;
 		}
 	}
@@ -240,10 +281,7 @@ void rad_req_free(struct rad_req_t *req)
 	if (req->serv)
 		rad_server_put(req->serv, req->type);
 
-	if (req->hnd.tpd)
-		triton_md_unregister_handler(&req->hnd, 1);
-	else if (req->hnd.fd != -1)
-		close(req->hnd.fd);
+	rad_req_close_socket(req);
 
 	if (req->timeout.tpd)
 		triton_timer_del(&req->timeout);
@@ -257,10 +295,429 @@ void rad_req_free(struct rad_req_t *req)
 	mempool_free(req);
 }
 
+static void rad_sock_put(struct rad_sock_t *sock)
+{
+	if (__sync_sub_and_fetch(&sock->refs, 1))
+		return;
+
+	pthread_mutex_destroy(&sock->lock);
+	_free(sock);
+}
+
+static int rad_sock_verify(struct rad_packet_t *reply, const uint8_t *RA, const char *secret)
+{
+	MD5_CTX ctx;
+	uint8_t md[16];
+
+	MD5_Init(&ctx);
+	MD5_Update(&ctx, reply->buf, 4);
+	MD5_Update(&ctx, RA, 16);
+	MD5_Update(&ctx, reply->buf + 20, reply->len - 20);
+	MD5_Update(&ctx, secret, strlen(secret));
+	MD5_Final(md, &ctx);
+
+	return memcmp(md, reply->buf + 4, 16);
+}
+
+static void rad_sock_deliver(struct rad_sock_reply_t *r)
+{
+	struct rad_sock_t *sock = r->sock;
+	struct rad_sock_slot_t *slot = &sock->slot[r->id];
+	struct rad_req_t *req = NULL;
+	struct rad_packet_t *reply = NULL;
+
+	pthread_mutex_lock(&sock->lock);
+	if (slot->pending == r)
+		slot->pending = NULL;
+	if (slot->seq == r->seq && slot->req && slot->reply) {
+		req = slot->req;
+		reply = slot->reply;
+		slot->reply = NULL;
+		slot->listen = 0;
+	}
+	pthread_mutex_unlock(&sock->lock);
+
+	rad_sock_put(sock);
+	mempool_free(r);
+
+	if (!req)
+		return;
+
+	if (!req->rpd)
+		log_switch(triton_context_self(), NULL);
+
+	rad_server_reply(req->serv);
+
+	__rad_req_recv(req, reply);
+}
+
+static int rad_sock_read(struct triton_md_handler_t *h)
+{
+	struct rad_sock_t *sock = container_of(h, typeof(*sock), hnd);
+	struct rad_sock_slot_t *slot;
+	struct rad_sock_reply_t *r;
+	struct rad_packet_t *pack;
+
+	log_switch(triton_context_self(), NULL);
+
+	while (1) {
+		if (rad_packet_recv(h->fd, &pack, NULL)) {
+			/* malformed packet, keep draining until EAGAIN */
+			if (recv(h->fd, NULL, 0, MSG_PEEK | MSG_DONTWAIT) < 0)
+				return 0;
+			continue;
+		}
+
+		if (!pack)
+			continue;
+
+		slot = &sock->slot[pack->id];
+
+		pthread_mutex_lock(&sock->lock);
+		if (!slot->req || !slot->listen || slot->reply || rad_sock_verify(pack, slot->RA, sock->serv->secret)) {
+			pthread_mutex_unlock(&sock->lock);
+			rad_packet_free(pack);
+			continue;
+		}
+
+		r = mempool_alloc(reply_pool);
+		if (!r) {
+			pthread_mutex_unlock(&sock->lock);
+			log_emerg("radius: out of memory\n");
+			rad_packet_free(pack);
+			continue;
+		}
+
+		r->sock = sock;
+		r->id = pack->id;
+		r->seq = slot->seq;
+		__sync_add_and_fetch(&sock->refs, 1);
+
+		/* queued under the lock, so the owner can't detach and close its context in between */
+		if (triton_context_call(slot->ctx, (triton_event_func)rad_sock_deliver, r)) {
+			pthread_mutex_unlock(&sock->lock);
+			__sync_sub_and_fetch(&sock->refs, 1);
+			mempool_free(r);
+			rad_packet_free(pack);
+			continue;
+		}
+
+		slot->reply = pack;
+		slot->pending = r;
+		pthread_mutex_unlock(&sock->lock);
+	}
+
+	return 0;
+}
+
+static struct rad_sock_t *rad_sock_create(struct rad_server_t *serv, int type)
+{
+	struct rad_sock_t *sock;
+	struct sockaddr_in addr;
+	int fd;
+
+	fd = socket(PF_INET, SOCK_DGRAM, 0);
+	if (fd < 0) {
+		log_error("radius:socket: %s\n", strerror(errno));
+		return NULL;
+	}
+
+	fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+
+	if (conf_bind) {
+		addr.sin_addr.s_addr = conf_bind;
+		if (bind(fd, (struct sockaddr *) &addr, sizeof(addr))) {
+			log_error("radius:bind: %s\n", strerror(errno));
+			goto out_err;
+		}
+	}
+
+	addr.sin_addr.s_addr = serv->addr;
+	addr.sin_port = htons(type == RAD_SERV_AUTH ? serv->auth_port : serv->acct_port);
+
+	if (connect(fd, (struct sockaddr *) &addr, sizeof(addr))) {
+		log_error("radius:connect: %s\n", strerror(errno));
+		goto out_err;
+	}
+
+	if (fcntl(fd, F_SETFL, O_NONBLOCK)) {
+		log_error("radius: failed to set nonblocking mode: %s\n", strerror(errno));
+		goto out_err;
+	}
+
+	sock = _malloc(sizeof(*sock));
+	memset(sock, 0, sizeof(*sock));
+	pthread_mutex_init(&sock->lock, NULL);
+	sock->serv = serv;
+	sock->refs = 1;
+	sock->free_cnt = SOCK_ID_CNT;
+	sock->next_id = random() % SOCK_ID_CNT;
+	sock->hnd.fd = fd;
+	sock->hnd.read = rad_sock_read;
+
+	triton_md_register_handler(&serv->ctx, &sock->hnd);
+	triton_md_enable_handler(&sock->hnd, MD_MODE_READ);
+
+	return sock;
+
+out_err:
+	close(fd);
+	return NULL;
+}
+
+static int rad_sock_alloc_id(struct rad_sock_t *sock, struct rad_req_t *req)
+{
+	int i, id;
+
+	pthread_mutex_lock(&sock->lock);
+	if (!sock->free_cnt) {
+		pthread_mutex_unlock(&sock->lock);
+		return -1;
+	}
+
+	for (i = 0; i < SOCK_ID_CNT; i++) {
+		id = (sock->next_id + i) % SOCK_ID_CNT;
+		if (!sock->slot[id].req)
+			break;
+	}
+
+	sock->slot[id].req = req;
+	sock->slot[id].listen = 0;
+	sock->slot[id].sent = 0;
+	sock->next_id = (id + 1) % SOCK_ID_CNT;
+	sock->free_cnt--;
+	pthread_mutex_unlock(&sock->lock);
+
+	__sync_add_and_fetch(&sock->refs, 1);
+
+	req->sock = sock;
+	req->sock_id = id;
+
+	return 0;
+}
+
+static int rad_sock_attach(struct rad_req_t *req)
+{
+	struct rad_server_t *serv = req->serv;
+	struct rad_sock_t *sock;
+	int r = -1;
+
+	pthread_mutex_lock(&serv->sock_lock);
+	list_for_each_entry(sock, &serv->sock_list[req->type], entry) {
+		if (!rad_sock_alloc_id(sock, req)) {
+			r = 0;
+			break;
+		}
+	}
+
+	if (r && serv->sock_cnt[req->type] < conf_shared_sockets) {
+		sock = rad_sock_create(serv, req->type);
+		if (sock) {
+			list_add_tail(&sock->entry, &serv->sock_list[req->type]);
+			serv->sock_cnt[req->type]++;
+			r = rad_sock_alloc_id(sock, req);
+		}
+	}
+	pthread_mutex_unlock(&serv->sock_lock);
+
+	return r;
+}
+
+/*
+ * Takes back a reply queued to the slot owner's context, so it isn't
+ * lost together with the sock reference when the context is closed.
+ * Must be called with sock->lock held.
+ */
+static struct rad_sock_reply_t *rad_sock_cancel(struct rad_sock_slot_t *slot)
+{
+	struct rad_sock_reply_t *r = slot->pending;
+
+	if (!r)
+		return NULL;
+
+	slot->pending = NULL;
+
+	/* already dequeued, rad_sock_deliver() will find the slot changed */
+	if (triton_cancel_call_arg(slot->ctx, (triton_event_func)rad_sock_deliver, r))
+		return NULL;
+
+	return r;
+}
+
+static void rad_sock_detach(struct rad_req_t *req)
+{
+	struct rad_sock_t *sock = req->sock;
+	struct rad_sock_slot_t *slot = &sock->slot[req->sock_id];
+	struct rad_sock_reply_t *r;
+	struct rad_packet_t *reply;
+
+	pthread_mutex_lock(&sock->lock);
+	r = rad_sock_cancel(slot);
+	reply = slot->reply;
+	slot->req = NULL;
+	slot->reply = NULL;
+	slot->listen = 0;
+	slot->seq++;
+	sock->free_cnt++;
+	pthread_mutex_unlock(&sock->lock);
+
+	if (reply)
+		rad_packet_free(reply);
+
+	if (r) {
+		mempool_free(r);
+		rad_sock_put(sock);
+	}
+
+	req->sock = NULL;
+	rad_sock_put(sock);
+}
+
+/*
+ * Makes the packet identifier match the slot owned by the request.
+ * Callers bump pack->id to mark a changed packet, in this case
+ * a new identifier is allocated.
+ */
+static int rad_sock_prepare(struct rad_req_t *req)
+{
+	struct rad_packet_t *pack = req->pack;
+	struct rad_sock_slot_t *slot = &req->sock->slot[req->sock_id];
+	uint8_t *buf = pack->buf;
+	MD5_CTX ctx;
+
+	if (slot->sent && pack->id != req->sock_id) {
+		rad_sock_detach(req);
+		if (rad_sock_attach(req))
+			return -1;
+	}
+
+	if (buf[1] != req->sock_id) {
+		pack->id = req->sock_id;
+		buf[1] = req->sock_id;
+		if (pack->code == CODE_ACCOUNTING_REQUEST) {
+			memset(buf + 4, 0, 16);
+			MD5_Init(&ctx);
+			MD5_Update(&ctx, buf, pack->len);
+			MD5_Update(&ctx, req->serv->secret, strlen(req->serv->secret));
+			MD5_Final(buf + 4, &ctx);
+		}
+	}
+
+	slot = &req->sock->slot[req->sock_id];
+
+	pthread_mutex_lock(&req->sock->lock);
+	memcpy(slot->RA, buf + 4, 16);
+	slot->sent = 1;
+	pthread_mutex_unlock(&req->sock->lock);
+
+	return 0;
+}
+
+static void rad_sock_listen(struct rad_req_t *req, struct triton_context_t *ctx)
+{
+	struct rad_sock_slot_t *slot = &req->sock->slot[req->sock_id];
+
+	pthread_mutex_lock(&req->sock->lock);
+	slot->ctx = ctx;
+	slot->listen = 1;
+	pthread_mutex_unlock(&req->sock->lock);
+}
+
+static void rad_sock_unlisten(struct rad_req_t *req)
+{
+	struct rad_sock_slot_t *slot = &req->sock->slot[req->sock_id];
+	struct rad_sock_reply_t *r;
+	struct rad_packet_t *reply;
+
+	pthread_mutex_lock(&req->sock->lock);
+	r = rad_sock_cancel(slot);
+	reply = slot->reply;
+	slot->reply = NULL;
+	slot->listen = 0;
+	slot->seq++;
+	pthread_mutex_unlock(&req->sock->lock);
+
+	if (reply)
+		rad_packet_free(reply);
+
+	if (r) {
+		mempool_free(r);
+		rad_sock_put(req->sock);
+	}
+}
+
+void rad_server_close_sockets(struct rad_server_t *serv)
+{
+	struct rad_sock_t *sock;
+	int i;
+
+	pthread_mutex_lock(&serv->sock_lock);
+	for (i = 0; i < 2; i++) {
+		while (!list_empty(&serv->sock_list[i])) {
+			sock = list_entry(serv->sock_list[i].next, typeof(*sock), entry);
+			list_del(&sock->entry);
+			triton_md_unregister_handler(&sock->hnd, 1);
+			rad_sock_put(sock);
+		}
+		serv->sock_cnt[i] = 0;
+	}
+	pthread_mutex_unlock(&serv->sock_lock);
+}
+
+static int use_shared_socket(struct rad_req_t *req)
+{
+	if (!conf_shared_sockets || !req->serv || req->server_addr != req->serv->addr)
+		return 0;
+
+	if (req->type == RAD_SERV_AUTH)
+		return req->server_port == req->serv->auth_port;
+
+	return req->server_port == req->serv->acct_port;
+}
+
+void rad_req_listen(struct rad_req_t *req, struct triton_context_t *ctx)
+{
+	if (req->sock) {
+		rad_sock_listen(req, ctx);
+		return;
+	}
+
+	if (!req->hnd.tpd)
+		triton_md_register_handler(ctx, &req->hnd);
+
+	triton_md_enable_handler(&req->hnd, MD_MODE_READ);
+}
+
+void rad_req_unlisten(struct rad_req_t *req)
+{
+	if (req->sock)
+		rad_sock_unlisten(req);
+	else if (req->hnd.tpd)
+		triton_md_unregister_handler(&req->hnd, 0);
+}
+
+void rad_req_close_socket(struct rad_req_t *req)
+{
+	if (req->sock)
+		rad_sock_detach(req);
+	else if (req->hnd.tpd)
+		triton_md_unregister_handler(&req->hnd, 1);
+	else if (req->hnd.fd != -1) {
+		close(req->hnd.fd);
+		req->hnd.fd = -1;
+	}
+}
+
 static int make_socket(struct rad_req_t *req)
 {
   struct sockaddr_in addr;
 
+	if (use_shared_socket(req) && !rad_sock_attach(req))
+		return 0;
+
 	req->hnd.fd = socket(PF_INET, SOCK_DGRAM, 0);
 	if (req->hnd.fd < 0) {
 		log_ppp_error("radius:socket: %s\n", strerror(errno));
@@ -315,7 +772,7 @@ int __rad_req_send(struct rad_req_t *req, int async)
 		return 0;
 	}
 
-	if (req->hnd.fd == -1 && make_socket(req))
+	if (!req->sock && req->hnd.fd == -1 && make_socket(req))
 		return -2;
 
 	if (req->before_send && req->before_send(req))
@@ -324,6 +781,9 @@ int __rad_req_send(struct rad_req_t *req, int async)
 	if (!req->pack->buf && rad_packet_build(req->pack, req->RA))
 		goto out_err;
 
+	if (req->sock && rad_sock_prepare(req))
+		goto out_err;
+
 	if (req->log) {
 		req->log("send ");
 		rad_packet_print(req->pack, req->serv, req->log);
@@ -332,17 +792,12 @@ int __rad_req_send(struct rad_req_t *req, int async)
 	if (req->sent)
 		req->sent(req, 0);
 
-	rad_packet_send(req->pack, req->hnd.fd, NULL);
+	rad_packet_send(req->pack, req->sock ? req->sock->hnd.fd : req->hnd.fd, NULL);
 
 	return 0;
 
 out_err:
-	if (req->hnd.tpd)
-		triton_md_unregister_handler(&req->hnd, 1);
-	else {
-		close(req->hnd.fd);
-		req->hnd.fd = -1;
-	}
+	rad_req_close_socket(req);
 
 	if (async && req->sent)
 		req->sent(req, -1);
@@ -410,6 +865,13 @@ int rad_req_read(struct triton_md_handler_t *h)
 		rad_packet_free(pack);
 	}
 
+	__rad_req_recv(req, pack);
+
+	return 1;
+}
+
+void __rad_req_recv(struct rad_req_t *req, struct rad_packet_t *pack)
+{
 	req->reply = pack;
 
 	if (req->active)
@@ -424,13 +886,12 @@ int rad_req_read(struct triton_md_handler_t *h)
 
 	if (req->recv)
 		req->recv(req);
-
-	return 1;
 }
 
 static void req_init(void)
 {
 	req_pool = mempool_create(sizeof(struct rad_req_t));
+	reply_pool = mempool_create(sizeof(struct rad_sock_reply_t));
 }
 
 DEFINE_INIT(50, req_init);
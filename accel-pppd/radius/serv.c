@@ -27,32 +27,52 @@ static int conf_acct_on;
 static int conf_fail_timeout;
 static int conf_max_fail;
 static int conf_req_limit;
+static int conf_interim_rate;
 
 static int num;
 static LIST_HEAD(serv_list);
 
+/* Candidates for each request type ordered by backup level, rebuilt on
+ * configuration change and read without locks by __rad_server_get().
+ * Replaced tables are kept for a while before freeing since a reader
+ * may still walk them. */
+#define SERV_SEL_GRACE 10
+
+struct serv_sel_t
+{
+	struct serv_sel_t *next;
+	time_t retire_time;
+	int cnt;
+	struct rad_server_t *serv[0];
+};
+
+static struct serv_sel_t *serv_sel[2];
+static struct serv_sel_t *serv_sel_retired;
+
 static void __free_server(struct rad_server_t *);
 static void serv_ctx_close(struct triton_context_t *);
 
 static struct rad_server_t *__rad_server_get(int type, struct rad_server_t *exclude, in_addr_t addr, int port)
 {
 	struct rad_server_t *s, *s0 = NULL, *s1 = NULL;
+	struct serv_sel_t *sel = serv_sel[type];
 	struct timespec ts;
+	int i;
+
+	if (!sel)
+		return NULL;
 
 	clock_gettime(CLOCK_MONOTONIC, &ts);
 
-	list_for_each_entry(s, &serv_list, entry) {
+	for (i = 0; i < sel->cnt; i++) {
+		s = sel->serv[i];
+
 		if (s == exclude)
 			continue;
 
 		if (s->fail_time && ts.tv_sec < s->fail_time)
 			continue;
 
-		if (type == RAD_SERV_AUTH && !s->auth_port)
-			continue;
-		else if (type == RAD_SERV_ACCT && !s->acct_port)
-			continue;
-
 		if (s->addr == addr) {
 			if (type == RAD_SERV_AUTH && port == s->auth_port)
 				s1 = s;
@@ -67,10 +87,14 @@ static struct rad_server_t *__rad_server_get(int type, struct rad_server_t *excl
 			continue;
 		}
 
-		if ((s->backup < s0->backup) ||
-			((s->backup == s0->backup) &&
-			((s->client_cnt[0] + s->client_cnt[1])*s0->weight < (s0->client_cnt[0] + s0->client_cnt[1])*s->weight)))
-		s0 = s;
+		if (s->backup != s0->backup) {
+			if (!addr)
+				break;
+			continue;
+		}
+
+		if ((s->client_cnt[0] + s->client_cnt[1])*s0->weight < (s0->client_cnt[0] + s0->client_cnt[1])*s->weight)
+			s0 = s;
 	}
 
 	if (s1)
@@ -83,6 +107,83 @@ static struct rad_server_t *__rad_server_get(int type, struct rad_server_t *excl
 	return s0;
 }
 
+static void serv_sel_update(void)
+{
+	struct serv_sel_t *sel, *old, **pprev;
+	struct rad_server_t *s;
+	struct timespec ts;
+	int type, backup, cnt, i;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	for (type = RAD_SERV_AUTH; type <= RAD_SERV_ACCT; type++) {
+		cnt = 0;
+		list_for_each_entry(s, &serv_list, entry)
+			cnt++;
+
+		sel = _malloc(sizeof(*sel) + cnt * sizeof(sel->serv[0]));
+		if (!sel) {
+			log_emerg("radius: out of memory\n");
+
+			/* Keep the current table, but it must not refer to servers
+			 * about to be freed. Readers walk it without locks, so their
+			 * entries are replaced by a neighbouring server in place. */
+			sel = serv_sel[type];
+			if (!sel)
+				continue;
+
+			for (i = 0; i < sel->cnt && sel->serv[i]->need_free; i++);
+
+			if (i == sel->cnt) {
+				sel->cnt = 0;
+				continue;
+			}
+
+			s = sel->serv[i];
+			for (i = 0; i < sel->cnt; i++) {
+				if (sel->serv[i]->need_free)
+					sel->serv[i] = s;
+				else
+					s = sel->serv[i];
+			}
+			continue;
+		}
+
+		sel->cnt = 0;
+		for (backup = 0; backup <= 1; backup++) {
+			list_for_each_entry(s, &serv_list, entry) {
+				if (s->need_free || s->backup != backup)
+					continue;
+				if (type == RAD_SERV_AUTH && !s->auth_port)
+					continue;
+				if (type == RAD_SERV_ACCT && !s->acct_port)
+					continue;
+				sel->serv[sel->cnt++] = s;
+			}
+		}
+
+		old = serv_sel[type];
+		__sync_synchronize();
+		serv_sel[type] = sel;
+
+		if (old) {
+			old->retire_time = ts.tv_sec;
+			old->next = serv_sel_retired;
+			serv_sel_retired = old;
+		}
+	}
+
+	pprev = &serv_sel_retired;
+	while (*pprev) {
+		old = *pprev;
+		if (ts.tv_sec - old->retire_time >= SERV_SEL_GRACE) {
+			*pprev = old->next;
+			_free(old);
+		} else
+			pprev = &old->next;
+	}
+}
+
 struct rad_server_t *rad_server_get(int type)
 {
 	return __rad_server_get(type, NULL, 0, 0);
@@ -105,6 +206,63 @@ void rad_server_put(struct rad_server_t *s, int type)
 	}
 }
 
+/* In-flight requests are accounted with atomic credits, serv->lock is
+ * only taken when request has to be queued or queue is not empty */
+static int req_credit_get(struct rad_server_t *serv)
+{
+	int n;
+
+	do {
+		n = serv->req_cnt;
+		if (n >= serv->req_limit)
+			return 0;
+	} while (!__sync_bool_compare_and_swap(&serv->req_cnt, n, n + 1));
+
+	return 1;
+}
+
+static void req_wakeup(struct rad_req_t *req);
+
+static void __req_dispatch(struct rad_server_t *serv)
+{
+	struct list_head *list;
+	struct rad_req_t *r;
+
+	while (serv->queue_cnt) {
+		if (!list_empty(&serv->req_queue[0]))
+			list = &serv->req_queue[0];
+		else if (!list_empty(&serv->req_queue[1]))
+			list = &serv->req_queue[1];
+		else
+			break;
+
+		if (!req_credit_get(serv))
+			break;
+
+		r = list_entry(list->next, typeof(*r), entry);
+		log_ppp_debug("radius(%i): wakeup %p\n", serv->id, r);
+		list_del(&r->entry);
+		__sync_sub_and_fetch(&serv->queue_cnt, 1);
+		serv->queue_len[r->prio]--;
+		r->active = 1;
+		triton_context_call(r->rpd ? r->rpd->ses->ctrl->ctx : NULL, (triton_event_func)req_wakeup, r);
+	}
+}
+
+static void req_credit_put(struct rad_server_t *serv)
+{
+	int n = __sync_sub_and_fetch(&serv->req_cnt, 1);
+
+	log_ppp_debug("radius(%i): req_exit %i\n", serv->id, n);
+	assert(n >= 0);
+
+	if (serv->queue_cnt) {
+		pthread_mutex_lock(&serv->lock);
+		__req_dispatch(serv);
+		pthread_mutex_unlock(&serv->lock);
+	}
+}
+
 static void req_wakeup(struct rad_req_t *req)
 {
 	struct timespec ts;
@@ -119,19 +277,15 @@ static void req_wakeup(struct rad_req_t *req)
 
 	clock_gettime(CLOCK_MONOTONIC, &ts);
 
-	pthread_mutex_lock(&req->serv->lock);
-
 	if (ts.tv_sec < req->serv->fail_time || req->serv->need_free) {
 		req->active = 0;
-		req->serv->req_cnt--;
 		log_ppp_debug("radius(%i): server failed\n", req->serv->id);
-		pthread_mutex_unlock(&req->serv->lock);
+		req_credit_put(req->serv);
 
 		req->send(req, -1);
 
 		return;
 	}
-	pthread_mutex_unlock(&req->serv->lock);
 
 	req->send(req, 1);
 }
@@ -151,7 +305,8 @@ int rad_server_req_cancel(struct rad_req_t *req, int full)
 	pthread_mutex_lock(&req->serv->lock);
 	if (req->entry.next) {
 		list_del(&req->entry);
-		req->serv->queue_cnt--;
+		__sync_sub_and_fetch(&req->serv->queue_cnt, 1);
+		req->serv->queue_len[req->prio]--;
 		r = 1;
 	}
 	pthread_mutex_unlock(&req->serv->lock);
@@ -167,26 +322,26 @@ int rad_server_req_cancel(struct rad_req_t *req, int full)
 	if (req->timeout.tpd)
 		triton_timer_del(&req->timeout);
 
-	if (req->hnd.tpd)
-		triton_md_unregister_handler(&req->hnd, 0);
+	rad_req_unlisten(req);
 
 	return r;
 }
 
 int rad_server_req_enter(struct rad_req_t *req)
 {
+	struct rad_server_t *serv = req->serv;
 	struct timespec ts;
 	int r = 0;
 
-	if (req->serv->need_free)
+	if (serv->need_free)
 		return -1;
 
 	clock_gettime(CLOCK_MONOTONIC, &ts);
 
-	if (ts.tv_sec < req->serv->fail_time)
+	if (ts.tv_sec < serv->fail_time)
 		return -1;
 
-	if (!req->serv->req_limit) {
+	if (!serv->req_limit) {
 		if (req->send)
 			return req->send(req, 0);
 		return 0;
@@ -195,33 +350,41 @@ int rad_server_req_enter(struct rad_req_t *req)
 	assert(!req->active);
 	assert(!req->entry.next);
 
-	pthread_mutex_lock(&req->serv->lock);
+	if (serv->queue_cnt || !req_credit_get(serv)) {
+		pthread_mutex_lock(&serv->lock);
 
-	if (ts.tv_sec < req->serv->fail_time) {
-		pthread_mutex_unlock(&req->serv->lock);
-		return -1;
-	}
+		if (ts.tv_sec < serv->fail_time) {
+			pthread_mutex_unlock(&serv->lock);
+			return -1;
+		}
+
+		if (serv->queue_cnt || !req_credit_get(serv)) {
+			if (!req->send) {
+				pthread_mutex_unlock(&serv->lock);
+				return 1;
+			}
+
+			list_add_tail(&req->entry, &serv->req_queue[req->prio]);
+			__sync_add_and_fetch(&serv->queue_cnt, 1);
+			if (++serv->queue_len[req->prio] > serv->queue_max[req->prio])
+				serv->queue_max[req->prio] = serv->queue_len[req->prio];
+			serv->stat_queued[req->prio]++;
+			log_ppp_debug("radius(%i): queue %p\n", serv->id, req);
+
+			/* credit may have been returned while we were queueing */
+			__req_dispatch(serv);
 
-	if (req->serv->req_cnt >= req->serv->req_limit) {
-		if (req->send) {
-			list_add_tail(&req->entry, &req->serv->req_queue[req->prio]);
-			req->serv->queue_cnt++;
-			log_ppp_debug("radius(%i): queue %p\n", req->serv->id, req);
-			pthread_mutex_unlock(&req->serv->lock);
+			pthread_mutex_unlock(&serv->lock);
 
-			if (req->hnd.tpd)
-				triton_md_disable_handler(&req->hnd, MD_MODE_READ);
+			rad_req_unlisten(req);
 
 			return 0;
 		}
 
-		pthread_mutex_unlock(&req->serv->lock);
-		return 1;
+		pthread_mutex_unlock(&serv->lock);
 	}
 
-	req->serv->req_cnt++;
-	log_ppp_debug("radius(%i): req_enter %i\n", req->serv->id, req->serv->req_cnt);
-	pthread_mutex_unlock(&req->serv->lock);
+	log_ppp_debug("radius(%i): req_enter %i\n", serv->id, serv->req_cnt);
 
 	req->active = 1;
 
@@ -230,11 +393,9 @@ int rad_server_req_enter(struct rad_req_t *req)
 		if (r) {
 			if (r == -2) {
 				req->active = 0;
-				pthread_mutex_lock(&req->serv->lock);
-				req->serv->req_cnt--;
-				pthread_mutex_unlock(&req->serv->lock);
+				req_credit_put(serv);
 
-				rad_server_fail(req->serv);
+				rad_server_fail(serv);
 			} else
 				rad_server_req_exit(req);
 		}
@@ -245,8 +406,6 @@ int rad_server_req_enter(struct rad_req_t *req)
 
 void rad_server_req_exit(struct rad_req_t *req)
 {
-	struct rad_server_t *serv = req->serv;
-
 	if (!req->serv->req_limit)
 		return;
 
@@ -254,28 +413,7 @@ void rad_server_req_exit(struct rad_req_t *req)
 
 	req->active = 0;
 
-	pthread_mutex_lock(&serv->lock);
-	serv->req_cnt--;
-	log_ppp_debug("radius(%i): req_exit %i\n", serv->id, serv->req_cnt);
-	assert(serv->req_cnt >= 0);
-	if (serv->req_cnt < serv->req_limit) {
-		struct list_head *list = NULL;
-		if (!list_empty(&serv->req_queue[0]))
-			list = &serv->req_queue[0];
-		else if (!list_empty(&serv->req_queue[1]))
-			list = &serv->req_queue[1];
-
-		if (list) {
-			struct rad_req_t *r = list_entry(list->next, typeof(*r), entry);
-			log_ppp_debug("radius(%i): wakeup %p\n", serv->id, r);
-			list_del(&r->entry);
-			serv->queue_cnt--;
-			serv->req_cnt++;
-			r->active = 1;
-			triton_context_call(r->rpd ? r->rpd->ses->ctrl->ctx : NULL, (triton_event_func)req_wakeup, r);
-		}
-	}
-	pthread_mutex_unlock(&serv->lock);
+	req_credit_put(req->serv);
 }
 
 int rad_server_realloc(struct rad_req_t *req)
@@ -290,14 +428,7 @@ int rad_server_realloc(struct rad_req_t *req)
 
 	req->serv = s;
 
-	if (req->hnd.fd != -1) {
-		if (req->hnd.tpd)
-			triton_md_unregister_handler(&req->hnd, 1);
-		else {
-			close(req->hnd.fd);
-			req->hnd.fd = -1;
-		}
-	}
+	rad_req_close_socket(req);
 
 	req->server_addr = req->serv->addr;
 	if (req->type == RAD_SERV_ACCT)
@@ -308,6 +439,124 @@ int rad_server_realloc(struct rad_req_t *req)
 	return 0;
 }
 
+#define INTERIM_TICK 100
+
+static void interim_flush(struct rad_server_t *s)
+{
+	struct radius_pd_t *rpd;
+
+	while (!list_empty(&s->interim_queue)) {
+		rpd = list_entry(s->interim_queue.next, typeof(*rpd), interim_entry);
+		list_del(&rpd->interim_entry);
+		triton_context_call(rpd->ses->ctrl->ctx, (triton_event_func)rad_acct_interim_wakeup, rpd);
+	}
+
+	s->interim_queue_cnt = 0;
+}
+
+static void interim_refill(struct rad_server_t *s)
+{
+	struct timespec ts;
+	uint64_t now;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+	/* credit is kept in 1/1000 of request, one request costs 1000 */
+	s->interim_credit += (now - s->interim_ts) * s->interim_rate;
+	if (s->interim_credit > s->interim_rate * 1000L)
+		s->interim_credit = s->interim_rate * 1000L;
+	s->interim_ts = now;
+}
+
+static void interim_timer_expire(struct triton_timer_t *t)
+{
+	struct rad_server_t *s = container_of(t, typeof(*s), interim_timer);
+	struct radius_pd_t *rpd;
+
+	pthread_mutex_lock(&s->lock);
+
+	if (s->interim_rate) {
+		interim_refill(s);
+
+		while (!list_empty(&s->interim_queue) && s->interim_credit >= 1000) {
+			rpd = list_entry(s->interim_queue.next, typeof(*rpd), interim_entry);
+			list_del(&rpd->interim_entry);
+			s->interim_queue_cnt--;
+			s->interim_credit -= 1000;
+			triton_context_call(rpd->ses->ctrl->ctx, (triton_event_func)rad_acct_interim_wakeup, rpd);
+		}
+	} else
+		interim_flush(s);
+
+	if (list_empty(&s->interim_queue))
+		triton_timer_del(t);
+
+	pthread_mutex_unlock(&s->lock);
+}
+
+static void interim_timer_start(struct rad_server_t *s)
+{
+	if (s->interim_timer.tpd)
+		return;
+
+	s->interim_timer.expire = interim_timer_expire;
+	s->interim_timer.period = INTERIM_TICK;
+	triton_timer_add(&s->ctx, &s->interim_timer, 0);
+}
+
+int rad_server_interim_enter(struct radius_pd_t *rpd)
+{
+	struct rad_server_t *s = rpd->acct_req->serv;
+	int r = 1;
+
+	if (!s || !s->interim_rate)
+		return 0;
+
+	pthread_mutex_lock(&s->lock);
+
+	if (rpd->interim_entry.next)
+		goto out;
+
+	interim_refill(s);
+
+	if (list_empty(&s->interim_queue) && s->interim_credit >= 1000) {
+		s->interim_credit -= 1000;
+		r = 0;
+		goto out;
+	}
+
+	list_add_tail(&rpd->interim_entry, &s->interim_queue);
+	rpd->interim_serv = s;
+	s->stat_interim_delayed++;
+	if (s->interim_queue_cnt++ == 0)
+		triton_context_call(&s->ctx, (triton_event_func)interim_timer_start, s);
+
+out:
+	pthread_mutex_unlock(&s->lock);
+
+	return r;
+}
+
+void rad_server_interim_cancel(struct radius_pd_t *rpd)
+{
+	struct rad_server_t *s = rpd->interim_serv;
+
+	if (!s)
+		return;
+
+	pthread_mutex_lock(&s->lock);
+	if (rpd->interim_entry.next) {
+		list_del(&rpd->interim_entry);
+		s->interim_queue_cnt--;
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	triton_cancel_call(rpd->ses->ctrl->ctx, (triton_event_func)rad_acct_interim_wakeup);
+
+	rpd->interim_serv = NULL;
+}
+
 void rad_server_fail(struct rad_server_t *s)
 {
 	struct rad_req_t *r;
@@ -336,8 +585,12 @@ void rad_server_fail(struct rad_server_t *s)
 	}
 
 	s->queue_cnt = 0;
+	s->queue_len[0] = 0;
+	s->queue_len[1] = 0;
 	s->stat_fail_cnt++;
 
+	interim_flush(s);
+
 	pthread_mutex_unlock(&s->lock);
 }
 
@@ -373,10 +626,8 @@ static int req_set_RA(struct rad_req_t *req, const char *secret)
 
 static void acct_on_sent(struct rad_req_t *req, int res)
 {
-	if (!res && !req->hnd.tpd) {
-		triton_md_register_handler(&req->serv->ctx, &req->hnd);
-		triton_md_enable_handler(&req->hnd, MD_MODE_READ);
-	}
+	if (!res)
+		rad_req_listen(req, &req->serv->ctx);
 }
 
 static void acct_on_recv(struct rad_req_t *req)
@@ -437,15 +688,15 @@ static void send_acct_on(struct rad_server_t *s)
 	if (!req->pack)
 		goto out_err;
 
-	if (rad_packet_add_val(req->pack, NULL, "Acct-Status-Type", s->starting ? "Accounting-On" : "Accounting-Off"))
+	if (rad_packet_add_attr_val(req->pack, rad_attr.acct_status_type, s->starting ? rad_attr.acct_status_on : rad_attr.acct_status_off))
 		goto out_err;
 
 	if (conf_nas_identifier)
-		if (rad_packet_add_str(req->pack, NULL, "NAS-Identifier", conf_nas_identifier))
+		if (rad_packet_add_attr_str(req->pack, rad_attr.nas_identifier, conf_nas_identifier))
 			goto out_err;
 
 	if (conf_nas_ip_address)
-		if (rad_packet_add_ipaddr(req->pack, NULL, "NAS-IP-Address", conf_nas_ip_address))
+		if (rad_packet_add_attr_ipaddr(req->pack, rad_attr.nas_ip_address, conf_nas_ip_address))
 			goto out_err;
 
 	if (req_set_RA(req, s->secret))
@@ -468,6 +719,9 @@ static void serv_ctx_close(struct triton_context_t *ctx)
 	if (s->timer.tpd)
 		triton_timer_del(&s->timer);
 
+	if (s->interim_timer.tpd)
+		triton_timer_del(&s->interim_timer);
+
 	s->need_close = 1;
 
 	if (!s->client_cnt[0] && !s->client_cnt[1]) {
@@ -476,11 +730,21 @@ static void serv_ctx_close(struct triton_context_t *ctx)
 			s->starting = 0;
 			s->need_close = 0;
 			send_acct_on(s);
-		} else
+		} else {
+			rad_server_close_sockets(s);
 			triton_context_unregister(ctx);
+		}
 	}
 }
 
+static void show_pct(void *client, const char *name, struct stat_accm_t *s5m, struct stat_accm_t *s1m)
+{
+	cli_sendv(client, "  %s query time p50/p95/p99(5m): %lu/%lu/%lu ms\r\n", name,
+		stat_accm_get_pct(s5m, 50), stat_accm_get_pct(s5m, 95), stat_accm_get_pct(s5m, 99));
+	cli_sendv(client, "  %s query time p50/p95/p99(1m): %lu/%lu/%lu ms\r\n", name,
+		stat_accm_get_pct(s1m, 50), stat_accm_get_pct(s1m, 95), stat_accm_get_pct(s1m, 99));
+}
+
 static void show_stat(struct rad_server_t *s, void *client)
 {
 	char addr[17];
@@ -500,6 +764,11 @@ static void show_stat(struct rad_server_t *s, void *client)
 
 	cli_sendv(client, "  request count: %i\r\n", s->req_cnt);
 	cli_sendv(client, "  queue length: %i\r\n", s->queue_cnt);
+	cli_sendv(client, "  queue length(prio 0/1): %i/%i\r\n", s->queue_len[0], s->queue_len[1]);
+	cli_sendv(client, "  queue peak(prio 0/1): %i/%i\r\n", s->queue_max[0], s->queue_max[1]);
+	cli_sendv(client, "  queued total(prio 0/1): %lu/%lu\r\n", s->stat_queued[0], s->stat_queued[1]);
+	if (conf_shared_sockets)
+		cli_sendv(client, "  shared sockets(auth/acct): %i/%i\r\n", s->sock_cnt[0], s->sock_cnt[1]);
 
 	if (s->auth_port) {
 		cli_sendv(client, "  auth sent: %lu\r\n", s->stat_auth_sent);
@@ -507,6 +776,7 @@ static void show_stat(struct rad_server_t *s, void *client)
 			s->stat_auth_lost, stat_accm_get_cnt(s->stat_auth_lost_5m), stat_accm_get_cnt(s->stat_auth_lost_1m));
 		cli_sendv(client, "  auth avg query time(5m/1m): %lu/%lu ms\r\n",
 			stat_accm_get_avg(s->stat_auth_query_5m), stat_accm_get_avg(s->stat_auth_query_1m));
+		show_pct(client, "auth", s->stat_auth_query_5m, s->stat_auth_query_1m);
 	}
 
 	if (s->acct_port) {
@@ -515,12 +785,20 @@ static void show_stat(struct rad_server_t *s, void *client)
 			s->stat_acct_lost, stat_accm_get_cnt(s->stat_acct_lost_5m), stat_accm_get_cnt(s->stat_acct_lost_1m));
 		cli_sendv(client, "  acct avg query time(5m/1m): %lu/%lu ms\r\n",
 			stat_accm_get_avg(s->stat_acct_query_5m), stat_accm_get_avg(s->stat_acct_query_1m));
+		show_pct(client, "acct", s->stat_acct_query_5m, s->stat_acct_query_1m);
 
 		cli_sendv(client, "  interim sent: %lu\r\n", s->stat_interim_sent);
 		cli_sendv(client, "  interim lost(total/5m/1m): %lu/%lu/%lu\r\n",
 			s->stat_interim_lost, stat_accm_get_cnt(s->stat_interim_lost_5m), stat_accm_get_cnt(s->stat_interim_lost_1m));
 		cli_sendv(client, "  interim avg query time(5m/1m): %lu/%lu ms\r\n",
 			stat_accm_get_avg(s->stat_interim_query_5m), stat_accm_get_avg(s->stat_interim_query_1m));
+		show_pct(client, "interim", s->stat_interim_query_5m, s->stat_interim_query_1m);
+
+		if (s->interim_rate) {
+			cli_sendv(client, "  interim rate limit: %i/s\r\n", s->interim_rate);
+			cli_sendv(client, "  interim backlog: %i\r\n", s->interim_queue_cnt);
+			cli_sendv(client, "  interim delayed: %lu\r\n", s->stat_interim_delayed);
+		}
 	}
 }
 
@@ -542,6 +820,7 @@ static void __add_server(struct rad_server_t *s)
 		if (s1->addr == s->addr && s1->auth_port == s->auth_port && s1->acct_port == s->acct_port) {
 			s1->fail_timeout = s->fail_timeout;
 			s1->req_limit = s->req_limit;
+			s1->interim_rate = s->interim_rate;
 			s1->max_fail = s->max_fail;
 			s1->need_free = 0;
 			_free(s);
@@ -552,24 +831,28 @@ static void __add_server(struct rad_server_t *s)
 	s->id = ++num;
 	INIT_LIST_HEAD(&s->req_queue[0]);
 	INIT_LIST_HEAD(&s->req_queue[1]);
+	INIT_LIST_HEAD(&s->interim_queue);
+	INIT_LIST_HEAD(&s->sock_list[0]);
+	INIT_LIST_HEAD(&s->sock_list[1]);
 	pthread_mutex_init(&s->lock, NULL);
+	pthread_mutex_init(&s->sock_lock, NULL);
 	list_add_tail(&s->entry, &serv_list);
 	s->starting = conf_acct_on;
 
-	s->stat_auth_lost_1m = stat_accm_create(60);
-	s->stat_auth_lost_5m = stat_accm_create(5 * 60);
-	s->stat_auth_query_1m = stat_accm_create(60);
-	s->stat_auth_query_5m = stat_accm_create(5 * 60);
+	s->stat_auth_lost_1m = stat_accm_create(60, 0);
+	s->stat_auth_lost_5m = stat_accm_create(5 * 60, 0);
+	s->stat_auth_query_1m = stat_accm_create(60, 1);
+	s->stat_auth_query_5m = stat_accm_create(5 * 60, 1);
 
-	s->stat_acct_lost_1m = stat_accm_create(60);
-	s->stat_acct_lost_5m = stat_accm_create(5 * 60);
-	s->stat_acct_query_1m = stat_accm_create(60);
-	s->stat_acct_query_5m = stat_accm_create(5 * 60);
+	s->stat_acct_lost_1m = stat_accm_create(60, 0);
+	s->stat_acct_lost_5m = stat_accm_create(5 * 60, 0);
+	s->stat_acct_query_1m = stat_accm_create(60, 1);
+	s->stat_acct_query_5m = stat_accm_create(5 * 60, 1);
 
-	s->stat_interim_lost_1m = stat_accm_create(60);
-	s->stat_interim_lost_5m = stat_accm_create(5 * 60);
-	s->stat_interim_query_1m = stat_accm_create(60);
-	s->stat_interim_query_5m = stat_accm_create(5 * 60);
+	s->stat_interim_lost_1m = stat_accm_create(60, 0);
+	s->stat_interim_lost_5m = stat_accm_create(5 * 60, 0);
+	s->stat_interim_query_1m = stat_accm_create(60, 1);
+	s->stat_interim_query_5m = stat_accm_create(5 * 60, 1);
 
 	s->ctx.close = serv_ctx_close;
 
@@ -599,6 +882,9 @@ static void __free_server(struct rad_server_t *s)
 	stat_accm_free(s->stat_interim_query_1m);
 	stat_accm_free(s->stat_interim_query_5m);
 
+	rad_server_close_sockets(s);
+	if (s->interim_timer.tpd)
+		triton_timer_del(&s->interim_timer);
 	triton_context_unregister(&s->ctx);
 
 	_free(s);
@@ -670,6 +956,7 @@ static void add_server_old(void)
 	s->auth_port = auth_port;
 	s->fail_timeout = conf_fail_timeout;
 	s->req_limit = conf_req_limit;
+	s->interim_rate = conf_interim_rate;
 	s->max_fail = conf_max_fail;
 
 	if (auth_addr == acct_addr && !strcmp(auth_secret, acct_secret)) {
@@ -688,6 +975,7 @@ static void add_server_old(void)
 		s->acct_port = acct_port;
 		s->fail_timeout = conf_fail_timeout;
 		s->req_limit = conf_req_limit;
+		s->interim_rate = conf_interim_rate;
 		s->max_fail = conf_max_fail;
 		__add_server(s);
 	}
@@ -738,6 +1026,7 @@ static int parse_server1(const char *_opt, struct rad_server_t *s)
 	s->secret = _strdup(ptr1 + 1);
 	s->fail_timeout = conf_fail_timeout;
 	s->req_limit = conf_req_limit;
+	s->interim_rate = conf_interim_rate;
 	s->max_fail = conf_max_fail;
 
 	return 0;
@@ -787,6 +1076,14 @@ static int parse_server2(const char *_opt, struct rad_server_t *s)
 	} else
 		s->req_limit = conf_req_limit;
 
+	ptr3 = strstr(ptr2, ",interim-rate=");
+	if (ptr3) {
+		s->interim_rate = strtol(ptr3 + 14, &endptr, 10);
+		if (*endptr != ',' && *endptr != 0)
+			goto out;
+	} else
+		s->interim_rate = conf_interim_rate;
+
 	ptr3 = strstr(ptr2, ",fail-timeout=");
 	if (ptr3) {
 		s->fail_timeout = strtol(ptr3 + 14, &endptr, 10);
@@ -893,6 +1190,12 @@ static void load_config(void)
 	else
 		conf_req_limit = 0;
 
+	opt1 = conf_get_opt("radius", "interim-rate");
+	if (opt1 && atoi(opt1) >= 0)
+		conf_interim_rate = atoi(opt1);
+	else
+		conf_interim_rate = 0;
+
 	opt1 = conf_get_opt("radius", "max-fail");
 	if (opt1)
 		conf_max_fail = atoi(opt1);
@@ -905,6 +1208,8 @@ static void load_config(void)
 		add_server(opt->val);
 	}
 
+	serv_sel_update();
+
 	list_for_each_safe(pos, n, &serv_list) {
 		s = list_entry(pos, typeof(*s), entry);
 		if (s->need_free) {
@@ -922,6 +1227,10 @@ static void load_config(void)
 				triton_context_call(r->rpd->ses->ctrl->ctx, (triton_event_func)req_wakeup, r);
 			}
 
+			pthread_mutex_lock(&s->lock);
+			interim_flush(s);
+			pthread_mutex_unlock(&s->lock);
+
 			if (!s->client_cnt[0] && !s->client_cnt[1]) {
 				if (s->acct_on)
 					triton_context_call(&s->ctx, (triton_event_func)serv_ctx_close, &s->ctx);
@@ -933,6 +1242,8 @@ static void load_config(void)
 
 	add_server_old();
 
+	serv_sel_update();
+
 	conf_accounting = 0;
 	list_for_each_entry(s, &serv_list, entry) {
 		if (s->acct_port) {
@@ -1,116 +1,206 @@
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
 
 #include "radius_p.h"
-#include "mempool.h"
+#include "spinlock.h"
 #include "memdebug.h"
 
-struct item_t
+/* Values are histogrammed with 4 sub-buckets per power of two, that is
+ * exact below 8 and within 12.5% above, values beyond 2^17 are clamped */
+#define HIST_LIN 8
+#define HIST_SUB 4
+#define HIST_MAX_LOG 17
+#define HIST_SIZE (HIST_LIN + (HIST_MAX_LOG - 2) * HIST_SUB)
+
+struct slot_t
 {
-	struct list_head entry;
-	unsigned int val;
-	time_t ts;
+	unsigned int sec;
+	unsigned int cnt;
+	unsigned long total;
+	unsigned int *hist;
 };
 
+/* Ring of per-second slots covering the last 'time' seconds.
+ * Samples are accumulated with atomic adds into the slot of the current
+ * second, the lock is only taken to recycle a slot once per second. */
 struct stat_accm_t
 {
-	pthread_mutex_t lock;
-	struct list_head items;
-	unsigned int items_cnt;
+	spinlock_t lock;
 	unsigned int time;
-	unsigned long total;
+	unsigned int size;
+	struct slot_t *slots;
+	unsigned int *hist;
 };
 
-static mempool_t item_pool;
+static unsigned int now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
 
-struct stat_accm_t *stat_accm_create(unsigned int time)
+	/* slot with sec == 0 is treated as never used */
+	return ts.tv_sec + 1;
+}
+
+static int hist_idx(unsigned int val)
+{
+	int l;
+
+	if (val < HIST_LIN)
+		return val;
+
+	l = 31 - __builtin_clz(val);
+	if (l > HIST_MAX_LOG)
+		return HIST_SIZE - 1;
+
+	return HIST_LIN + (l - 3) * HIST_SUB + ((val >> (l - 2)) & (HIST_SUB - 1));
+}
+
+/* upper bound of values counted in bucket */
+static unsigned long hist_val(int idx)
+{
+	int l;
+
+	if (idx < HIST_LIN)
+		return idx;
+
+	idx -= HIST_LIN;
+	l = idx / HIST_SUB + 3;
+
+	return ((unsigned long)(HIST_SUB + idx % HIST_SUB + 1) << (l - 2)) - 1;
+}
+
+struct stat_accm_t *stat_accm_create(unsigned int time, int hist)
 {
 	struct stat_accm_t *s = _malloc(sizeof(*s));
+	unsigned int i;
 
 	memset(s, 0, sizeof(*s));
-	pthread_mutex_init(&s->lock, NULL);
-	INIT_LIST_HEAD(&s->items);
+	spinlock_init(&s->lock);
 	s->time = time;
+	s->size = time + 1;
+
+	s->slots = _malloc(s->size * sizeof(*s->slots));
+	memset(s->slots, 0, s->size * sizeof(*s->slots));
+
+	if (hist) {
+		s->hist = _malloc(s->size * HIST_SIZE * sizeof(*s->hist));
+		memset(s->hist, 0, s->size * HIST_SIZE * sizeof(*s->hist));
+		for (i = 0; i < s->size; i++)
+			s->slots[i].hist = s->hist + i * HIST_SIZE;
+	}
 
 	return s;
 }
 
 void stat_accm_free(struct stat_accm_t *s)
 {
-	struct item_t *it;
-
-	while (!list_empty(&s->items)) {
-		it = list_entry(s->items.next, typeof(*it), entry);
-		list_del(&it->entry);
-		mempool_free(it);
-	}
-
+	if (s->hist)
+		_free(s->hist);
+	_free(s->slots);
 	_free(s);
 }
 
-static void stat_accm_clean(struct stat_accm_t *s)
+static struct slot_t *get_slot(struct stat_accm_t *s, unsigned int sec)
 {
-	struct item_t *it;
-	struct timespec ts;
-
-	clock_gettime(CLOCK_MONOTONIC, &ts);
-
-	while (!list_empty(&s->items)) {
-		it = list_entry(s->items.next, typeof(*it), entry);
-		if (ts.tv_sec - it->ts > s->time) {
-			list_del(&it->entry);
-			--s->items_cnt;
-			s->total -= it->val;
-			mempool_free(it);
-		} else
-			break;
+	struct slot_t *slot = &s->slots[sec % s->size];
+
+	if (slot->sec == sec)
+		return slot;
+
+	spin_lock(&s->lock);
+	if (slot->sec != sec) {
+		slot->cnt = 0;
+		slot->total = 0;
+		if (slot->hist)
+			memset(slot->hist, 0, HIST_SIZE * sizeof(*slot->hist));
+		__sync_synchronize();
+		slot->sec = sec;
 	}
+	spin_unlock(&s->lock);
+
+	return slot;
 }
 
 void stat_accm_add(struct stat_accm_t *s, unsigned int val)
 {
-	struct item_t *it;
-	struct timespec ts;
-
-	clock_gettime(CLOCK_MONOTONIC, &ts);
-
-	pthread_mutex_lock(&s->lock);
+	struct slot_t *slot = get_slot(s, now_sec());
 
-	stat_accm_clean(s);
+	__sync_add_and_fetch(&slot->cnt, 1);
+	__sync_add_and_fetch(&slot->total, val);
+	if (slot->hist)
+		__sync_add_and_fetch(&slot->hist[hist_idx(val)], 1);
+}
 
-	it = mempool_alloc(item_pool);
-	it->ts = ts.tv_sec;
-	it->val = val;
-	list_add_tail(&it->entry, &s->items);
-	++s->items_cnt;
-	s->total += val;
+static int slot_valid(struct stat_accm_t *s, struct slot_t *slot, unsigned int sec)
+{
+	unsigned int ssec = slot->sec;
 
-	pthread_mutex_unlock(&s->lock);
+	return ssec && ssec <= sec && sec - ssec <= s->time;
 }
 
 unsigned long stat_accm_get_cnt(struct stat_accm_t *s)
 {
-	pthread_mutex_lock(&s->lock);
-	stat_accm_clean(s);
-	pthread_mutex_unlock(&s->lock);
+	unsigned int sec = now_sec(), i;
+	unsigned long cnt = 0;
+
+	for (i = 0; i < s->size; i++) {
+		if (slot_valid(s, &s->slots[i], sec))
+			cnt += s->slots[i].cnt;
+	}
 
-	return s->items_cnt;
+	return cnt;
 }
 
 unsigned long stat_accm_get_avg(struct stat_accm_t *s)
 {
-	unsigned long val;
-	pthread_mutex_lock(&s->lock);
-	stat_accm_clean(s);
-	val = s->items_cnt ? s->total/s->items_cnt : 0;
-	pthread_mutex_unlock(&s->lock);
+	unsigned int sec = now_sec(), i;
+	unsigned long cnt = 0, total = 0;
+
+	for (i = 0; i < s->size; i++) {
+		if (slot_valid(s, &s->slots[i], sec)) {
+			cnt += s->slots[i].cnt;
+			total += s->slots[i].total;
+		}
+	}
 
-	return val;
+	return cnt ? total/cnt : 0;
 }
 
-static void init(void)
+/* Returns the value below which 'pct' percent of samples fall,
+ * rounded up to the histogram bucket bound */
+unsigned long stat_accm_get_pct(struct stat_accm_t *s, unsigned int pct)
 {
-	item_pool = mempool_create(sizeof(struct item_t));
-}
+	unsigned int sec = now_sec(), i;
+	unsigned long hist[HIST_SIZE];
+	unsigned long cnt = 0, n = 0, thr;
+	int j;
+
+	if (!s->hist)
+		return 0;
+
+	memset(hist, 0, sizeof(hist));
+
+	for (i = 0; i < s->size; i++) {
+		if (!slot_valid(s, &s->slots[i], sec))
+			continue;
+		for (j = 0; j < HIST_SIZE; j++) {
+			hist[j] += s->slots[i].hist[j];
+			cnt += s->slots[i].hist[j];
+		}
+	}
 
-DEFINE_INIT(50, init);
+	if (!cnt)
+		return 0;
+
+	thr = (cnt * pct + 99) / 100;
+
+	for (j = 0; j < HIST_SIZE - 1; j++) {
+		n += hist[j];
+		if (n >= thr)
+			break;
+	}
+
+	return hist_val(j);
+}
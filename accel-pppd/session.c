@@ -7,6 +7,7 @@
 #include <signal.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <ctype.h>
 #include <pthread.h>
 #include <arpa/inet.h>
 #include <features.h>
@@ -37,6 +38,7 @@ static int conf_seq_save_timeout = 10;
 static const char *conf_seq_file;
 int __export conf_max_sessions;
 int __export conf_max_starting;
+static int conf_stats_cache_interval;
 
 pthread_rwlock_t __export ses_lock = PTHREAD_RWLOCK_INITIALIZER;
 __export LIST_HEAD(ses_list);
@@ -49,6 +51,46 @@ int __export ap_shutdown;
 #if __WORDSIZE == 32
 static spinlock_t seq_lock;
 #endif
+
+/* Sessions with username indexed for single-session checks. Names are
+ * hashed case-folded so the index serves both single-session-ignore-case
+ * modes, a bucket is protected by one of the striped locks. */
+#define USER_HASH_BITS 13
+#define USER_HASH_SIZE (1 << USER_HASH_BITS)
+#define USER_LOCK_CNT 64
+
+static struct list_head user_hash[USER_HASH_SIZE];
+static pthread_mutex_t user_lock[USER_LOCK_CNT];
+
+struct stats_cache_item {
+	int ifindex;
+	struct rtnl_link_stats stats;
+};
+
+struct stats_cache {
+	struct list_head entry;
+	struct ap_net *net;
+	pthread_mutex_t lock;
+	uint64_t ts;
+	uint64_t refresh_ts;
+	int refreshing;
+	int cnt;
+	int size;
+	struct stats_cache_item *items;
+};
+
+static LIST_HEAD(stats_cache_list);
+static spinlock_t stats_cache_lock;
+
+static uint64_t stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 static long long unsigned seq;
 static struct timespec seq_ts;
 
@@ -58,6 +100,7 @@ static void (*shutdown_cb)(void);
 
 static void generate_sessionid(struct ap_session *ses);
 static void save_seq(void);
+static int read_stats(struct ap_session *ses, struct rtnl_link_stats *stats, int cached);
 
 void __export ap_session_init(struct ap_session *ses)
 {
@@ -83,9 +126,53 @@ void __export ap_session_set_ifindex(struct ap_session *ses)
 		ses->acct_tx_bytes = 0;
 		ses->acct_input_gigawords = 0;
 		ses->acct_output_gigawords = 0;
+		ses->stats_ts = stats_now();
 	}
 }
 
+static unsigned int user_hash_fn(const char *username)
+{
+	unsigned int h = 2166136261u;
+
+	for (; *username; username++)
+		h = (h ^ (uint8_t)tolower(*username)) * 16777619u;
+
+	return h & (USER_HASH_SIZE - 1);
+}
+
+static pthread_mutex_t *user_hash_lock(unsigned int h)
+{
+	return &user_lock[h & (USER_LOCK_CNT - 1)];
+}
+
+static int username_cmp(const char *u1, const char *u2)
+{
+	return conf_single_session_ignore_case == 1 ? strcasecmp(u1, u2) : strcmp(u1, u2);
+}
+
+static void user_index_add(struct ap_session *ses)
+{
+	unsigned int h = user_hash_fn(ses->username);
+
+	pthread_mutex_lock(user_hash_lock(h));
+	list_add_tail(&ses->user_entry, &user_hash[h]);
+	pthread_mutex_unlock(user_hash_lock(h));
+}
+
+static void user_index_del(struct ap_session *ses)
+{
+	unsigned int h;
+
+	if (!ses->user_entry.next)
+		return;
+
+	h = user_hash_fn(ses->username);
+
+	pthread_mutex_lock(user_hash_lock(h));
+	list_del(&ses->user_entry);
+	pthread_mutex_unlock(user_hash_lock(h));
+}
+
 int __export ap_session_starting(struct ap_session *ses)
 {
 	if (ap_shutdown)
@@ -111,6 +198,9 @@ int __export ap_session_starting(struct ap_session *ses)
 	list_add_tail(&ses->entry, &ses_list);
 	pthread_rwlock_unlock(&ses_lock);
 
+	if (ses->username)
+		user_index_add(ses);
+
 	triton_event_fire(EV_SES_STARTING, ses);
 
 	return 0;
@@ -175,13 +265,15 @@ void __export ap_session_finished(struct ap_session *ses)
 
 	if (!ses->down) {
 		ap_session_ifdown(ses);
-		ap_session_read_stats(ses, NULL);
+		read_stats(ses, NULL, 0);
 
 		triton_event_fire(EV_SES_FINISHING, ses);
 	}
 
 	triton_event_fire(EV_SES_PRE_FINISHED, ses);
 
+	user_index_del(ses);
+
 	pthread_rwlock_wrlock(&ses_lock);
 	list_del(&ses->entry);
 	pthread_rwlock_unlock(&ses_lock);
@@ -294,7 +386,7 @@ void __export ap_session_terminate(struct ap_session *ses, int cause, int hard)
 
 	if (ses->ctrl->terminate(ses, hard)) {
 		ap_session_ifdown(ses);
-		ap_session_read_stats(ses, NULL);
+		read_stats(ses, NULL, 0);
 
 		triton_event_fire(EV_SES_FINISHING, ses);
 
@@ -368,7 +460,184 @@ static void generate_sessionid(struct ap_session *ses)
 	}
 }
 
-int __export ap_session_read_stats(struct ap_session *ses, struct rtnl_link_stats *stats)
+static int stats_item_cmp(const void *a, const void *b)
+{
+	const struct stats_cache_item *i1 = a;
+	const struct stats_cache_item *i2 = b;
+
+	return i1->ifindex - i2->ifindex;
+}
+
+static struct stats_cache *__stats_cache_find(struct ap_net *n)
+{
+	struct stats_cache *c;
+
+	list_for_each_entry(c, &stats_cache_list, entry) {
+		if (c->net == n)
+			return c;
+	}
+
+	return NULL;
+}
+
+static struct stats_cache *stats_cache_find(struct ap_net *n)
+{
+	struct stats_cache *c, *nc;
+
+	spin_lock(&stats_cache_lock);
+	c = __stats_cache_find(n);
+	spin_unlock(&stats_cache_lock);
+
+	if (c)
+		return c;
+
+	nc = _malloc(sizeof(*nc));
+	if (!nc)
+		return NULL;
+
+	memset(nc, 0, sizeof(*nc));
+	nc->net = n;
+	pthread_mutex_init(&nc->lock, NULL);
+
+	spin_lock(&stats_cache_lock);
+	c = __stats_cache_find(n);
+	if (!c) {
+		list_add_tail(&nc->entry, &stats_cache_list);
+		c = nc;
+		nc = NULL;
+	}
+	spin_unlock(&stats_cache_lock);
+
+	if (nc) {
+		pthread_mutex_destroy(&nc->lock);
+		_free(nc);
+	}
+
+	return c;
+}
+
+/* Called when the last reference to 'n' is dropped, so no session
+ * of that net can be reading the cache anymore */
+void __export ap_session_stats_cache_free(struct ap_net *n)
+{
+	struct stats_cache *c;
+
+	spin_lock(&stats_cache_lock);
+	c = __stats_cache_find(n);
+	if (c)
+		list_del(&c->entry);
+	spin_unlock(&stats_cache_lock);
+
+	if (!c)
+		return;
+
+	if (c->items)
+		_free(c->items);
+	pthread_mutex_destroy(&c->lock);
+	_free(c);
+}
+
+struct stats_fill {
+	struct stats_cache_item *items;
+	int cnt;
+	int size;
+};
+
+static int stats_fill(int ifindex, const struct rtnl_link_stats *stats, void *arg)
+{
+	struct stats_fill *f = arg;
+	struct stats_cache_item *items;
+
+	if (f->cnt == f->size) {
+		items = _realloc(f->items, f->size * 2 * sizeof(*items));
+		if (!items)
+			return -1;
+		f->items = items;
+		f->size *= 2;
+	}
+
+	f->items[f->cnt].ifindex = ifindex;
+	memcpy(&f->items[f->cnt].stats, stats, sizeof(*stats));
+	f->cnt++;
+
+	return 0;
+}
+
+static void stats_cache_refresh(struct stats_cache *c)
+{
+	struct stats_fill f;
+	struct stats_cache_item *items;
+	uint64_t ts = stats_now();
+
+	f.cnt = 0;
+	f.size = c->size > 256 ? c->size : 256;
+	f.items = _malloc(f.size * sizeof(*f.items));
+
+	if (!f.items || iplink_stats_list(stats_fill, &f)) {
+		log_warn("failed to dump interface statistics\n");
+		if (f.items)
+			_free(f.items);
+		pthread_mutex_lock(&c->lock);
+		c->refreshing = 0;
+		pthread_mutex_unlock(&c->lock);
+		return;
+	}
+
+	qsort(f.items, f.cnt, sizeof(*f.items), stats_item_cmp);
+
+	pthread_mutex_lock(&c->lock);
+	items = c->items;
+	c->items = f.items;
+	c->cnt = f.cnt;
+	c->size = f.size;
+	c->ts = ts;
+	c->refreshing = 0;
+	pthread_mutex_unlock(&c->lock);
+
+	if (items)
+		_free(items);
+}
+
+/* Serve statistics from a per-net snapshot taken by one link dump.
+ * Snapshot older than the last reading of the session is never used,
+ * so counters stay monotonic and a reused ifindex can't leak values. */
+static int stats_cache_get(struct ap_session *ses, struct rtnl_link_stats *stats)
+{
+	struct stats_cache *c = stats_cache_find(net);
+	struct stats_cache_item key, *it;
+	uint64_t now = stats_now();
+	int refresh = 0, r = -1;
+
+	if (!c)
+		return -1;
+
+	pthread_mutex_lock(&c->lock);
+	if (!c->refreshing && now - c->refresh_ts >= conf_stats_cache_interval) {
+		c->refreshing = 1;
+		c->refresh_ts = now;
+		refresh = 1;
+	}
+	pthread_mutex_unlock(&c->lock);
+
+	if (refresh)
+		stats_cache_refresh(c);
+
+	pthread_mutex_lock(&c->lock);
+	if (c->items && c->ts >= ses->stats_ts) {
+		key.ifindex = ses->ifindex;
+		it = bsearch(&key, c->items, c->cnt, sizeof(*it), stats_item_cmp);
+		if (it) {
+			memcpy(stats, &it->stats, sizeof(*stats));
+			ses->stats_ts = c->ts;
+			r = 0;
+		}
+	}
+	pthread_mutex_unlock(&c->lock);
+
+	return r;
+}
+
+static int read_stats(struct ap_session *ses, struct rtnl_link_stats *stats, int cached)
 {
 	struct rtnl_link_stats lstats;
 
@@ -378,9 +647,13 @@ int __export ap_session_read_stats(struct ap_session *ses, struct rtnl_link_stat
 	if (!stats)
 		stats = &lstats;
 
-	if (iplink_get_stats(ses->ifindex, stats)) {
-		log_ppp_warn("failed to get interface statistics\n");
-		return -1;
+	if (!cached || !conf_stats_cache_interval || stats_cache_get(ses, stats)) {
+		if (iplink_get_stats(ses->ifindex, stats)) {
+			log_ppp_warn("failed to get interface statistics\n");
+			return -1;
+		}
+		if (conf_stats_cache_interval)
+			ses->stats_ts = stats_now();
 	}
 
 	stats->rx_packets -= ses->acct_rx_packets_i;
@@ -402,6 +675,11 @@ int __export ap_session_read_stats(struct ap_session *ses, struct rtnl_link_stat
 	return 0;
 }
 
+int __export ap_session_read_stats(struct ap_session *ses, struct rtnl_link_stats *stats)
+{
+	return read_stats(ses, stats, 1);
+}
+
 static void __terminate_sec(struct ap_session *ses)
 {
 	ap_session_terminate(ses, TERM_NAS_REQUEST, 0);
@@ -410,16 +688,23 @@ static void __terminate_sec(struct ap_session *ses)
 int __export ap_session_set_username(struct ap_session *s, char *username)
 {
 	struct ap_session *ses;
+	unsigned int h = user_hash_fn(username);
+	int reindex = s->user_entry.next != NULL;
 	int wait = 0;
 
-	pthread_rwlock_wrlock(&ses_lock);
+	if (reindex)
+		user_index_del(s);
+
+	pthread_mutex_lock(user_hash_lock(h));
 	if (conf_single_session >= 0) {
-		list_for_each_entry(ses, &ses_list, entry) {
-			if (ses->username && ses->terminate_cause != TERM_AUTH_ERROR && !(conf_single_session_ignore_case == 1 ? strcasecmp(ses->username, username) : strcmp(ses->username, username))) {
+		list_for_each_entry(ses, &user_hash[h], user_entry) {
+			if (ses->terminate_cause != TERM_AUTH_ERROR && !username_cmp(ses->username, username)) {
 				if (conf_single_session == 0) {
-					pthread_rwlock_unlock(&ses_lock);
+					pthread_mutex_unlock(user_hash_lock(h));
 					log_ppp_info1("%s: second session denied\n", username);
 					_free(username);
+					if (reindex)
+						user_index_add(s);
 					return -1;
 				} else {
 					if (!ses->wakeup) {
@@ -433,8 +718,14 @@ int __export ap_session_set_username(struct ap_session *s, char *username)
 			}
 		}
 	}
+
+	__sync_synchronize();
 	s->username = username;
-	pthread_rwlock_unlock(&ses_lock);
+
+	/* sessions not in ses_list yet are indexed by ap_session_starting() */
+	if (s->entry.next)
+		list_add_tail(&s->user_entry, &user_hash[h]);
+	pthread_mutex_unlock(user_hash_lock(h));
 
 	if (wait)
 		triton_context_schedule();
@@ -442,22 +733,45 @@ int __export ap_session_set_username(struct ap_session *s, char *username)
 	return 0;
 }
 
+/* Username of a session that failed authentication is indexed like
+ * others, but doesn't go through single-session checks */
+void __export ap_session_set_failed_username(struct ap_session *s, char *username)
+{
+	pthread_rwlock_wrlock(&ses_lock);
+	s->terminate_cause = TERM_AUTH_ERROR;
+	if (!username || s->username) {
+		pthread_rwlock_unlock(&ses_lock);
+		if (username)
+			_free(username);
+		return;
+	}
+	s->username = username;
+	pthread_rwlock_unlock(&ses_lock);
+
+	/* sessions not in ses_list yet are indexed by ap_session_starting() */
+	if (s->entry.next)
+		user_index_add(s);
+}
+
 int __export ap_check_username(const char *username)
 {
 	struct ap_session *ses;
+	unsigned int h;
 	int r = 0;
 
 	if (conf_single_session)
 		return 0;
 
-	pthread_rwlock_rdlock(&ses_lock);
-	list_for_each_entry(ses, &ses_list, entry) {
-		if (ses->username && !(conf_single_session_ignore_case == 1 ? strcasecmp(ses->username, username) : strcmp(ses->username, username))) {
+	h = user_hash_fn(username);
+
+	pthread_mutex_lock(user_hash_lock(h));
+	list_for_each_entry(ses, &user_hash[h], user_entry) {
+		if (!username_cmp(ses->username, username)) {
 			r = 1;
 			break;
 		}
 	}
-	pthread_rwlock_unlock(&ses_lock);
+	pthread_mutex_unlock(user_hash_lock(h));
 
 	return r;
 }
@@ -539,15 +853,29 @@ static void load_config(void)
 		conf_max_starting = atoi(opt);
 	else
 		conf_max_starting = 0;
+
+	opt = conf_get_opt("common", "stats-cache-interval");
+	if (opt && atoi(opt) > 0)
+		conf_stats_cache_interval = atoi(opt);
+	else
+		conf_stats_cache_interval = 0;
 }
 
 static void init(void)
 {
 	FILE *f;
+	int i;
 
 #if __WORDSIZE == 32
 	spinlock_init(&seq_lock);
 #endif
+	spinlock_init(&stats_cache_lock);
+
+	for (i = 0; i < USER_HASH_SIZE; i++)
+		INIT_LIST_HEAD(&user_hash[i]);
+
+	for (i = 0; i < USER_LOCK_CNT; i++)
+		pthread_mutex_init(&user_lock[i], NULL);
 
 	sock_fd = socket(AF_INET, SOCK_DGRAM, 0);
 	if (sock_fd < 0) {
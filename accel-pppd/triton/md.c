@@ -11,54 +11,97 @@
 
 extern int max_events;
 
-static int epoll_fd;
-static struct epoll_event *epoll_events;
+/*
+ * Handlers are spread round robin over md-thread-count pollers,
+ * each one running own epoll instance in own thread.
+ */
+struct _triton_md_poller_t
+{
+	int epoll_fd;
+	struct epoll_event *epoll_events;
+	pthread_t thr;
+
+	pthread_mutex_t freed_list_lock;
+	struct list_head freed_list;
+	struct list_head freed_list2;
+};
+
+static struct _triton_md_poller_t *pollers;
+static int poller_cnt = 1;
+static unsigned int poller_next;
 
-static pthread_t md_thr;
 static void *md_thread(void *arg);
 
 static mempool_t *md_pool;
 
-static pthread_mutex_t freed_list_lock = PTHREAD_MUTEX_INITIALIZER;
-static LIST_HEAD(freed_list);
-static LIST_HEAD(freed_list2);
-
 int md_init(void)
 {
-	epoll_fd = epoll_create(1);
-	if (epoll_fd < 0) {
-		perror("md:epoll_create");
-		return -1;
-	}
+	struct _triton_md_poller_t *p;
+	char *opt;
+	int i;
 
-	fcntl(epoll_fd, F_SETFD, O_CLOEXEC);
+	opt = conf_get_opt("core", "md-thread-count");
+	if (opt && atoi(opt) > 0)
+		poller_cnt = atoi(opt);
 
-	epoll_events = malloc(max_events * sizeof(struct epoll_event));
-	if (!epoll_events) {
+	pollers = malloc(poller_cnt * sizeof(*pollers));
+	if (!pollers) {
 		fprintf(stderr,"md:cann't allocate memory\n");
 		return -1;
 	}
 
+	for (i = 0; i < poller_cnt; i++) {
+		p = &pollers[i];
+
+		p->epoll_fd = epoll_create(1);
+		if (p->epoll_fd < 0) {
+			perror("md:epoll_create");
+			return -1;
+		}
+
+		fcntl(p->epoll_fd, F_SETFD, O_CLOEXEC);
+
+		p->epoll_events = malloc(max_events * sizeof(struct epoll_event));
+		if (!p->epoll_events) {
+			fprintf(stderr,"md:cann't allocate memory\n");
+			return -1;
+		}
+
+		pthread_mutex_init(&p->freed_list_lock, NULL);
+		INIT_LIST_HEAD(&p->freed_list);
+		INIT_LIST_HEAD(&p->freed_list2);
+	}
+
 	md_pool = mempool_create(sizeof(struct _triton_md_handler_t));
 
 	return 0;
 }
+
 void md_run(void)
 {
-	if (pthread_create(&md_thr, NULL, md_thread, NULL)) {
-		triton_log_error("md:pthread_create: %s", strerror(errno));
-		_exit(-1);
+	int i;
+
+	for (i = 0; i < poller_cnt; i++) {
+		if (pthread_create(&pollers[i].thr, NULL, md_thread, &pollers[i])) {
+			triton_log_error("md:pthread_create: %s", strerror(errno));
+			_exit(-1);
+		}
 	}
 }
 
 void md_terminate(void)
 {
-	pthread_cancel(md_thr);
-	pthread_join(md_thr, NULL);
+	int i;
+
+	for (i = 0; i < poller_cnt; i++) {
+		pthread_cancel(pollers[i].thr);
+		pthread_join(pollers[i].thr, NULL);
+	}
 }
 
 static void *md_thread(void *arg)
 {
+	struct _triton_md_poller_t *p = arg;
 	int i,n,r;
 	struct _triton_md_handler_t *h;
 	sigset_t set;
@@ -69,7 +112,7 @@ static void *md_thread(void *arg)
 	pthread_sigmask(SIG_BLOCK, &set, NULL);
 
 	while(1) {
-		n = epoll_wait(epoll_fd, epoll_events, max_events, -1);
+		n = epoll_wait(p->epoll_fd, p->epoll_events, max_events, -1);
 		if (n < 0) {
 			if (errno == EINTR)
 				continue;
@@ -78,12 +121,12 @@ static void *md_thread(void *arg)
 		}
 
 		for(i = 0; i < n; i++) {
-			h = (struct _triton_md_handler_t *)epoll_events[i].data.ptr;
+			h = (struct _triton_md_handler_t *)p->epoll_events[i].data.ptr;
 			if (!h->ud)
 				continue;
 			spin_lock(&h->ctx->lock);
 			if (h->ud) {
-				h->trig_epoll_events |= epoll_events[i].events;
+				h->trig_epoll_events |= p->epoll_events[i].events;
 				if (!h->pending) {
 					list_add_tail(&h->entry2, &h->ctx->pending_handlers);
 					h->pending = 1;
@@ -98,16 +141,16 @@ static void *md_thread(void *arg)
 				triton_thread_wakeup(h->ctx->thread);
 		}
 
-		while (!list_empty(&freed_list2)) {
-			h = list_entry(freed_list2.next, typeof(*h), entry);
+		while (!list_empty(&p->freed_list2)) {
+			h = list_entry(p->freed_list2.next, typeof(*h), entry);
 			list_del(&h->entry);
 			triton_context_release(h->ctx);
 			mempool_free(h);
 		}
 
-		pthread_mutex_lock(&freed_list_lock);
-		list_splice_init(&freed_list, &freed_list2);
-		pthread_mutex_unlock(&freed_list_lock);
+		pthread_mutex_lock(&p->freed_list_lock);
+		list_splice_init(&p->freed_list, &p->freed_list2);
+		pthread_mutex_unlock(&p->freed_list_lock);
 	}
 
 	return NULL;
@@ -119,6 +162,7 @@ void __export triton_md_register_handler(struct triton_context_t *ctx, struct tr
 	memset(h, 0, sizeof(*h));
 	h->ud = ud;
 	h->epoll_event.data.ptr = h;
+	h->poller = &pollers[__sync_fetch_and_add(&poller_next, 1) % poller_cnt];
 	if (ctx)
 		h->ctx = (struct _triton_context_t *)ctx->tpd;
 	else
@@ -152,9 +196,9 @@ void __export triton_md_unregister_handler(struct triton_md_handler_t *ud, int c
 	}
 	spin_unlock(&h->ctx->lock);
 
-	pthread_mutex_lock(&freed_list_lock);
-	list_add_tail(&h->entry, &freed_list);
-	pthread_mutex_unlock(&freed_list_lock);
+	pthread_mutex_lock(&h->poller->freed_list_lock);
+	list_add_tail(&h->entry, &h->poller->freed_list);
+	pthread_mutex_unlock(&h->poller->freed_list_lock);
 
 	ud->tpd = NULL;
 
@@ -182,13 +226,13 @@ int __export triton_md_enable_handler(struct triton_md_handler_t *ud, int mode)
 
 	if (events) {
 		if (h->armed)
-			r = epoll_ctl(epoll_fd, EPOLL_CTL_MOD, h->ud->fd, &h->epoll_event);
+			r = epoll_ctl(h->poller->epoll_fd, EPOLL_CTL_MOD, h->ud->fd, &h->epoll_event);
 		else {
 			h->mod = 1;
 			r = 0;
 		}
 	} else
-		r = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, h->ud->fd, &h->epoll_event);
+		r = epoll_ctl(h->poller->epoll_fd, EPOLL_CTL_ADD, h->ud->fd, &h->epoll_event);
 
 	if (r) {
 		triton_log_error("md:epoll_ctl: %s",strerror(errno));
@@ -220,14 +264,14 @@ int __export triton_md_disable_handler(struct triton_md_handler_t *ud,int mode)
 
 	if (h->epoll_event.events) {
 		if (h->armed)
-			r = epoll_ctl(epoll_fd, EPOLL_CTL_MOD, h->ud->fd, &h->epoll_event);
+			r = epoll_ctl(h->poller->epoll_fd, EPOLL_CTL_MOD, h->ud->fd, &h->epoll_event);
 		else {
 			h->mod = 1;
 			r = 0;
 		}
 	} else {
 		h->mod = 0;
-		r = epoll_ctl(epoll_fd, EPOLL_CTL_DEL, h->ud->fd, NULL);
+		r = epoll_ctl(h->poller->epoll_fd, EPOLL_CTL_DEL, h->ud->fd, NULL);
 	}
 
 	if (r) {
@@ -247,7 +291,7 @@ void __export triton_md_set_trig(struct triton_md_handler_t *ud, int mode)
 void md_rearm(struct _triton_md_handler_t *h)
 {
 	if (h->mod) {
-		epoll_ctl(epoll_fd, EPOLL_CTL_MOD, h->ud->fd, &h->epoll_event);
+		epoll_ctl(h->poller->epoll_fd, EPOLL_CTL_MOD, h->ud->fd, &h->epoll_event);
 		h->mod = 0;
 	}
 
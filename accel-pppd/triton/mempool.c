@@ -22,9 +22,18 @@
 
 static int conf_mempool_min = 128;
 
+/*
+ * Every thread keeps a small magazine of free items per pool, so
+ * most alloc/free calls don't touch the pool lock. Magazines are
+ * refilled from/flushed to the pool list by MAG_BATCH items.
+ */
+#define MAG_SIZE 32
+#define MAG_BATCH (MAG_SIZE / 2)
+
 struct _mempool_t
 {
 	struct list_head entry;
+	int id;
 	int size;
 	struct list_head items;
 #ifdef MEMDEBUG
@@ -34,6 +43,18 @@ struct _mempool_t
 	spinlock_t lock;
 	int mmap:1;
 	int objects;
+	struct list_head mags;
+};
+
+struct _mempool_mag_t
+{
+	struct list_head entry;
+	struct _mempool_t *pool;
+	int cnt;
+	int avail;
+	unsigned long alloc;
+	unsigned long hit;
+	struct _item_t *items[MAG_SIZE];
 };
 
 struct _item_t
@@ -54,6 +75,7 @@ struct _item_t
 
 static LIST_HEAD(pools);
 static spinlock_t pools_lock;
+static int pools_cnt;
 static spinlock_t mmap_lock;
 static void *mmap_ptr;
 static void *mmap_endptr;
@@ -67,6 +89,7 @@ mempool_t __export *mempool_create(int size)
 
 	memset(p, 0, sizeof(*p));
 	INIT_LIST_HEAD(&p->items);
+	INIT_LIST_HEAD(&p->mags);
 #ifdef MEMDEBUG
 	INIT_LIST_HEAD(&p->ditems);
 	p->magic = (uint64_t)random() * (uint64_t)random();
@@ -75,6 +98,7 @@ mempool_t __export *mempool_create(int size)
 	p->size = size;
 
 	spin_lock(&pools_lock);
+	p->id = pools_cnt++;
 	list_add_tail(&p->entry, &pools);
 	spin_unlock(&pools_lock);
 
@@ -91,12 +115,122 @@ mempool_t __export *mempool_create2(int size)
 }
 
 #ifndef MEMDEBUG
+static __thread struct _mempool_mag_t **mags;
+static __thread int mags_size;
+
+static struct _mempool_mag_t *mag_get(struct _mempool_t *p)
+{
+	struct _mempool_mag_t *m, **ptr;
+	int n;
+
+#if defined(VALGRIND) || defined(MEMPOOL_DISABLE)
+	return NULL;
+#endif
+
+	if (p->id < mags_size && mags[p->id])
+		return mags[p->id];
+
+	if (p->id >= mags_size) {
+		n = p->id + 16;
+		ptr = _realloc(mags, n * sizeof(*mags));
+		if (!ptr)
+			return NULL;
+		memset(ptr + mags_size, 0, (n - mags_size) * sizeof(*mags));
+		mags = ptr;
+		mags_size = n;
+	}
+
+	m = _malloc(sizeof(*m));
+	if (!m)
+		return NULL;
+
+	memset(m, 0, sizeof(*m));
+	m->pool = p;
+
+	spin_lock(&p->lock);
+	list_add_tail(&m->entry, &p->mags);
+	spin_unlock(&p->lock);
+
+	mags[p->id] = m;
+
+	return m;
+}
+
+static int mag_refill(struct _mempool_mag_t *m)
+{
+	struct _mempool_t *p = m->pool;
+	struct _item_t *it;
+
+	spin_lock(&p->lock);
+	while (m->cnt < MAG_BATCH && !list_empty(&p->items)) {
+		it = list_entry(p->items.next, typeof(*it), entry);
+		list_del(&it->entry);
+		m->items[m->cnt++] = it;
+		--p->objects;
+	}
+	spin_unlock(&p->lock);
+
+	if (m->avail) {
+		__sync_add_and_fetch(&triton_stat.mempool_available, m->avail);
+		m->avail = 0;
+	}
+
+	return m->cnt;
+}
+
+static void mag_flush(struct _mempool_mag_t *m)
+{
+	struct _mempool_t *p = m->pool;
+	struct _item_t *it;
+	uint32_t size = sizeof(*it) + p->size + 8;
+	int i, n = 0;
+
+	spin_lock(&p->lock);
+	for (i = 0; i < MAG_BATCH; i++) {
+		it = m->items[i];
+		if (p->mmap || p->objects < conf_mempool_min) {
+			++p->objects;
+			list_add_tail(&it->entry, &p->items);
+		} else
+			m->items[n++] = it;
+	}
+	spin_unlock(&p->lock);
+
+	for (i = 0; i < n; i++)
+		_free(m->items[i]);
+
+	if (n) {
+		__sync_sub_and_fetch(&triton_stat.mempool_allocated, n * size);
+		m->avail -= n * size;
+	}
+
+	memmove(m->items, m->items + MAG_BATCH, (MAG_SIZE - MAG_BATCH) * sizeof(*m->items));
+	m->cnt -= MAG_BATCH;
+
+	if (m->avail) {
+		__sync_add_and_fetch(&triton_stat.mempool_available, m->avail);
+		m->avail = 0;
+	}
+}
+
 void __export *mempool_alloc(mempool_t *pool)
 {
 	struct _mempool_t *p = (struct _mempool_t *)pool;
+	struct _mempool_mag_t *m = mag_get(p);
 	struct _item_t *it;
 	uint32_t size = sizeof(*it) + p->size + 8;
 
+	if (m) {
+		m->alloc++;
+		if (m->cnt)
+			m->hit++;
+		if (m->cnt || mag_refill(m)) {
+			it = m->items[--m->cnt];
+			m->avail -= size;
+			return it->ptr;
+		}
+	}
+
 	spin_lock(&p->lock);
 	if (!list_empty(&p->items)) {
 		it = list_entry(p->items.next, typeof(*it), entry);
@@ -113,8 +247,10 @@ void __export *mempool_alloc(mempool_t *pool)
 	if (p->mmap) {
 		spin_lock(&mmap_lock);
 		if (mmap_ptr + size >= mmap_endptr) {
-			if (mmap_grow())
+			if (mmap_grow()) {
+				spin_unlock(&mmap_lock);
 				return NULL;
+			}
 		}
 		it = (struct _item_t *)mmap_ptr;
 		mmap_ptr += size;
@@ -138,6 +274,7 @@ void __export mempool_free(void *ptr)
 {
 	struct _item_t *it = container_of(ptr, typeof(*it), ptr);
 	struct _mempool_t *p = it->owner;
+	struct _mempool_mag_t *m;
 	uint32_t size = sizeof(*it) + it->owner->size + 8;
 	int need_free = 0;
 
@@ -160,6 +297,15 @@ void __export mempool_free(void *ptr)
 	it->magic1 = 0;
 #endif
 
+	m = mag_get(p);
+	if (m) {
+		if (m->cnt == MAG_SIZE)
+			mag_flush(m);
+		m->items[m->cnt++] = it;
+		m->avail += size;
+		return;
+	}
+
 	spin_lock(&p->lock);
 #ifdef MEMDEBUG
 	list_del(&it->entry);
@@ -201,6 +347,55 @@ void __export *md_mempool_alloc(mempool_t *pool, const char *fname, int line)
 #endif
 
 
+/* Counters are copied under the locks, callbacks run without them,
+ * so that a slow consumer doesn't stall allocations */
+void __export mempool_walk_stat(void (*cb)(struct mempool_pool_stat_t *st, void *arg), void *arg)
+{
+	struct _mempool_t *p;
+	struct _mempool_mag_t *m;
+	struct mempool_pool_stat_t *st;
+	int i, n = 0, cnt = 0;
+
+	spin_lock(&pools_lock);
+	list_for_each_entry(p, &pools, entry)
+		n++;
+	spin_unlock(&pools_lock);
+
+	if (!n)
+		return;
+
+	st = _malloc(n * sizeof(*st));
+	if (!st)
+		return;
+
+	memset(st, 0, n * sizeof(*st));
+
+	spin_lock(&pools_lock);
+	list_for_each_entry(p, &pools, entry) {
+		if (cnt == n)
+			break;
+
+		st[cnt].size = p->size;
+
+		spin_lock(&p->lock);
+		st[cnt].objects = p->objects;
+		list_for_each_entry(m, &p->mags, entry) {
+			st[cnt].alloc += m->alloc;
+			st[cnt].hit += m->hit;
+			st[cnt].cached += m->cnt;
+		}
+		spin_unlock(&p->lock);
+
+		cnt++;
+	}
+	spin_unlock(&pools_lock);
+
+	for (i = 0; i < cnt; i++)
+		cb(&st[i], arg);
+
+	_free(st);
+}
+
 #ifdef MEMDEBUG
 void __export mempool_show(mempool_t *pool)
 {
@@ -9,10 +9,20 @@ struct mempool_stat_t
 	uint32_t available;
 };
 
+struct mempool_pool_stat_t
+{
+	int size;
+	int objects;
+	int cached;
+	unsigned long alloc;
+	unsigned long hit;
+};
+
 typedef void * mempool_t;
 mempool_t *mempool_create(int size);
 mempool_t *mempool_create2(int size);
 struct mempool_stat_t mempool_get_stat(void);
+void mempool_walk_stat(void (*cb)(struct mempool_pool_stat_t *st, void *arg), void *arg);
 
 #ifdef MEMDEBUG
 #include "memdebug.h"
@@ -31,8 +31,180 @@ static pthread_mutex_t freed_list_lock = PTHREAD_MUTEX_INITIALIZER;
 static LIST_HEAD(freed_list);
 static LIST_HEAD(freed_list2);
 
+/*
+ * Relative timers are kept in a hierarchical timing wheel driven by
+ * a single timerfd ticking every TIMER_TICK ms while the wheel is not
+ * empty. Absolute (CLOCK_REALTIME) timers still use own timerfd each
+ * to follow wall clock changes.
+ */
+#define TIMER_TICK 10
+#define WHEEL_BITS 8
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4
+#define WHEEL_MAX ((1ull << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+static spinlock_t wheel_lock;
+static struct list_head wheel[WHEEL_LEVELS][WHEEL_SIZE];
+static uint64_t wheel_now;
+static int wheel_cnt;
+static int wheel_fd;
+static struct timespec wheel_base;
+
+static uint64_t wheel_ticks(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((ts.tv_sec - wheel_base.tv_sec) * 1000000000ll + (ts.tv_nsec - wheel_base.tv_nsec)) / (TIMER_TICK * 1000000);
+}
+
+static void wheel_arm(int on)
+{
+	struct itimerspec ts = {
+		.it_value.tv_nsec = on ? TIMER_TICK * 1000000 : 0,
+		.it_interval.tv_nsec = on ? TIMER_TICK * 1000000 : 0,
+	};
+
+	if (timerfd_settime(wheel_fd, 0, &ts, NULL))
+		triton_log_error("timer:timerfd_settime: %s", strerror(errno));
+}
+
+static void wheel_insert(struct _triton_timer_t *t)
+{
+	uint64_t expires = t->expires;
+	uint64_t idx = expires - wheel_now;
+	struct list_head *head;
+
+	if ((int64_t)idx < 0)
+		head = &wheel[0][wheel_now & WHEEL_MASK];
+	else if (idx < 1ull << WHEEL_BITS)
+		head = &wheel[0][expires & WHEEL_MASK];
+	else if (idx < 1ull << (WHEEL_BITS * 2))
+		head = &wheel[1][(expires >> WHEEL_BITS) & WHEEL_MASK];
+	else if (idx < 1ull << (WHEEL_BITS * 3))
+		head = &wheel[2][(expires >> (WHEEL_BITS * 2)) & WHEEL_MASK];
+	else {
+		if (idx > WHEEL_MAX) {
+			expires = wheel_now + WHEEL_MAX;
+			t->expires = expires;
+		}
+		head = &wheel[3][(expires >> (WHEEL_BITS * 3)) & WHEEL_MASK];
+	}
+
+	list_add_tail(&t->wheel_entry, head);
+}
+
+static int wheel_cascade(int level, int idx)
+{
+	struct _triton_timer_t *t;
+	LIST_HEAD(list);
+
+	list_splice_init(&wheel[level][idx], &list);
+
+	while (!list_empty(&list)) {
+		t = list_entry(list.next, typeof(*t), wheel_entry);
+		list_del(&t->wheel_entry);
+		wheel_insert(t);
+	}
+
+	return idx;
+}
+
+static void wheel_add(struct _triton_timer_t *t, long long delay)
+{
+	uint64_t now = wheel_ticks();
+
+	/* the wheel is not advanced while idle */
+	if (!wheel_cnt)
+		wheel_now = now;
+
+	t->expires = now + (delay + TIMER_TICK - 1) / TIMER_TICK + 1;
+	wheel_insert(t);
+
+	if (wheel_cnt++ == 0)
+		wheel_arm(1);
+}
+
+static void wheel_remove(struct _triton_timer_t *t)
+{
+	if (list_empty(&t->wheel_entry))
+		return;
+
+	list_del_init(&t->wheel_entry);
+	wheel_cnt--;
+}
+
+static void timer_queue(struct _triton_timer_t *t)
+{
+	int r;
+
+	spin_lock(&t->ctx->lock);
+	if (t->ud) {
+		if (!t->pending) {
+			list_add_tail(&t->entry2, &t->ctx->pending_timers);
+			t->pending = 1;
+			__sync_add_and_fetch(&triton_stat.timer_pending, 1);
+			r = triton_queue_ctx(t->ctx);
+		} else
+			r = 0;
+	} else
+		r = 0;
+	spin_unlock(&t->ctx->lock);
+	if (r)
+		triton_thread_wakeup(t->ctx->thread);
+}
+
+static void wheel_run(void)
+{
+	struct _triton_timer_t *t;
+	uint64_t now = wheel_ticks();
+	LIST_HEAD(expired);
+	int idx;
+
+	spin_lock(&wheel_lock);
+	while (wheel_now <= now) {
+		idx = wheel_now & WHEEL_MASK;
+		if (!idx &&
+		    !wheel_cascade(1, (wheel_now >> WHEEL_BITS) & WHEEL_MASK) &&
+		    !wheel_cascade(2, (wheel_now >> (WHEEL_BITS * 2)) & WHEEL_MASK))
+			wheel_cascade(3, (wheel_now >> (WHEEL_BITS * 3)) & WHEEL_MASK);
+
+		list_splice_init(&wheel[0][idx], &expired);
+		wheel_now++;
+
+		while (!list_empty(&expired)) {
+			t = list_entry(expired.next, typeof(*t), wheel_entry);
+			list_del_init(&t->wheel_entry);
+
+			if (t->period) {
+				t->expires += t->period;
+				if (t->expires < wheel_now)
+					t->expires = wheel_now + t->period;
+				wheel_insert(t);
+			} else
+				wheel_cnt--;
+
+			spin_unlock(&wheel_lock);
+			timer_queue(t);
+			spin_lock(&wheel_lock);
+		}
+	}
+
+	if (!wheel_cnt)
+		wheel_arm(0);
+	spin_unlock(&wheel_lock);
+}
+
 int timer_init(void)
 {
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data.ptr = NULL,
+	};
+	int i, j;
+
 	epoll_fd = epoll_create(1);
 	if (epoll_fd < 0) {
 		perror("timer:epoll_create");
@@ -49,6 +221,27 @@ int timer_init(void)
 
 	timer_pool = mempool_create(sizeof(struct _triton_timer_t));
 
+	spinlock_init(&wheel_lock);
+	for (i = 0; i < WHEEL_LEVELS; i++)
+		for (j = 0; j < WHEEL_SIZE; j++)
+			INIT_LIST_HEAD(&wheel[i][j]);
+
+	clock_gettime(CLOCK_MONOTONIC, &wheel_base);
+
+	wheel_fd = timerfd_create(CLOCK_MONOTONIC, 0);
+	if (wheel_fd < 0) {
+		perror("timer:timerfd_create");
+		return -1;
+	}
+
+	fcntl(wheel_fd, F_SETFD, O_CLOEXEC);
+	fcntl(wheel_fd, F_SETFL, O_NONBLOCK);
+
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wheel_fd, &ev)) {
+		perror("timer:epoll_ctl");
+		return -1;
+	}
+
 	return 0;
 }
 
@@ -68,8 +261,9 @@ void timer_terminate(void)
 
 void *timer_thread(void *arg)
 {
-	int i,n,r;
+	int i,n;
 	struct _triton_timer_t *t;
+	uint64_t tt;
 	sigset_t set;
 
 	sigfillset(&set);
@@ -88,22 +282,14 @@ void *timer_thread(void *arg)
 
 		for(i = 0; i < n; i++) {
 			t = (struct _triton_timer_t *)epoll_events[i].data.ptr;
+			if (!t) {
+				read(wheel_fd, &tt, sizeof(tt));
+				wheel_run();
+				continue;
+			}
 			if (!t->ud)
 				continue;
-			spin_lock(&t->ctx->lock);
-			if (t->ud) {
-				if (!t->pending) {
-					list_add_tail(&t->entry2, &t->ctx->pending_timers);
-					t->pending = 1;
-					__sync_add_and_fetch(&triton_stat.timer_pending, 1);
-					r = triton_queue_ctx(t->ctx);
-				} else
-					r = 0;
-			} else
-				r = 0;
-			spin_unlock(&t->ctx->lock);
-			if (r)
-				triton_thread_wakeup(t->ctx->thread);
+			timer_queue(t);
 		}
 
 		while (!list_empty(&freed_list2)) {
@@ -128,22 +314,27 @@ int __export triton_timer_add(struct triton_context_t *ctx, struct triton_timer_
 
 	memset(t, 0, sizeof(*t));
 	t->ud = ud;
-	t->epoll_event.data.ptr = t;
-	t->epoll_event.events = EPOLLIN | EPOLLET;
+	t->fd = -1;
+	INIT_LIST_HEAD(&t->wheel_entry);
 	if (ctx)
 		t->ctx = (struct _triton_context_t *)ctx->tpd;
 	else
 		t->ctx = (struct _triton_context_t *)default_ctx.tpd;
-	t->fd = timerfd_create(abs_time ? CLOCK_REALTIME : CLOCK_MONOTONIC, 0);
-	if (t->fd < 0) {
-		triton_log_error("timer:timerfd_create: %s", strerror(errno));
-		mempool_free(t);
-		return -1;
-	}
 
-	if (fcntl(t->fd, F_SETFL, O_NONBLOCK)) {
-		triton_log_error("timer: failed to set nonblocking mode: %s", strerror(errno));
-		goto out_err;
+	if (abs_time) {
+		t->epoll_event.data.ptr = t;
+		t->epoll_event.events = EPOLLIN | EPOLLET;
+		t->fd = timerfd_create(CLOCK_REALTIME, 0);
+		if (t->fd < 0) {
+			triton_log_error("timer:timerfd_create: %s", strerror(errno));
+			mempool_free(t);
+			return -1;
+		}
+
+		if (fcntl(t->fd, F_SETFL, O_NONBLOCK)) {
+			triton_log_error("timer: failed to set nonblocking mode: %s", strerror(errno));
+			goto out_err;
+		}
 	}
 
 	__sync_add_and_fetch(&t->ctx->refs, 1);
@@ -156,7 +347,7 @@ int __export triton_timer_add(struct triton_context_t *ctx, struct triton_timer_
 	list_add_tail(&t->entry, &t->ctx->timers);
 	spin_unlock(&t->ctx->lock);
 
-	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, t->fd, &t->epoll_event)) {
+	if (t->fd != -1 && epoll_ctl(epoll_fd, EPOLL_CTL_ADD, t->fd, &t->epoll_event)) {
 		triton_log_error("timer:epoll_ctl: %s", strerror(errno));
 		spin_lock(&t->ctx->lock);
 		t->ud = NULL;
@@ -171,10 +362,12 @@ int __export triton_timer_add(struct triton_context_t *ctx, struct triton_timer_
 
 out_err:
 	ud->tpd = NULL;
-	close(t->fd);
+	if (t->fd != -1)
+		close(t->fd);
 	mempool_free(t);
 	return -1;
 }
+
 int __export triton_timer_mod(struct triton_timer_t *ud,int abs_time)
 {
 	struct _triton_timer_t *t = (struct _triton_timer_t *)ud->tpd;
@@ -184,22 +377,47 @@ int __export triton_timer_mod(struct triton_timer_t *ud,int abs_time)
 		.it_interval.tv_sec = ud->period / 1000,
 		.it_interval.tv_nsec = (ud->period % 1000) * 1000,
 	};
+	long long delay;
 
 	if (ud->expire_tv.tv_sec == 0 && ud->expire_tv.tv_usec == 0)
 		ts.it_value = ts.it_interval;
 
-	if (timerfd_settime(t->fd, abs_time ? TFD_TIMER_ABSTIME : 0, &ts, NULL)) {
-		triton_log_error("timer:timerfd_settime: %s", strerror(errno));
-		return -1;
+	if (t->fd != -1) {
+		if (timerfd_settime(t->fd, abs_time ? TFD_TIMER_ABSTIME : 0, &ts, NULL)) {
+			triton_log_error("timer:timerfd_settime: %s", strerror(errno));
+			return -1;
+		}
+
+		return 0;
+	}
+
+	if (ud->expire_tv.tv_sec == 0 && ud->expire_tv.tv_usec == 0)
+		delay = ud->period;
+	else
+		delay = (long long)ud->expire_tv.tv_sec * 1000 + (ud->expire_tv.tv_usec + 999) / 1000;
+
+	spin_lock(&wheel_lock);
+	wheel_remove(t);
+	if (delay) {
+		t->period = (ud->period + TIMER_TICK - 1) / TIMER_TICK;
+		wheel_add(t, delay);
 	}
+	spin_unlock(&wheel_lock);
 
 	return 0;
 }
+
 void __export triton_timer_del(struct triton_timer_t *ud)
 {
 	struct _triton_timer_t *t = (struct _triton_timer_t *)ud->tpd;
 
-	close(t->fd);
+	if (t->fd != -1)
+		close(t->fd);
+	else {
+		spin_lock(&wheel_lock);
+		wheel_remove(t);
+		spin_unlock(&wheel_lock);
+	}
 
 	spin_lock(&t->ctx->lock);
 	t->ud = NULL;
@@ -218,4 +436,3 @@ void __export triton_timer_del(struct triton_timer_t *ud)
 
 	__sync_sub_and_fetch(&triton_stat.timer_count, 1);
 }
-
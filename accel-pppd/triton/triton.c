@@ -9,6 +9,7 @@
 #include <ucontext.h>
 #include <setjmp.h>
 #include <sys/resource.h>
+#include <sys/eventfd.h>
 
 #include "triton_p.h"
 #include "memdebug.h"
@@ -21,7 +22,21 @@ int max_events = 64;
 static spinlock_t threads_lock;
 static LIST_HEAD(threads);
 static LIST_HEAD(sleep_threads);
-
+static int sleep_cnt;
+
+/*
+ * Every worker owns a run queue, contexts are queued to the queue of
+ * the worker that triggered them (or round robin from md/timer
+ * threads) and idle workers steal from the others. threads_lock only
+ * protects the idle list, sched_lock serializes context sleep/wakeup.
+ */
+static struct _triton_thread_t **workers;
+static int worker_cnt;
+static unsigned int worker_next;
+static spinlock_t sched_lock;
+static __thread struct _triton_thread_t *this_thread;
+
+/* contexts queued before workers are started */
 static struct list_head ctx_queue[CTX_PRIO_MAX];
 
 static spinlock_t ctx_list_lock;
@@ -59,8 +74,10 @@ static __thread void *thread_frame;
 
 void triton_thread_wakeup(struct _triton_thread_t *thread)
 {
+	uint64_t v = 1;
+
 	log_debug2("wake up thread %p\n", thread);
-	pthread_kill(thread->thread, SIGUSR1);
+	write(thread->wakeup_fd, &v, sizeof(v));
 }
 
 static void __config_reload(void (*notify)(int))
@@ -82,21 +99,69 @@ static void __config_reload(void (*notify)(int))
 
 static void ctx_thread(struct _triton_context_t *ctx);
 
-static int check_ctx_queue_empty(struct _triton_thread_t *t)
+static int rq_pop(struct _triton_thread_t *t, struct _triton_thread_t *thread)
 {
+	struct _triton_context_t *ctx;
 	int i;
 
+	if (!t->queue_cnt && (t != thread || !t->wakeup_cnt))
+		return 0;
+
+	spin_lock(&t->lock);
 	for (i = 0; i < CTX_PRIO_MAX; i++) {
-		if (!list_empty(&t->wakeup_list[i])) {
-			t->ctx = list_entry(t->wakeup_list[i].next, struct _triton_context_t, entry2);
-			return 1;
+		if (t == thread && !list_empty(&t->wakeup_list[i])) {
+			ctx = list_entry(t->wakeup_list[i].next, typeof(*ctx), entry2);
+			list_del(&ctx->entry2);
+			__sync_sub_and_fetch(&t->wakeup_cnt, 1);
+			spin_unlock(&t->lock);
+			thread->ctx = ctx;
+			return 2;
 		}
 
-		if (!list_empty(&ctx_queue[i])) {
-			t->ctx = list_entry(ctx_queue[i].next, struct _triton_context_t, entry2);
+		if (!list_empty(&t->queue[i])) {
+			ctx = list_entry(t->queue[i].next, typeof(*ctx), entry2);
+			list_del(&ctx->entry2);
+			__sync_sub_and_fetch(&t->queue_cnt, 1);
+			spin_unlock(&t->lock);
+			thread->ctx = ctx;
 			return 1;
 		}
 	}
+	spin_unlock(&t->lock);
+
+	return 0;
+}
+
+static int check_ctx_queue_empty(struct _triton_thread_t *thread)
+{
+	int i, r;
+
+	r = rq_pop(thread, thread);
+	if (r)
+		return r;
+
+	for (i = 1; i < worker_cnt; i++) {
+		r = rq_pop(workers[(thread->id + i) % worker_cnt], thread);
+		if (r) {
+			__sync_add_and_fetch(&triton_stat.context_stolen, 1);
+			return r;
+		}
+	}
+
+	return 0;
+}
+
+static int has_work(struct _triton_thread_t *thread)
+{
+	int i;
+
+	if (thread->wakeup_cnt)
+		return 1;
+
+	for (i = 0; i < worker_cnt; i++) {
+		if (workers[i]->queue_cnt)
+			return 1;
+	}
 
 	return 0;
 }
@@ -104,7 +169,8 @@ static int check_ctx_queue_empty(struct _triton_thread_t *t)
 static void* triton_thread(struct _triton_thread_t *thread)
 {
 	sigset_t set;
-	int sig, need_free;
+	int r, need_free;
+	uint64_t v;
 	void *stack;
 
 	sigfillset(&set);
@@ -113,22 +179,16 @@ static void* triton_thread(struct _triton_thread_t *thread)
 	sigdelset(&set, SIGSEGV);
 	pthread_sigmask(SIG_BLOCK, &set, NULL);
 
-	sigemptyset(&set);
-	sigaddset(&set, SIGUSR1);
-	sigaddset(&set, SIGQUIT);
-
 	thread_frame = __builtin_frame_address(0);
+	this_thread = thread;
 
 	pthread_mutex_lock(&thread->sleep_lock);
 	pthread_mutex_unlock(&thread->sleep_lock);
 
 	while (1) {
-		spin_lock(&threads_lock);
-		if (!need_config_reload && check_ctx_queue_empty(thread)) {
-			if (thread->ctx->asleep && thread->ctx->wakeup) {
+		if (!need_config_reload && (r = check_ctx_queue_empty(thread))) {
+			if (r == 2) {
 				log_debug2("thread: %p: wakeup ctx %p\n", thread, thread->ctx);
-				list_del(&thread->ctx->entry2);
-				spin_unlock(&threads_lock);
 
 				this_ctx = thread->ctx->ud;
 				if (this_ctx->before_switch)
@@ -142,17 +202,21 @@ static void* triton_thread(struct _triton_thread_t *thread)
 				abort();
 			} else {
 				log_debug2("thread: %p: dequeued ctx %p\n", thread, thread->ctx);
-				list_del(&thread->ctx->entry2);
+				spin_lock(&thread->ctx->lock);
 				thread->ctx->thread = thread;
 				thread->ctx->queued = 0;
-				spin_unlock(&threads_lock);
+				spin_unlock(&thread->ctx->lock);
 				__sync_sub_and_fetch(&triton_stat.context_pending, 1);
 			}
 		} else {
 			log_debug2("thread: %p: sleeping\n", thread);
 
-			if (!terminate)
+			spin_lock(&threads_lock);
+			if (!terminate) {
 				list_add(&thread->entry2, &sleep_threads);
+				thread->sleeping = 1;
+				__sync_add_and_fetch(&sleep_cnt, 1);
+			}
 
 			if (__sync_sub_and_fetch(&triton_stat.thread_active, 1) == 0 && need_config_reload) {
 				spin_unlock(&threads_lock);
@@ -167,18 +231,22 @@ static void* triton_thread(struct _triton_thread_t *thread)
 				return NULL;
 			}
 
-			//printf("thread %p: enter sigwait\n", thread);
-			sigwait(&set, &sig);
-			//printf("thread %p: exit sigwait\n", thread);
+			/* contexts queued before we became visible as idle */
+			if (need_config_reload || !has_work(thread)) {
+				while (read(thread->wakeup_fd, &v, sizeof(v)) < 0 && errno == EINTR);
+			}
 
 			spin_lock(&threads_lock);
 			__sync_add_and_fetch(&triton_stat.thread_active, 1);
-			if (!thread->ctx) {
+			if (thread->sleeping) {
 				list_del(&thread->entry2);
-				spin_unlock(&threads_lock);
-				continue;
+				thread->sleeping = 0;
+				__sync_sub_and_fetch(&sleep_cnt, 1);
 			}
 			spin_unlock(&threads_lock);
+
+			if (!thread->ctx)
+				continue;
 		}
 
 		if (setjmp(jmp_env) == 0) {
@@ -192,15 +260,15 @@ static void* triton_thread(struct _triton_thread_t *thread)
 				ctx_thread(thread->ctx);
 				log_debug2("thread %p: switch from %p %p\n", thread, thread->ctx, thread->ctx->thread);
 
-				spin_lock(&threads_lock);
+				spin_lock(&thread->ctx->lock);
 				if (!thread->ctx->pending || thread->ctx->need_free)
 					break;
-				spin_unlock(&threads_lock);
+				spin_unlock(&thread->ctx->lock);
 			}
 
 			thread->ctx->thread = NULL;
 			need_free = thread->ctx->need_free;
-			spin_unlock(&threads_lock);
+			spin_unlock(&thread->ctx->lock);
 
 			if (need_free) {
 				log_debug2("- context %p removed\n", thread->ctx);
@@ -229,7 +297,8 @@ static void ctx_thread(struct _triton_context_t *ctx)
 			t->pending = 0;
 			spin_unlock(&ctx->lock);
 			__sync_sub_and_fetch(&triton_stat.timer_pending, 1);
-			read(t->fd, &tt, sizeof(tt));
+			if (t->fd != -1)
+				read(t->fd, &tt, sizeof(tt));
 			if (t->ud)
 				t->ud->expire(t->ud);
 			continue;
@@ -307,8 +376,19 @@ struct _triton_thread_t *create_thread()
 
 	memset(thread, 0, sizeof(*thread));
 
-	for (i = 0; i < CTX_PRIO_MAX; i++)
+	for (i = 0; i < CTX_PRIO_MAX; i++) {
 		INIT_LIST_HEAD(&thread->wakeup_list[i]);
+		INIT_LIST_HEAD(&thread->queue[i]);
+	}
+
+	spinlock_init(&thread->lock);
+
+	thread->wakeup_fd = eventfd(0, EFD_CLOEXEC);
+	if (thread->wakeup_fd < 0) {
+		triton_log_error("eventfd: %s", strerror(errno));
+		_free(thread);
+		return NULL;
+	}
 
 	pthread_mutex_init(&thread->sleep_lock, NULL);
 	pthread_mutex_lock(&thread->sleep_lock);
@@ -325,31 +405,91 @@ struct _triton_thread_t *create_thread()
 	return thread;
 }
 
-int triton_queue_ctx(struct _triton_context_t *ctx)
+static void rq_push(struct _triton_context_t *ctx)
+{
+	struct _triton_thread_t *t = this_thread;
+
+	if (!worker_cnt) {
+		spin_lock(&threads_lock);
+		if (!worker_cnt) {
+			list_add_tail(&ctx->entry2, &ctx_queue[ctx->priority]);
+			ctx->queued = 1;
+			spin_unlock(&threads_lock);
+			__sync_add_and_fetch(&triton_stat.context_pending, 1);
+			return;
+		}
+		spin_unlock(&threads_lock);
+	}
+
+	if (!t)
+		t = workers[__sync_fetch_and_add(&worker_next, 1) % worker_cnt];
+
+	spin_lock(&t->lock);
+	list_add_tail(&ctx->entry2, &t->queue[ctx->priority]);
+	ctx->queued = 1;
+	__sync_add_and_fetch(&t->queue_cnt, 1);
+	spin_unlock(&t->lock);
+
+	log_debug2("ctx %p: queued to thread %p\n", ctx, t);
+	__sync_add_and_fetch(&triton_stat.context_pending, 1);
+}
+
+static struct _triton_thread_t *pop_sleeper(void)
 {
+	struct _triton_thread_t *t = NULL;
+
 	spin_lock(&threads_lock);
+	if (!list_empty(&sleep_threads)) {
+		t = list_entry(sleep_threads.next, typeof(*t), entry2);
+		list_del(&t->entry2);
+		t->sleeping = 0;
+		__sync_sub_and_fetch(&sleep_cnt, 1);
+	}
+	spin_unlock(&threads_lock);
+
+	return t;
+}
+
+/* must be called with ctx->lock held */
+int triton_queue_ctx(struct _triton_context_t *ctx)
+{
+	struct _triton_thread_t *t;
+
 	ctx->pending = 1;
-	if (ctx->thread || ctx->entry2.next || ctx->need_free) {
-		spin_unlock(&threads_lock);
+	if (ctx->thread || ctx->queued || ctx->need_free)
+		return 0;
+
+	if (ctx->init || need_config_reload) {
+		rq_push(ctx);
 		return 0;
 	}
 
-	if (list_empty(&sleep_threads) || ctx->init || need_config_reload) {
-		list_add_tail(&ctx->entry2, &ctx_queue[ctx->priority]);
+	if (sleep_cnt) {
+		spin_lock(&threads_lock);
+		if (!list_empty(&sleep_threads)) {
+			t = list_entry(sleep_threads.next, typeof(*t), entry2);
+			list_del(&t->entry2);
+			t->sleeping = 0;
+			__sync_sub_and_fetch(&sleep_cnt, 1);
+			ctx->thread = t;
+			t->ctx = ctx;
+			spin_unlock(&threads_lock);
+			log_debug2("ctx %p: assigned to thread %p\n", ctx, t);
+			return 1;
+		}
 		spin_unlock(&threads_lock);
-		ctx->queued = 1;
-		log_debug2("ctx %p: queued\n", ctx);
-		__sync_add_and_fetch(&triton_stat.context_pending, 1);
-		return 0;
 	}
 
-	ctx->thread = list_entry(sleep_threads.next, typeof(*ctx->thread), entry2);
-	ctx->thread->ctx = ctx;
-	log_debug2("ctx %p: assigned to thread %p\n", ctx, ctx->thread);
-	list_del(&ctx->thread->entry2);
-	spin_unlock(&threads_lock);
+	rq_push(ctx);
 
-	return 1;
+	/* let an idle worker steal it */
+	if (sleep_cnt) {
+		t = pop_sleeper();
+		if (t)
+			triton_thread_wakeup(t);
+	}
+
+	return 0;
 }
 
 void triton_context_release(struct _triton_context_t *ctx)
@@ -501,11 +641,11 @@ void __export triton_context_schedule()
 
 	ctx = (struct _triton_context_t *)this_ctx->tpd;
 
-	spin_lock(&threads_lock);
+	spin_lock(&sched_lock);
 	if (ctx->wakeup) {
 		ctx->asleep = 0;
 		ctx->wakeup = 0;
-		spin_unlock(&threads_lock);
+		spin_unlock(&sched_lock);
 		_free(ctx->uc);
 		ctx->uc = NULL;
 		__sync_sub_and_fetch(&triton_stat.context_sleeping, 1);
@@ -513,7 +653,7 @@ void __export triton_context_schedule()
 	} else {
 		ctx->asleep = 1;
 		ctx->thread->ctx = NULL;
-		spin_unlock(&threads_lock);
+		spin_unlock(&sched_lock);
 		longjmp(jmp_env, 1);
 	}
 }
@@ -533,7 +673,7 @@ void __export triton_context_wakeup(struct triton_context_t *ud)
 			r = triton_queue_ctx(ctx);
 		spin_unlock(&ctx->lock);
 	} else {
-		spin_lock(&threads_lock);
+		spin_lock(&sched_lock);
 		/* In some cases (pppd_compat.c), triton_context_wakeup() might
 		 * be called before triton_context_schedule(). When that
 		 * happens, we must not add 'ctx' to the wakeup_list as it is
@@ -544,10 +684,13 @@ void __export triton_context_wakeup(struct triton_context_t *ud)
 		 */
 		ctx->wakeup = 1;
 		if (ctx->asleep) {
+			spin_lock(&ctx->thread->lock);
 			list_add_tail(&ctx->entry2, &ctx->thread->wakeup_list[ctx->priority]);
-			r = ctx->thread->ctx == NULL;
+			__sync_add_and_fetch(&ctx->thread->wakeup_cnt, 1);
+			spin_unlock(&ctx->thread->lock);
+			r = 1;
 		}
-		spin_unlock(&threads_lock);
+		spin_unlock(&sched_lock);
 	}
 
 	if (r)
@@ -599,6 +742,28 @@ void __export triton_cancel_call(struct triton_context_t *ud, void (*func)(void
 	}
 }
 
+int __export triton_cancel_call_arg(struct triton_context_t *ud, void (*func)(void *), void *arg)
+{
+	struct _triton_context_t *ctx = ud ? (struct _triton_context_t *)ud->tpd : (struct _triton_context_t *)default_ctx.tpd;
+	struct _triton_ctx_call_t *call;
+	int r = -1;
+
+	spin_lock(&ctx->lock);
+	list_for_each_entry(call, &ctx->pending_calls, entry) {
+		if (call->func == func && call->arg == arg) {
+			list_del(&call->entry);
+			r = 0;
+			break;
+		}
+	}
+	spin_unlock(&ctx->lock);
+
+	if (!r)
+		mempool_free(call);
+
+	return r;
+}
+
 void __export triton_collect_cpu_usage(void)
 {
 	struct rusage rusage;
@@ -663,6 +828,7 @@ int __export triton_init(const char *conf_file)
 	int i;
 
 	spinlock_init(&threads_lock);
+	spinlock_init(&sched_lock);
 	spinlock_init(&ctx_list_lock);
 
 	ctx_pool = mempool_create(sizeof(struct _triton_context_t));
@@ -723,6 +889,7 @@ void __export triton_conf_reload(void (*notify)(int))
 void __export triton_run()
 {
 	struct _triton_thread_t *t;
+	struct _triton_context_t *ctx;
 	int i;
 	char *opt;
 	struct timespec ts;
@@ -739,15 +906,32 @@ void __export triton_run()
 		}
 	}
 
+	workers = _malloc(thread_count * sizeof(*workers));
+
 	for(i = 0; i < thread_count; i++) {
 		t = create_thread();
 		if (!t)
 			_exit(-1);
 
+		t->id = i;
+		workers[i] = t;
 		list_add_tail(&t->entry, &threads);
-		pthread_mutex_unlock(&t->sleep_lock);
 	}
 
+	spin_lock(&threads_lock);
+	for (i = 0; i < CTX_PRIO_MAX; i++) {
+		while (!list_empty(&ctx_queue[i])) {
+			ctx = list_entry(ctx_queue[i].next, typeof(*ctx), entry2);
+			list_move_tail(&ctx->entry2, &workers[0]->queue[i]);
+			workers[0]->queue_cnt++;
+		}
+	}
+	worker_cnt = thread_count;
+	spin_unlock(&threads_lock);
+
+	list_for_each_entry(t, &threads, entry)
+		pthread_mutex_unlock(&t->sleep_lock);
+
 	clock_gettime(CLOCK_MONOTONIC, &ts);
 	triton_stat.start_time = ts.tv_sec;
 
@@ -62,6 +62,7 @@ struct triton_stat_t
 	unsigned int context_count;
 	unsigned int context_sleeping;
 	unsigned int context_pending;
+	unsigned int context_stolen;
 	unsigned int md_handler_count;
 	unsigned int md_handler_pending;
 	unsigned int timer_count;
@@ -78,6 +79,7 @@ void triton_context_schedule(void);
 void triton_context_wakeup(struct triton_context_t *);
 int triton_context_call(struct triton_context_t *, void (*func)(void *), void *arg);
 void triton_cancel_call(struct triton_context_t *, void (*func)(void *));
+int triton_cancel_call_arg(struct triton_context_t *, void (*func)(void *), void *arg);
 struct triton_context_t *triton_context_self(void);
 
 #define MD_MODE_READ 1
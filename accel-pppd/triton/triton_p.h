@@ -17,9 +17,16 @@ struct _triton_thread_t
 	struct list_head entry;
 	struct list_head entry2;
 	pthread_t thread;
+	int id;
 	int terminate;
+	int sleeping;
+	int wakeup_fd;
 	struct _triton_context_t *ctx;
 	pthread_mutex_t sleep_lock;
+	spinlock_t lock;
+	int queue_cnt;
+	int wakeup_cnt;
+	struct list_head queue[CTX_PRIO_MAX];
 	struct list_head wakeup_list[CTX_PRIO_MAX];
 };
 
@@ -53,6 +60,8 @@ struct _triton_context_t
 	void *bf_arg;
 };
 
+struct _triton_md_poller_t;
+
 struct _triton_md_handler_t
 {
 	struct list_head entry;
@@ -64,6 +73,7 @@ struct _triton_md_handler_t
 	int trig_level:1;
 	int armed:1;
 	int mod:1;
+	struct _triton_md_poller_t *poller;
 	struct triton_md_handler_t *ud;
 };
 
@@ -71,10 +81,13 @@ struct _triton_timer_t
 {
 	struct list_head entry;
 	struct list_head entry2;
+	struct list_head wheel_entry;
 	struct epoll_event epoll_event;
 	struct _triton_context_t *ctx;
 	int fd;
 	int pending:1;
+	uint64_t expires;
+	unsigned int period;
 	struct triton_timer_t *ud;
 };
 